@@ -6,4 +6,7 @@ echo
 echo
 echo
 date
-gcc src/main.c -O3 -o bin/cwig.out && time bin/cwig.out
+gcc -c src/main.c -O3 -fPIC -fvisibility=hidden -DCWIG_LIBRARY -o bin/cwig.o \
+    && ar rcs bin/libcwig.a bin/cwig.o \
+    && gcc -shared bin/cwig.o -pthread -lm -o bin/libcwig.so
+gcc src/main.c -O3 -pthread -lm -o bin/cwig.out && time bin/cwig.out
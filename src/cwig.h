@@ -0,0 +1,119 @@
+#ifndef CWIG_H
+#define CWIG_H
+
+/* cwig as a library. Build src/main.c with -DCWIG_LIBRARY to leave out
+ * main(); run.bash builds bin/libcwig.a and bin/libcwig.so that way.
+ *
+ * An Engine holds all the state of a search: its move buffers, its
+ * transposition and pawn hash tables, its NNUE accumulators and its
+ * counters. Engines are independent, so several can be used at once from
+ * different threads, but one engine must only be used by one thread at a
+ * time. Values are in centipawns from white's point of view; being mated
+ * in n half-moves from the root is worth -(32000 - n) to the side that is
+ * mated. Functions returning int return 0 on success and -1 on failure. */
+
+#include <stddef.h>
+
+#if defined(CWIG_LIBRARY) && defined(__GNUC__)
+#define CWIG_API __attribute__((visibility("default")))
+#else
+#define CWIG_API
+#endif
+
+typedef struct Engine Engine;
+
+/* What an iterative deepening search has found so far. */
+typedef struct EngineProgress {
+    /* The depth just completed, in half-moves. */
+    int ply;
+    int score;
+    /* As from engine_pv; only valid during the call. */
+    const char *pv;
+    int n_pos_explored;
+    double seconds;
+    /* Positions explored per second. */
+    double nps;
+} EngineProgress;
+
+typedef void (*EngineProgressFn)(const EngineProgress *progress, void *data);
+
+typedef struct EngineLimits {
+    /* Search depth in half-moves. */
+    int ply;
+    /* The number of best moves to find values and lines for. */
+    int multi_pv;
+    /* Whether to search 1, 2, ... ply deep in turn, with aspiration
+     * windows. */
+    int iterative_deepening;
+    /* Selective techniques and extensions as for solve -s, e.g. "nlfrc",
+     * or NULL. */
+    const char *selectivity;
+    /* If positive, the search stops after this many seconds, as if
+     * engine_stop had been called. */
+    double max_seconds;
+    /* If not NULL, called with progress_data on the searching thread after
+     * each depth of an iterative deepening search. */
+    EngineProgressFn progress;
+    void *progress_data;
+} EngineLimits;
+
+/* Counted over all the searches of the engine. */
+typedef struct EngineStats {
+    int n_pos_explored;
+    int n_pawn_hash_hits;
+    int n_pawn_hash_misses;
+    int n_tablebase_hits;
+} EngineStats;
+
+/* NULL if memory runs out. */
+CWIG_API Engine *engine_create(void);
+CWIG_API void engine_destroy(Engine *engine);
+
+/* Evaluate with the network file at path instead of the hand-written
+ * evaluation. */
+CWIG_API int engine_load_network(Engine *engine, const char *path);
+
+/* Returns -1 if a search is running or fen is malformed or not a legal
+ * position, e.g. one without exactly one king a side or with the side not
+ * to move in check. */
+CWIG_API int engine_set_position(Engine *engine, const char *fen);
+
+/* Search the position set; returns the number of lines found, which is
+ * less than limits->multi_pv if there are fewer legal moves, or -1. A
+ * search stopped by engine_stop returns the lines of the last depth
+ * completed, so none unless it is an iterative deepening one. */
+CWIG_API int engine_search(Engine *engine, const EngineLimits *limits);
+
+/* As engine_search, but on a new thread; engine_wait returns what
+ * engine_search would have. Until then the engine may only be passed to
+ * engine_stop and engine_wait. */
+CWIG_API int engine_start_search(Engine *engine, const EngineLimits *limits);
+
+/* Ask a search of engine to stop soon. It is safe to call from any thread,
+ * at any time. */
+CWIG_API void engine_stop(Engine *engine);
+
+CWIG_API int engine_wait(Engine *engine);
+
+/* Start searching, as engine_start_search does, the position after the
+ * best line of the last search has gone two half-moves on: the move to
+ * play and the reply expected to it. The position is set to that one.
+ * Searching it until the opponent replies warms the transposition table
+ * for the search that follows, which is quick if the reply was the
+ * expected one. Returns -1 if the last search found no such line. */
+CWIG_API int engine_start_ponder(Engine *engine, const EngineLimits *limits);
+
+/* The value of the index-th best line of the last search. */
+CWIG_API int engine_score(Engine *engine, int index);
+
+/* Write the index-th best line of the last search in SAN, e.g.
+ * "1.Qd5+ Ka6  2.cxb8=N#", to buf, truncated to size bytes. */
+CWIG_API int engine_pv(Engine *engine, int index, char *buf, size_t size);
+
+/* Write the first move of the best line of the last search in SAN, e.g.
+ * "Qd5+", to buf, truncated to size bytes. */
+CWIG_API int engine_best_move(Engine *engine, char *buf, size_t size);
+
+CWIG_API void engine_stats(Engine *engine, EngineStats *stats);
+
+#endif
@@ -1,13 +1,36 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cwig.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 /* TODO: join move lists when doing quiescence search */
 
-#define MOVE_BUFFER_N_MOVES ( 100 * 1000 * 50 * 30 )
-#define MOVE_LIST_NODE_BUFFER_N_MOVE_LIST_NODES ( 50 * 1000 * 50 )
-#define EVAL_RESULT_ARRAY_BUFFER_N ( 50 * 1000 * 50 * 10 )
+#define MAX_SEARCH_PLY 128
+/* More than the legal moves of any position. */
+#define MAX_POSITION_MOVES 256
+/* A search only holds the moves of the nodes along its current line, and
+ * the tools a few positions more around it. */
+#define MOVE_BUFFER_N_MOVES ( 4 * MAX_SEARCH_PLY * MAX_POSITION_MOVES )
+#define EVAL_RESULT_ARRAY_BUFFER_N ( 8 * MAX_POSITION_MOVES )
 
 #define PRINT_EVAL_AT_PLY_DIAGNOSTICS 0
 
@@ -38,17 +61,27 @@
 #define Q_BLACK ( COLOR_BLACK | UNCOLORED_QUEEN )
 #define K_BLACK ( COLOR_BLACK | UNCOLORED_KING )
 
-#define CASTLING_BLACK_KINGSIDE     0b1000;
-#define CASTLING_BLACK_QUEENSIDE    0b0100;
-#define CASTLING_WHITE_KINGSIDE     0b0010;
-#define CASTLING_WHITE_QUEENSIDE    0b0001;
+#define CASTLING_BLACK_KINGSIDE     0b1000
+#define CASTLING_BLACK_QUEENSIDE    0b0100
+#define CASTLING_WHITE_KINGSIDE     0b0010
+#define CASTLING_WHITE_QUEENSIDE    0b0001
 
 #define N_FILES 8
 #define N_RANKS 8
 
-#define CHECKMATE_VAL 99999999
+#define FEN_MAX_LEN 100
+
+/* Longest text of one move in a line: move number, SAN and spacing. */
+#define MOVE_TEXT_MAX_LEN 24
+
+/* Values are in centipawns from white's point of view. Being mated at
+ * distance n half-moves from the root of the search is worth
+ * -(CHECKMATE_VAL - n) to the side that is mated, so shorter mates are
+ * preferred. All values fit in 16 bits. */
+#define CHECKMATE_VAL 32000
+#define VAL_INFINITY 32001
+#define MATE_VAL_MIN ( CHECKMATE_VAL - MAX_SEARCH_PLY )
 
-int n_pos_explored = 0;
 
 typedef char Piece;
 typedef char Castling;
@@ -56,8 +89,9 @@ typedef char Direction;
 typedef char File;
 typedef char Rank;
 typedef char Color;
-typedef float Ply;
-typedef double Val;
+/* Search depths and distances are in half-moves. */
+typedef int Ply;
+typedef int Val;
 
 typedef struct {
     File f;
@@ -111,61 +145,114 @@ int move_eq(Move a, Move b) {
     return sq_eq(a.from, b.from) && sq_eq(a.to, b.to);
 }
 
-typedef struct MoveListNode {
-    Move move;
-    struct MoveListNode *rest;
-} MoveListNode;
-
-Move move_buffer_start[MOVE_BUFFER_N_MOVES];
-Move *move_buffer_end = move_buffer_start + MOVE_BUFFER_N_MOVES;
-Move *move_buffer_current = move_buffer_start;
-
-MoveListNode move_list_node_buffer_start[MOVE_LIST_NODE_BUFFER_N_MOVE_LIST_NODES];
-MoveListNode *move_list_node_buffer_end = 
-    move_list_node_buffer_start + MOVE_LIST_NODE_BUFFER_N_MOVE_LIST_NODES;
-MoveListNode *move_list_node_buffer_current = move_list_node_buffer_start;
+typedef struct MoveLine {
+    int len;
+    Move moves[MAX_SEARCH_PLY];
+} MoveLine;
 
+/* The result of searching one root move, with the line leading to it. */
 typedef struct {
     Val val;
-    MoveListNode *moves;
+    MoveLine line;
 } EvalResult;
 
-EvalResult eval_result_array_buffer_start[EVAL_RESULT_ARRAY_BUFFER_N];
-EvalResult *eval_result_array_buffer_end =
-    eval_result_array_buffer_start + EVAL_RESULT_ARRAY_BUFFER_N;
-EvalResult *eval_result_array_buffer_current = eval_result_array_buffer_start;
-
 enum PruneStrategyType {
     PruneStrategyTypeNoPruning,
     PruneStrategyTypePruneLowValChanges,
     PruneStrategyTypePruneLowVals,
 };
 
+/* Selective search techniques, combined as bit flags in
+ * PruneStrategy.selectivity. Without any of them the search is exact. The
+ * extensions search forcing moves a half-move deeper than the others, so
+ * that mates just beyond the nominal depth are found. */
+enum Selectivity {
+    SelectivityNullMove = 1,
+    SelectivityLateMoveReductions = 2,
+    SelectivityFutility = 4,
+    SelectivityRazoring = 8,
+    SelectivityCheckExtension = 16,
+    SelectivityOneReplyExtension = 32,
+    SelectivitySingularExtension = 64,
+};
+
+#define SELECTIVITY_EXTENSIONS ( SelectivityCheckExtension \
+        | SelectivityOneReplyExtension | SelectivitySingularExtension )
+
+#define NULL_MOVE_REDUCTION 2
+/* The reduced search must see at least one move of the side that passed,
+ * or mate threats go unnoticed. */
+#define NULL_MOVE_MIN_PLY ( NULL_MOVE_REDUCTION + 2 )
+/* Late quiet moves are scouted this many plies shallower than the other
+ * moves, i.e. at ply - 1 - LATE_MOVE_REDUCTION. */
+#define LATE_MOVE_REDUCTION 1
+#define LATE_MOVE_REDUCTION_MIN_PLY 3
+#define LATE_MOVE_REDUCTION_MIN_MOVES 3
+#define FUTILITY_MAX_PLY 2
+#define ASPIRATION_MIN_PLY 3
+#define ASPIRATION_WINDOW 50
+#define ASPIRATION_MAX_WINDOW 1000
+#define RAZORING_MAX_PLY 2
+/* A move is singular if the TT says it reaches some value and no other
+ * move comes within SINGULAR_MARGIN of it in a search of half the depth.
+ * The TT entry may be up to SINGULAR_TT_PLY_MARGIN shallower than the
+ * node. */
+#define SINGULAR_MIN_PLY 4
+#define SINGULAR_MARGIN 50
+#define SINGULAR_TT_PLY_MARGIN 3
+/* A search with a deadline looks at the clock once in this many nodes. */
+#define TIME_CHECK_N_NODES 1024
+
+/* Indexed by remaining ply. */
+int futility_margins[FUTILITY_MAX_PLY + 1] = { 0, 200, 500 };
+int razoring_margins[RAZORING_MAX_PLY + 1] = { 0, 300, 600 };
+
 typedef struct PruneStrategy {
     int type;
     Ply initial_ply;
     Val cutoff;
+    int selectivity;
 } PruneStrategy;
 
 void explore_position(Pos *pos);
 int is_king_in_check(Pos *pos);
 int is_king_in_checkmate(Pos *pos);
 int is_king_in_stalemate(Pos *pos);
+int gives_check(Pos *next_pos);
 void print_move(Move move, Pos *pos);
+uint16_t pack_move(Move move);
+Move unpack_move(uint16_t packed, Color color);
+uint64_t position_key(Pos *pos);
+uint64_t pawn_key(Pos *pos);
+void put_le(unsigned char *buf, uint64_t v, int n_bytes);
+uint64_t get_le(unsigned char *buf, int n_bytes);
+int probe_tablebases(Pos *pos, int height, Val *val);
+void tablebase_line(Pos *pos, MoveLine *line, int max_len);
+void format_move_line(MoveLine *line, Pos *pos_in, char *result);
+double seconds_now();
+void strip_line_end(char *line);
 EvalResult *position_val_at_ply(
     Pos *pos,
     Ply ply,
     PruneStrategy *prune_strat,
-    int do_quiescence_search
+    int do_quiescence_search,
+    int multi_pv
 );
 
-int positions_allocated = 0;
 
 Sq make_sq(File f, Rank r) {
     Sq sq = { .f = f, .r = r };
     return sq;
 }
 
+int sq_index(Sq sq) {
+    return sq.r * N_FILES + sq.f;
+}
+
+Sq index_to_sq(int index) {
+    return make_sq(index % N_FILES, index / N_FILES);
+}
+
 struct Pos {
     char is_explored;
     Piece placement[N_FILES][N_RANKS];
@@ -181,19 +268,95 @@ struct Pos {
     int moves_len;
 };
 
+/* Everything a search changes. Code works on the engine ctx points to,
+ * which is per thread: the command-line tools use default_engine
+ * throughout, and a program using cwig as a library creates an engine per
+ * independent search and has it bound to the calling thread for the
+ * duration of each call (see engine_create in cwig.h). What is only read
+ * while searching, like the Zobrist keys, the SIMD kernels, the evaluation
+ * weights and the tablebases, is shared. */
+struct Engine {
+    Move *move_buffer_start;
+    Move *move_buffer_end;
+    Move *move_buffer_current;
+    EvalResult *eval_result_array_buffer_start;
+    EvalResult *eval_result_array_buffer_end;
+    EvalResult *eval_result_array_buffer_current;
+    /* Triangular principal variation table. pv_table[height] holds the best
+     * line found so far from the node at distance height from the root.
+     * Rows are only written when a move improves on the best so far, by
+     * copying the child's row behind the move. */
+    MoveLine pv_table[MAX_SEARCH_PLY + 1];
+    /* is_null_move_line[height] is 1 if the node at height was reached by
+     * a null move, so that two null moves are never made in a row. */
+    char is_null_move_line[MAX_SEARCH_PLY + 1];
+    /* line_extensions[height] is the number of extensions on the line to
+     * the node at height. A line is extended at most root_ply times, the
+     * depth of the search, so it never goes more than twice as deep. */
+    int line_extensions[MAX_SEARCH_PLY + 1];
+    Ply root_ply;
+    /* Allocated on first use, see tt_entry. */
+    struct TTEntry *tt;
+    uint64_t tt_n_entries;
+    /* PAWN_HASH_N_ENTRIES entries. They start with key 0, which is the key
+     * of positions without pawns, whose pawn structure is worth 0. */
+    struct PawnHashEntry *pawn_hash;
+    /* The network that replaces tapered_static_val, if any, its hash for
+     * the evaluation cache, and the NNUE accumulators by height; the last
+     * one is for positions outside the search. */
+    struct NnueNetwork *nnue_network;
+    uint64_t nnue_key;
+    struct NnueAccumulator *nnue_stack;
+    uint64_t book_rng_state;
+    int use_generic_move_generator;
+    int n_pos_explored;
+    int positions_made;
+    int positions_allocated;
+    int n_pawn_hash_hits;
+    int n_pawn_hash_misses;
+    int n_tablebase_hits;
+    /* For the library interface: the position set, and the position and
+     * results of the last search from it. */
+    char fen[FEN_MAX_LEN];
+    Pos root;
+    EvalResult *results;
+    int n_results;
+    /* Set from any thread to stop the search. Nodes return at once when it
+     * is set; is_interrupted then records that values are no longer to be
+     * trusted, and so not stored in the transposition table. */
+    _Atomic int stop;
+    int is_interrupted;
+    /* The time at which the search stops itself, if not 0. The clock is
+     * only read every TIME_CHECK_N_NODES nodes. */
+    double deadline;
+    int nodes_until_time_check;
+    EngineProgressFn progress;
+    void *progress_data;
+    double search_start_time;
+    int search_start_n_pos_explored;
+    /* The search running on search_thread, if is_searching. */
+    pthread_t search_thread;
+    int is_searching;
+    EngineLimits thread_limits;
+    char thread_selectivity[16];
+    int thread_n_results;
+};
+
+Engine default_engine;
+_Thread_local Engine *ctx = &default_engine;
+
 PruneStrategy prune_strat_no_pruning ={
     .type = PruneStrategyTypeNoPruning
 };
 PruneStrategy prune_strat_prune_low_val_changes = {
     .type = PruneStrategyTypePruneLowValChanges,
-    .cutoff = 1.0,
+    .cutoff = 100,
 };
 PruneStrategy prune_strat_prune_low_vals = {
     .type = PruneStrategyTypePruneLowVals,
-    .cutoff = 1.0,
+    .cutoff = 100,
 };
 
-int positions_made = 0;
 
 void init_position(Pos *p) {
     p->is_explored = 0;
@@ -205,9 +368,9 @@ void init_position(Pos *p) {
     p->is_king_in_check = -2;
     p->is_king_in_checkmate = -2;
     p->is_king_in_stalemate = -2;
-    p->p_moves = move_buffer_current;
+    p->p_moves = ctx->move_buffer_current;
     p->moves_len = 0;
-    positions_made += 1;
+    ctx->positions_made += 1;
 }
 
 void set_piece_at_sq(Pos *pos, Sq sq, Piece piece) {
@@ -218,21 +381,21 @@ Piece get_piece_at_sq(Pos *pos, Sq sq) {
     return pos->placement[sq.f][sq.r];
 }
 
+/* Material by uncolored piece, as used by the search for move ordering and
+ * pruning. Both kings are always on the board, so they are worth nothing.
+ * The static evaluation has its own, tunable, material weights. */
+Val piece_vals[8] = {
+    [UNCOLORED_PAWN] = 100,
+    [UNCOLORED_ROOK] = 500,
+    [UNCOLORED_KNIGHT] = 300,
+    [UNCOLORED_BISHOP] = 300,
+    [UNCOLORED_QUEEN] = 900,
+};
+
 Val piece_val(Piece piece) {
-    Val v;
-    if (piece == P_WHITE) { v = 1; }
-    else if (piece == R_WHITE) { v = 5; }
-    else if (piece == N_WHITE) { v = 3; }
-    else if (piece == B_WHITE) { v = 3; }
-    else if (piece == Q_WHITE) { v = 9; }
-    else if (piece == K_WHITE) { v = 9999; }
-    else if (piece == P_BLACK) { v = -1; }
-    else if (piece == R_BLACK) { v = -5; }
-    else if (piece == N_BLACK) { v = -3; }
-    else if (piece == B_BLACK) { v = -3; }
-    else if (piece == Q_BLACK) { v = -9; }
-    else if (piece == K_BLACK) { v = -9999; }
-    return v;
+    /* From white's point of view; 0 for PIECE_EMPTY. */
+    Val v = piece_vals[piece & 0b111];
+    return (piece & COLOR_BLACK) == COLOR_BLACK ? -v : v;
 }
 
 File algf_to_f(char algf) {
@@ -370,13 +533,13 @@ Pos decode_fen(char *fen_string) {
             }
         } else if (state == 2) {
             if (c == 'K') {
-                p.castling |= CASTLING_BLACK_KINGSIDE;
+                p.castling |= CASTLING_WHITE_KINGSIDE;
             } else if (c == 'Q') {
-                p.castling |= CASTLING_BLACK_QUEENSIDE;
+                p.castling |= CASTLING_WHITE_QUEENSIDE;
             } else if (c == 'k') {
-                p.castling |= CASTLING_WHITE_KINGSIDE;
+                p.castling |= CASTLING_BLACK_KINGSIDE;
             } else if (c == 'q') {
-                p.castling |= CASTLING_WHITE_QUEENSIDE;
+                p.castling |= CASTLING_BLACK_QUEENSIDE;
             } else if (c == '-') {
                 ;
             }
@@ -394,10 +557,71 @@ Pos decode_fen(char *fen_string) {
             p.fullmoves += (c - 48);
         }
     }
-    explore_position(&p);
     return p;
 }
 
+char piece_to_fen_char(Piece piece) {
+    if (piece == P_WHITE) { return 'P'; }
+    else if (piece == R_WHITE) { return 'R'; }
+    else if (piece == N_WHITE) { return 'N'; }
+    else if (piece == B_WHITE) { return 'B'; }
+    else if (piece == Q_WHITE) { return 'Q'; }
+    else if (piece == K_WHITE) { return 'K'; }
+    else if (piece == P_BLACK) { return 'p'; }
+    else if (piece == R_BLACK) { return 'r'; }
+    else if (piece == N_BLACK) { return 'n'; }
+    else if (piece == B_BLACK) { return 'b'; }
+    else if (piece == Q_BLACK) { return 'q'; }
+    else if (piece == K_BLACK) { return 'k'; }
+    return '?';
+}
+
+void encode_fen(Pos *pos, char *result) {
+    /* The inverse of decode_fen. result must have room for at least
+     * FEN_MAX_LEN characters. */
+    int i = 0;
+    for (int r = N_RANKS - 1; r >= 0; r--) {
+        int n_empty = 0;
+        for (int f = 0; f < N_FILES; f++) {
+            Piece found = get_piece_at_sq(pos, make_sq(f, r));
+            if (found == PIECE_EMPTY) {
+                n_empty++;
+            } else {
+                if (n_empty > 0) {
+                    result[i++] = '0' + n_empty;
+                    n_empty = 0;
+                }
+                result[i++] = piece_to_fen_char(found);
+            }
+        }
+        if (n_empty > 0) {
+            result[i++] = '0' + n_empty;
+        }
+        if (r > 0) {
+            result[i++] = '/';
+        }
+    }
+    result[i++] = ' ';
+    result[i++] = pos->active_color == COLOR_WHITE ? 'w' : 'b';
+    result[i++] = ' ';
+    if (pos->castling == 0) {
+        result[i++] = '-';
+    } else {
+        if (pos->castling & CASTLING_WHITE_KINGSIDE) { result[i++] = 'K'; }
+        if (pos->castling & CASTLING_WHITE_QUEENSIDE) { result[i++] = 'Q'; }
+        if (pos->castling & CASTLING_BLACK_KINGSIDE) { result[i++] = 'k'; }
+        if (pos->castling & CASTLING_BLACK_QUEENSIDE) { result[i++] = 'q'; }
+    }
+    result[i++] = ' ';
+    if (pos->en_passant.f == 0 && pos->en_passant.r == 0) {
+        result[i++] = '-';
+    } else {
+        sq_to_algsq(pos->en_passant, result + i);
+        i += 2;
+    }
+    sprintf(result + i, " %d %d", pos->halfmoves, pos->fullmoves);
+}
+
 Color piece_color(Piece piece) {
     return 0b11000 & piece;
 }
@@ -503,7 +727,286 @@ void print_placement(Pos *pos) {
     printf("\n");
 }
 
-void append_legal_moves_for_piece(Pos* pos, Sq sq0, Piece piece) {
+/* Scans of the 64 placement bytes of a position. The bytes are laid out by
+ * file and then by rank, so bit f * N_RANKS + r of the masks below stands
+ * for square (f, r), see placement_bit_to_sq; this is not the sq_index
+ * order. Each scan has a scalar version and, on x86, SSE2 and AVX2 ones
+ * that compare 16 or 32 bytes at a time; init_simd_kernels picks the best
+ * one the CPU supports. */
+
+Sq placement_bit_to_sq(int bit) {
+    return make_sq(bit / N_RANKS, bit % N_RANKS);
+}
+
+uint64_t placement_piece_mask_scalar(Pos *pos, Piece piece) {
+    /* The squares holding piece, which may be PIECE_EMPTY. */
+    const Piece *bytes = &pos->placement[0][0];
+    uint64_t mask = 0;
+    for (int i = 0; i < N_FILES * N_RANKS; i++) {
+        mask |= (uint64_t) (bytes[i] == piece) << i;
+    }
+    return mask;
+}
+
+uint64_t placement_color_mask_scalar(Pos *pos, Color color) {
+    /* The squares holding a piece of color. */
+    const Piece *bytes = &pos->placement[0][0];
+    uint64_t mask = 0;
+    for (int i = 0; i < N_FILES * N_RANKS; i++) {
+        mask |= (uint64_t) (piece_color(bytes[i]) == color) << i;
+    }
+    return mask;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define HAVE_X86_SIMD_KERNELS 1
+
+__attribute__((target("sse2")))
+uint64_t placement_piece_mask_sse2(Pos *pos, Piece piece) {
+    const Piece *bytes = &pos->placement[0][0];
+    __m128i needle = _mm_set1_epi8(piece);
+    uint64_t mask = 0;
+    for (int i = 0; i < 4; i++) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (bytes + 16 * i));
+        mask |= (uint64_t) (uint16_t)
+                    _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle)) << (16 * i);
+    }
+    return mask;
+}
+
+__attribute__((target("sse2")))
+uint64_t placement_color_mask_sse2(Pos *pos, Color color) {
+    const Piece *bytes = &pos->placement[0][0];
+    __m128i color_bits = _mm_set1_epi8(0b11000);
+    __m128i needle = _mm_set1_epi8(color);
+    uint64_t mask = 0;
+    for (int i = 0; i < 4; i++) {
+        __m128i v = _mm_and_si128(color_bits,
+                    _mm_loadu_si128((const __m128i *) (bytes + 16 * i)));
+        mask |= (uint64_t) (uint16_t)
+                    _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle)) << (16 * i);
+    }
+    return mask;
+}
+
+__attribute__((target("avx2")))
+uint64_t placement_piece_mask_avx2(Pos *pos, Piece piece) {
+    const Piece *bytes = &pos->placement[0][0];
+    __m256i needle = _mm256_set1_epi8(piece);
+    __m256i lo = _mm256_loadu_si256((const __m256i *) bytes);
+    __m256i hi = _mm256_loadu_si256((const __m256i *) (bytes + 32));
+    return (uint64_t) (uint32_t)
+                _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, needle))
+        | (uint64_t) (uint32_t)
+                _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, needle)) << 32;
+}
+
+__attribute__((target("avx2")))
+uint64_t placement_color_mask_avx2(Pos *pos, Color color) {
+    const Piece *bytes = &pos->placement[0][0];
+    __m256i color_bits = _mm256_set1_epi8(0b11000);
+    __m256i needle = _mm256_set1_epi8(color);
+    __m256i lo = _mm256_and_si256(color_bits,
+                        _mm256_loadu_si256((const __m256i *) bytes));
+    __m256i hi = _mm256_and_si256(color_bits,
+                        _mm256_loadu_si256((const __m256i *) (bytes + 32)));
+    return (uint64_t) (uint32_t)
+                _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, needle))
+        | (uint64_t) (uint32_t)
+                _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, needle)) << 32;
+}
+
+#endif
+
+/* The kernels of the NNUE evaluation (see nnue_static_val): adding a
+ * column of first-layer weights to an accumulator or subtracting it, and
+ * the output layer, the dot product of the accumulators, clipped to
+ * [0, NNUE_QA], with the output weights. They have the same three versions
+ * as the scans above. */
+
+#define NNUE_N_FEATURES ( 2 * 6 * N_FILES * N_RANKS )
+#define NNUE_N_HIDDEN 128
+#define NNUE_QA 255
+#define NNUE_QB 64
+#define NNUE_SCALE 400
+
+void nnue_add_scalar(int16_t *acc, const int16_t *column) {
+    for (int i = 0; i < NNUE_N_HIDDEN; i++) {
+        acc[i] += column[i];
+    }
+}
+
+void nnue_sub_scalar(int16_t *acc, const int16_t *column) {
+    for (int i = 0; i < NNUE_N_HIDDEN; i++) {
+        acc[i] -= column[i];
+    }
+}
+
+int32_t nnue_output_scalar(
+    const int16_t *us, const int16_t *them, const int16_t *weights
+) {
+    /* weights holds the side to move's NNUE_N_HIDDEN weights, then the
+     * opponent's. */
+    int32_t sum = 0;
+    for (int i = 0; i < NNUE_N_HIDDEN; i++) {
+        int a = us[i] < 0 ? 0 : us[i] > NNUE_QA ? NNUE_QA : us[i];
+        int b = them[i] < 0 ? 0 : them[i] > NNUE_QA ? NNUE_QA : them[i];
+        sum += a * weights[i] + b * weights[NNUE_N_HIDDEN + i];
+    }
+    return sum;
+}
+
+#ifdef HAVE_X86_SIMD_KERNELS
+
+__attribute__((target("sse2")))
+void nnue_add_sse2(int16_t *acc, const int16_t *column) {
+    for (int i = 0; i < NNUE_N_HIDDEN; i += 8) {
+        __m128i *p = (__m128i *) (acc + i);
+        _mm_storeu_si128(p, _mm_add_epi16(_mm_loadu_si128(p),
+                            _mm_loadu_si128((const __m128i *) (column + i))));
+    }
+}
+
+__attribute__((target("sse2")))
+void nnue_sub_sse2(int16_t *acc, const int16_t *column) {
+    for (int i = 0; i < NNUE_N_HIDDEN; i += 8) {
+        __m128i *p = (__m128i *) (acc + i);
+        _mm_storeu_si128(p, _mm_sub_epi16(_mm_loadu_si128(p),
+                            _mm_loadu_si128((const __m128i *) (column + i))));
+    }
+}
+
+__attribute__((target("sse2")))
+int32_t nnue_output_sse2(
+    const int16_t *us, const int16_t *them, const int16_t *weights
+) {
+    __m128i zero = _mm_setzero_si128();
+    __m128i qa = _mm_set1_epi16(NNUE_QA);
+    __m128i sum = zero;
+    for (int i = 0; i < NNUE_N_HIDDEN; i += 8) {
+        __m128i a = _mm_min_epi16(qa, _mm_max_epi16(zero,
+                            _mm_loadu_si128((const __m128i *) (us + i))));
+        __m128i b = _mm_min_epi16(qa, _mm_max_epi16(zero,
+                            _mm_loadu_si128((const __m128i *) (them + i))));
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(a,
+                        _mm_loadu_si128((const __m128i *) (weights + i))));
+        sum = _mm_add_epi32(sum, _mm_madd_epi16(b, _mm_loadu_si128(
+                    (const __m128i *) (weights + NNUE_N_HIDDEN + i))));
+    }
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4e));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xb1));
+    return _mm_cvtsi128_si32(sum);
+}
+
+__attribute__((target("avx2")))
+void nnue_add_avx2(int16_t *acc, const int16_t *column) {
+    for (int i = 0; i < NNUE_N_HIDDEN; i += 16) {
+        __m256i *p = (__m256i *) (acc + i);
+        _mm256_storeu_si256(p, _mm256_add_epi16(_mm256_loadu_si256(p),
+                        _mm256_loadu_si256((const __m256i *) (column + i))));
+    }
+}
+
+__attribute__((target("avx2")))
+void nnue_sub_avx2(int16_t *acc, const int16_t *column) {
+    for (int i = 0; i < NNUE_N_HIDDEN; i += 16) {
+        __m256i *p = (__m256i *) (acc + i);
+        _mm256_storeu_si256(p, _mm256_sub_epi16(_mm256_loadu_si256(p),
+                        _mm256_loadu_si256((const __m256i *) (column + i))));
+    }
+}
+
+__attribute__((target("avx2")))
+int32_t nnue_output_avx2(
+    const int16_t *us, const int16_t *them, const int16_t *weights
+) {
+    __m256i zero = _mm256_setzero_si256();
+    __m256i qa = _mm256_set1_epi16(NNUE_QA);
+    __m256i sum = zero;
+    for (int i = 0; i < NNUE_N_HIDDEN; i += 16) {
+        __m256i a = _mm256_min_epi16(qa, _mm256_max_epi16(zero,
+                        _mm256_loadu_si256((const __m256i *) (us + i))));
+        __m256i b = _mm256_min_epi16(qa, _mm256_max_epi16(zero,
+                        _mm256_loadu_si256((const __m256i *) (them + i))));
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(a,
+                    _mm256_loadu_si256((const __m256i *) (weights + i))));
+        sum = _mm256_add_epi32(sum, _mm256_madd_epi16(b, _mm256_loadu_si256(
+                    (const __m256i *) (weights + NNUE_N_HIDDEN + i))));
+    }
+    __m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum),
+                                            _mm256_extracti128_si256(sum, 1));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4e));
+    half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xb1));
+    return _mm_cvtsi128_si32(half);
+}
+
+#endif
+
+uint64_t (*placement_piece_mask)(Pos *pos, Piece piece) =
+                                                placement_piece_mask_scalar;
+uint64_t (*placement_color_mask)(Pos *pos, Color color) =
+                                                placement_color_mask_scalar;
+void (*nnue_add)(int16_t *acc, const int16_t *column) = nnue_add_scalar;
+void (*nnue_sub)(int16_t *acc, const int16_t *column) = nnue_sub_scalar;
+int32_t (*nnue_output)(const int16_t *us, const int16_t *them,
+                                const int16_t *weights) = nnue_output_scalar;
+const char *simd_kernel = "scalar";
+
+void init_simd_kernels(const char *kernel) {
+    /* Use the named kernel ("scalar", "sse2" or "avx2") if the CPU has it,
+     * or the best one it has if kernel is NULL. Returns with the scalar
+     * kernel if the named one is not available. */
+    placement_piece_mask = placement_piece_mask_scalar;
+    placement_color_mask = placement_color_mask_scalar;
+    nnue_add = nnue_add_scalar;
+    nnue_sub = nnue_sub_scalar;
+    nnue_output = nnue_output_scalar;
+    simd_kernel = "scalar";
+#ifdef HAVE_X86_SIMD_KERNELS
+    __builtin_cpu_init();
+    if (
+        __builtin_cpu_supports("avx2")
+        && (kernel == NULL || strcmp(kernel, "avx2") == 0)
+    ) {
+        placement_piece_mask = placement_piece_mask_avx2;
+        placement_color_mask = placement_color_mask_avx2;
+        nnue_add = nnue_add_avx2;
+        nnue_sub = nnue_sub_avx2;
+        nnue_output = nnue_output_avx2;
+        simd_kernel = "avx2";
+    } else if (
+        __builtin_cpu_supports("sse2")
+        && (kernel == NULL || strcmp(kernel, "sse2") == 0)
+    ) {
+        placement_piece_mask = placement_piece_mask_sse2;
+        placement_color_mask = placement_color_mask_sse2;
+        nnue_add = nnue_add_sse2;
+        nnue_sub = nnue_sub_sse2;
+        nnue_output = nnue_output_sse2;
+        simd_kernel = "sse2";
+    }
+#endif
+}
+
+/* Which moves the generator appends. Promotions count as captures, so
+ * that the quiescence search sees them. */
+enum MoveKind {
+    MoveKindCaptures = 1,
+    MoveKindQuiets = 2,
+    MoveKindAll = 3,
+};
+
+#define ALL_SQUARES ( ~(uint64_t) 0 )
+
+void append_legal_moves_for_piece_generic(
+    Pos* pos, Sq sq0, Piece piece, int kinds, uint64_t targets
+) {
+    /* Append the legal moves of the piece on sq0 of the given kinds (see
+     * MoveKind). Unless the piece is the king, only moves to squares in
+     * targets, a mask by sq_index, are appended; see evasion_targets.
+     * This is the reference for the specialised generators below and is
+     * only used when use_generic_move_generator is set. */
     Color own_color = piece_color(piece);
 
     ApplyDirFn *dir_fns;
@@ -591,8 +1094,15 @@ void append_legal_moves_for_piece(Pos* pos, Sq sq0, Piece piece) {
                 } else {
                     po = NULL;
                 }
+                int is_wanted =
+                    (wp == K_WHITE || (targets >> sq_index(sq) & 1))
+                    && (kinds & (
+                        found != PIECE_EMPTY || po != NULL ?
+                                        MoveKindCaptures : MoveKindQuiets));
                 if (found == PIECE_EMPTY) {
-                    if (move_to_empty_allowed) {
+                    if (move_to_empty_allowed && !is_wanted) {
+                        ;
+                    } else if (move_to_empty_allowed) {
                         Move move = {
                             .from = sq0, .to = sq, .promotion_to = PIECE_EMPTY };
                         position_after_move(pos, &move, &next_pos);
@@ -600,21 +1110,21 @@ void append_legal_moves_for_piece(Pos* pos, Sq sq0, Piece piece) {
                             toggled_color(next_pos.active_color);
                         if (is_king_in_check(&next_pos) != 1) {
                             for (int j = 0; j < (po == NULL? 1: 4); j++) {
-                                if (move_buffer_current >= move_buffer_end) {
+                                if (ctx->move_buffer_current >= ctx->move_buffer_end) {
                                     fprintf(stderr,
                                         "Move buffer exhausted. Aborting...\n");
                                     abort();
                                 }
-                                *move_buffer_current = move;
+                                *ctx->move_buffer_current = move;
                                 if (po != NULL) {
-                                    move_buffer_current->promotion_to = 
+                                    ctx->move_buffer_current->promotion_to = 
                                                         own_color | po[j];
                                 } else {
-                                    move_buffer_current->promotion_to =
+                                    ctx->move_buffer_current->promotion_to =
                                                                 PIECE_EMPTY;
                                 }
                                 pos->moves_len++;
-                                move_buffer_current++;
+                                ctx->move_buffer_current++;
                             }
                         }
                     } else {
@@ -623,7 +1133,7 @@ void append_legal_moves_for_piece(Pos* pos, Sq sq0, Piece piece) {
                 } else if (own_color == found_color) {
                     break;
                 } else {
-                    if (captures_allowed) {
+                    if (captures_allowed && is_wanted) {
                         Move move = {
                             .from = sq0, .to = sq, .promotion_to = PIECE_EMPTY };
                         position_after_move(pos, &move, &next_pos);
@@ -631,21 +1141,21 @@ void append_legal_moves_for_piece(Pos* pos, Sq sq0, Piece piece) {
                             toggled_color(next_pos.active_color);
                         if (is_king_in_check(&next_pos) != 1) {
                             for (int j = 0; j < (po == NULL? 1: 4); j++) {
-                                if (move_buffer_current >= move_buffer_end) {
+                                if (ctx->move_buffer_current >= ctx->move_buffer_end) {
                                     fprintf(stderr,
                                             "Move buffer exhausted. Aborting...\n");
                                     abort();
                                 }
-                                *move_buffer_current = move;
+                                *ctx->move_buffer_current = move;
                                 if (po != NULL) {
-                                    move_buffer_current->promotion_to = 
+                                    ctx->move_buffer_current->promotion_to = 
                                                         own_color | po[j];
                                 } else {
-                                    move_buffer_current->promotion_to =
+                                    ctx->move_buffer_current->promotion_to =
                                                                 PIECE_EMPTY;
                                 }
                                 pos->moves_len++;
-                                move_buffer_current++;
+                                ctx->move_buffer_current++;
                             }
                         }
                     }
@@ -657,7 +1167,7 @@ void append_legal_moves_for_piece(Pos* pos, Sq sq0, Piece piece) {
     }
 }
 
-int is_king_in_square_in_check(Pos *pos, Sq sq0) {
+int is_king_in_square_in_check_generic(Pos *pos, Sq sq0) {
     ApplyDirFn dir_fn;
     Color own_color = pos->active_color;
 
@@ -753,434 +1263,7460 @@ int is_king_in_square_in_check(Pos *pos, Sq sq0) {
     return 0;
 }
 
-int is_king_in_check(Pos *pos) {
-    Color active_color = pos->active_color;
-    Piece king_to_find = active_color | UNCOLORED_KING;
-    for (int f = 0; f < N_FILES; f++) {
-        for (int r = 0; r < N_RANKS; r++) {
-            Sq sq = make_sq(f, r);
-            Piece found = get_piece_at_sq(pos, sq);
-            if (found == king_to_find) {
-                return is_king_in_square_in_check(pos, sq);
+/* Move generation and check detection specialised per color and piece at
+ * compile time. The bodies are written once as always-inlined functions
+ * that take the color and piece as arguments, and each DEFINE_ macro below
+ * instantiates them with constants, so the compiler folds away the tests
+ * on the color, the piece, the pawn direction and the promotion rank.
+ * Legality is tested by making the move on the board in place and undoing
+ * it, with the square of the king found once per call rather than once
+ * per move. The generic functions above produce the same moves in the
+ * same order and can be selected with use_generic_move_generator, which
+ * the bench subcommand uses to compare the two. */
+
+typedef struct Delta {
+    signed char f;
+    signed char r;
+} Delta;
+
+/* In the order of the corresponding *_dir_fns, so that the moves come out
+ * in the same order as from the generic generator. */
+const Delta rook_deltas[4] = { {0, 1}, {0, -1}, {-1, 0}, {1, 0} };
+const Delta bishop_deltas[4] = { {1, 1}, {-1, 1}, {1, -1}, {-1, -1} };
+const Delta queen_deltas[8] = {
+    {0, 1}, {0, -1}, {-1, 0}, {1, 0}, {1, 1}, {-1, 1}, {1, -1}, {-1, -1} };
+const Delta knight_deltas[8] = {
+    {2, 1}, {1, 2}, {2, -1}, {1, -2}, {-2, 1}, {-1, 2}, {-2, -1}, {-1, -2} };
+
+#define IS_ON_BOARD(f, r) ( (unsigned) (f) < N_FILES && (unsigned) (r) < N_RANKS )
+
+static inline __attribute__((always_inline)) int is_sq_attacked_inline(
+    Pos *pos, int f0, int r0, Color own_color
+) {
+    /* Whether a piece not of own_color attacks (f0, r0). */
+    const Color enemy_color = toggled_color(own_color);
+    for (int i = 0; i < 8; i++) {
+        /* queen_deltas lists the rook directions first. */
+        const Piece slider = enemy_color | (i < 4 ? UNCOLORED_ROOK : UNCOLORED_BISHOP);
+        int f = f0 + queen_deltas[i].f;
+        int r = r0 + queen_deltas[i].r;
+        if (!IS_ON_BOARD(f, r)) {
+            continue;
+        }
+        Piece found = pos->placement[f][r];
+        if (found == (enemy_color | UNCOLORED_KING)) {
+            return 1;
+        }
+        while (found == PIECE_EMPTY) {
+            f += queen_deltas[i].f;
+            r += queen_deltas[i].r;
+            if (!IS_ON_BOARD(f, r)) {
+                break;
             }
+            found = pos->placement[f][r];
+        }
+        if (found == slider || found == (enemy_color | UNCOLORED_QUEEN)) {
+            return 1;
         }
     }
-    return -1;
+    for (int i = 0; i < 8; i++) {
+        int f = f0 + knight_deltas[i].f;
+        int r = r0 + knight_deltas[i].r;
+        if (IS_ON_BOARD(f, r)
+                && pos->placement[f][r] == (enemy_color | UNCOLORED_KNIGHT)) {
+            return 1;
+        }
+    }
+    const int pawn_r = r0 + (own_color == COLOR_WHITE ? 1 : -1);
+    if ((unsigned) pawn_r < N_RANKS) {
+        if (f0 > 0 && pos->placement[f0 - 1][pawn_r]
+                                    == (enemy_color | UNCOLORED_PAWN)) {
+            return 1;
+        }
+        if (f0 < N_FILES - 1 && pos->placement[f0 + 1][pawn_r]
+                                    == (enemy_color | UNCOLORED_PAWN)) {
+            return 1;
+        }
+    }
+    return 0;
 }
 
-void move_to_alg(Move move_in, Pos *pos, char *result) {
-    explore_position(pos);
-    Piece piece_moving = get_piece_at_sq(pos, move_in.from);
-    Piece wp_in = piece_as_white(piece_moving);
-    int is_capture = 0;
-    if (get_piece_at_sq(pos, move_in.to) != PIECE_EMPTY) {
-        is_capture = 1;
+#define DEFINE_SQ_ATTACKED_TEST(name, own_color) \
+    int name(Pos *pos, int f, int r) { \
+        return is_sq_attacked_inline(pos, f, r, own_color); \
     }
-    int i = 0;
-    if (wp_in == P_WHITE && is_capture) {
-        result[i++] = f_to_algf(move_in.from.f);
+
+DEFINE_SQ_ATTACKED_TEST(is_sq_attacked_against_white, COLOR_WHITE)
+DEFINE_SQ_ATTACKED_TEST(is_sq_attacked_against_black, COLOR_BLACK)
+
+static inline __attribute__((always_inline)) void append_move_if_legal(
+    Pos *pos, int f0, int r0, int f, int r, Sq king_sq,
+    Color own_color, Piece wp, int is_promotion
+) {
+    /* Append the move from (f0, r0) to (f, r), or the four promotions, if
+     * it does not leave the own king, on king_sq unless it is the piece
+     * moving, in check. */
+    Piece captured = pos->placement[f][r];
+    Piece moving = pos->placement[f0][r0];
+    pos->placement[f][r] = moving;
+    pos->placement[f0][r0] = PIECE_EMPTY;
+    int is_in_check;
+    if (wp == K_WHITE) {
+        is_in_check = own_color == COLOR_WHITE ?
+            is_sq_attacked_against_white(pos, f, r) :
+            is_sq_attacked_against_black(pos, f, r);
+    } else if (king_sq.f < 0) {
+        is_in_check = 0;
+    } else {
+        is_in_check = own_color == COLOR_WHITE ?
+            is_sq_attacked_against_white(pos, king_sq.f, king_sq.r) :
+            is_sq_attacked_against_black(pos, king_sq.f, king_sq.r);
     }
-    else if (wp_in == R_WHITE) { result[i++] = 'R'; }
-    else if (wp_in == N_WHITE) { result[i++] = 'N'; }
-    else if (wp_in == B_WHITE) { result[i++] = 'B'; }
-    else if (wp_in == Q_WHITE) { result[i++] = 'Q'; }
-    else if (wp_in == K_WHITE) { result[i++] = 'K'; }
-    int is_unique = 1;
-    for (int i = 0; i < pos->moves_len; i++) {
-        Move move = pos->p_moves[i];
-        if (move_eq(move, move_in)) { continue; }
-        if (sq_eq(move.to, move_in.to)) {
-            Piece wp = piece_as_white(get_piece_at_sq(pos, move.from));
-            if (wp == wp_in && wp != P_WHITE) {
-                is_unique = 0;
-                break;
+    pos->placement[f0][r0] = moving;
+    pos->placement[f][r] = captured;
+    if (is_in_check) {
+        return;
+    }
+    int n = is_promotion ? 4 : 1;
+    if (ctx->move_buffer_current + n > ctx->move_buffer_end) {
+        fprintf(stderr, "Move buffer exhausted. Aborting...\n");
+        abort();
+    }
+    for (int j = 0; j < n; j++) {
+        ctx->move_buffer_current->from = make_sq(f0, r0);
+        ctx->move_buffer_current->to = make_sq(f, r);
+        ctx->move_buffer_current->promotion_to =
+                    is_promotion ? own_color | promotion_options[j] : PIECE_EMPTY;
+        ctx->move_buffer_current++;
+    }
+    pos->moves_len += n;
+}
+
+static inline __attribute__((always_inline)) void append_piece_moves_inline(
+    Pos *pos, Sq sq0, int kinds, uint64_t targets, Sq king_sq,
+    Color own_color, Piece wp
+) {
+    const int f0 = sq0.f;
+    const int r0 = sq0.r;
+    if (wp == P_WHITE) {
+        const int dr = own_color == COLOR_WHITE ? 1 : -1;
+        const int start_r = own_color == COLOR_WHITE ? 1 : 6;
+        const int promotion_r = own_color == COLOR_WHITE ? 7 : 0;
+        int r = r0 + dr;
+        if ((unsigned) r >= N_RANKS) {
+            return;
+        }
+        int is_promotion = r == promotion_r;
+        int push_kind = is_promotion ? MoveKindCaptures : MoveKindQuiets;
+        if ((kinds & push_kind) && pos->placement[f0][r] == PIECE_EMPTY) {
+            if (targets >> (r * 8 + f0) & 1) {
+                append_move_if_legal(pos, f0, r0, f0, r, king_sq,
+                                            own_color, wp, is_promotion);
+            }
+            if (r0 == start_r && pos->placement[f0][r + dr] == PIECE_EMPTY
+                    && (targets >> ((r + dr) * 8 + f0) & 1)) {
+                append_move_if_legal(pos, f0, r0, f0, r + dr, king_sq,
+                                            own_color, wp, 0);
             }
         }
-    }
-    if (!is_unique) {
-        is_unique = 1;
-        // Try adding the file and see if this uniquely identifies the moving
-        // piece.
-        for (int i = 0; i < pos->moves_len; i++) {
-            Move move = pos->p_moves[i];
-            if (move_eq(move, move_in)) { continue; }
-            if (sq_eq(move.to, move_in.to)) {
-                Piece wp = piece_as_white(get_piece_at_sq(pos, move.from));
-                if (wp == wp_in) {
-                    if (move.from.f == move_in.from.f) {
-                        is_unique = 0;
-                        break;
-                    }
+        if (kinds & MoveKindCaptures) {
+            /* Right before left, as in the generic generator. */
+            for (int df = 1; df >= -1; df -= 2) {
+                int f = f0 + df;
+                if ((unsigned) f >= N_FILES) {
+                    continue;
+                }
+                Piece found = pos->placement[f][r];
+                if (found != PIECE_EMPTY && piece_color(found) != own_color
+                        && (targets >> (r * 8 + f) & 1)) {
+                    append_move_if_legal(pos, f0, r0, f, r, king_sq,
+                                            own_color, wp, is_promotion);
                 }
             }
         }
-        if (is_unique) {
-            result[i++] = f_to_algf(move_in.from.f);
-        }
+        return;
     }
-    if (!is_unique) {
-        is_unique = 1;
-        // Try adding the rank and see if this uniquely identifies the moving
-        // piece.
-        for (int i = 0; i < pos->moves_len; i++) {
-            Move move = pos->p_moves[i];
-            if (move_eq(move, move_in)) { continue; }
-            if (sq_eq(move.to, move_in.to)) {
-                Piece wp = piece_as_white(get_piece_at_sq(pos, move.from));
-                if (wp == wp_in) {
-                    if (move.from.r == move_in.from.r) {
-                        is_unique = 0;
-                        break;
-                    }
+    const Delta *deltas;
+    int n_deltas;
+    if (wp == R_WHITE) {
+        deltas = rook_deltas;
+        n_deltas = 4;
+    } else if (wp == B_WHITE) {
+        deltas = bishop_deltas;
+        n_deltas = 4;
+    } else if (wp == N_WHITE) {
+        deltas = knight_deltas;
+        n_deltas = 8;
+    } else {
+        deltas = queen_deltas;
+        n_deltas = 8;
+    }
+    const int is_slider = wp == R_WHITE || wp == B_WHITE || wp == Q_WHITE;
+    for (int i = 0; i < n_deltas; i++) {
+        int f = f0;
+        int r = r0;
+        for (;;) {
+            f += deltas[i].f;
+            r += deltas[i].r;
+            if (!IS_ON_BOARD(f, r)) {
+                break;
+            }
+            Piece found = pos->placement[f][r];
+            if (found == PIECE_EMPTY) {
+                if ((kinds & MoveKindQuiets)
+                        && (wp == K_WHITE || (targets >> (r * 8 + f) & 1))) {
+                    append_move_if_legal(
+                            pos, f0, r0, f, r, king_sq, own_color, wp, 0);
+                }
+            } else {
+                if (piece_color(found) != own_color
+                        && (kinds & MoveKindCaptures)
+                        && (wp == K_WHITE || (targets >> (r * 8 + f) & 1))) {
+                    append_move_if_legal(
+                            pos, f0, r0, f, r, king_sq, own_color, wp, 0);
                 }
+                break;
+            }
+            if (!is_slider) {
+                break;
             }
         }
-        if (is_unique) {
-            result[i++] = r_to_algr(move_in.from.r);
-        }
-    }
-    if (!is_unique) {
-        // Add both the rank and the file.
-        result[i++] = f_to_algf(move_in.from.f);
-        result[i++] = r_to_algr(move_in.from.r);
-    }
-    if (is_capture) {
-        result[i++] = 'x';
     }
-    sq_to_algsq(move_in.to, result + i);
-    i += 2;
+}
 
-    switch (piece_as_white(move_in.promotion_to)) {
-        case R_WHITE:
-        case R_BLACK:
-            result[i++] = '=';
-            result[i++] = 'R';
-            break;
-        case N_WHITE:
-        case N_BLACK:
-            result[i++] = '=';
-            result[i++] = 'N';
-            break;
-        case B_WHITE:
-        case B_BLACK:
-            result[i++] = '=';
-            result[i++] = 'B';
-            break;
-        case Q_WHITE:
-        case Q_BLACK:
-            result[i++] = '=';
-            result[i++] = 'Q';
-            break;
+#define DEFINE_PIECE_MOVE_GENERATOR(name, own_color, wp) \
+    void name(Pos *pos, Sq sq0, int kinds, uint64_t targets, Sq king_sq) { \
+        append_piece_moves_inline( \
+                    pos, sq0, kinds, targets, king_sq, own_color, wp); \
     }
 
-    Pos next_pos;
-    position_after_move(pos, &move_in, &next_pos);
-    explore_position(&next_pos);
+DEFINE_PIECE_MOVE_GENERATOR(append_white_pawn_moves, COLOR_WHITE, P_WHITE)
+DEFINE_PIECE_MOVE_GENERATOR(append_white_rook_moves, COLOR_WHITE, R_WHITE)
+DEFINE_PIECE_MOVE_GENERATOR(append_white_knight_moves, COLOR_WHITE, N_WHITE)
+DEFINE_PIECE_MOVE_GENERATOR(append_white_bishop_moves, COLOR_WHITE, B_WHITE)
+DEFINE_PIECE_MOVE_GENERATOR(append_white_queen_moves, COLOR_WHITE, Q_WHITE)
+DEFINE_PIECE_MOVE_GENERATOR(append_white_king_moves, COLOR_WHITE, K_WHITE)
+DEFINE_PIECE_MOVE_GENERATOR(append_black_pawn_moves, COLOR_BLACK, P_WHITE)
+DEFINE_PIECE_MOVE_GENERATOR(append_black_rook_moves, COLOR_BLACK, R_WHITE)
+DEFINE_PIECE_MOVE_GENERATOR(append_black_knight_moves, COLOR_BLACK, N_WHITE)
+DEFINE_PIECE_MOVE_GENERATOR(append_black_bishop_moves, COLOR_BLACK, B_WHITE)
+DEFINE_PIECE_MOVE_GENERATOR(append_black_queen_moves, COLOR_BLACK, Q_WHITE)
+DEFINE_PIECE_MOVE_GENERATOR(append_black_king_moves, COLOR_BLACK, K_WHITE)
 
-    if (is_king_in_checkmate(&next_pos)) {
-        result[i++] = '#';
-    } else if (is_king_in_check(&next_pos)) {
-        result[i++] = '+';
-    }
-        
-    result[i++] = '\0';
-}
+typedef void (*PieceMoveGenerator)(Pos*, Sq, int, uint64_t, Sq);
 
-void print_move(Move move, Pos *pos) {
-    char buf[10];
-    move_to_alg(move, pos, buf);
-    printf("%s", buf);
-}
+/* By piece code; NULL for the codes of no piece. */
+PieceMoveGenerator piece_move_generators[32] = {
+    [P_WHITE] = append_white_pawn_moves,
+    [R_WHITE] = append_white_rook_moves,
+    [N_WHITE] = append_white_knight_moves,
+    [B_WHITE] = append_white_bishop_moves,
+    [Q_WHITE] = append_white_queen_moves,
+    [K_WHITE] = append_white_king_moves,
+    [P_BLACK] = append_black_pawn_moves,
+    [R_BLACK] = append_black_rook_moves,
+    [N_BLACK] = append_black_knight_moves,
+    [B_BLACK] = append_black_bishop_moves,
+    [Q_BLACK] = append_black_queen_moves,
+    [K_BLACK] = append_black_king_moves,
+};
 
-void set_legal_moves_for_position(Pos *pos) {
-    Color active_color = pos->active_color;
-    for (int f = 0; f < N_FILES; f++) {
-        for (int r = 0; r < N_RANKS; r++) {
-            Sq sq = make_sq(f, r);
-            Piece found = get_piece_at_sq(pos, sq);
-            Color found_color = piece_color(found);
-            if (active_color == found_color) {
-                append_legal_moves_for_piece(pos, sq, found);
-            }
-        }
+int is_king_in_square_in_check(Pos *pos, Sq sq0) {
+    /* Whether the king of the side to move, on sq0, is attacked. */
+    if (ctx->use_generic_move_generator) {
+        return is_king_in_square_in_check_generic(pos, sq0);
     }
-
-}
-
-int is_king_in_checkmate(Pos *pos) {
-    return (pos->is_king_in_check == 1) && (pos->moves_len == 0);
+    return pos->active_color == COLOR_WHITE ?
+                    is_sq_attacked_against_white(pos, sq0.f, sq0.r) :
+                    is_sq_attacked_against_black(pos, sq0.f, sq0.r);
 }
 
-int is_king_in_stalemate(Pos *pos) {
-    return (pos->is_king_in_check == 0) && (pos->moves_len == 0);
+Sq find_king(Pos *pos, Color color) {
+    /* The square of the king of color, or one with f = -1 if there is
+     * none. */
+    uint64_t mask = placement_piece_mask(pos, color | UNCOLORED_KING);
+    if (mask == 0) {
+        return make_sq(-1, -1);
+    }
+    return placement_bit_to_sq(__builtin_ctzll(mask));
 }
 
-void set_is_king_in_checkmate(Pos *pos) {
-    pos->is_king_in_checkmate = is_king_in_checkmate(pos);
+int is_king_in_check(Pos *pos) {
+    /* 1 or 0, or -1 if the side to move has no king. */
+    Sq king_sq = find_king(pos, pos->active_color);
+    if (king_sq.f < 0) {
+        return -1;
+    }
+    return is_king_in_square_in_check(pos, king_sq);
 }
 
-void set_is_king_in_stalemate(Pos *pos) {
-    pos->is_king_in_stalemate = is_king_in_stalemate(pos);
+int is_valid_fen(const char *fen) {
+    /* Whether decode_fen can be trusted with fen: eight ranks of eight
+     * squares, one king a side, no pawns on the first or last rank, w or b
+     * to move, well-formed castling, en passant and move counter fields if
+     * there are any, castling rights matching the king and rooks, and the
+     * side not to move not in check. */
+    int n_kings[2] = { 0, 0 };
+    int i = 0;
+    for (int r = N_RANKS - 1; r >= 0; r--) {
+        int n_squares = 0;
+        for (; fen[i] != '\0' && fen[i] != '/' && fen[i] != ' '; i++) {
+            char c = fen[i];
+            if (c >= '1' && c <= '8') {
+                n_squares += c - '0';
+                continue;
+            }
+            if (strchr("pnbrqkPNBRQK", c) == NULL) {
+                return 0;
+            }
+            if ((c == 'p' || c == 'P') && (r == 0 || r == N_RANKS - 1)) {
+                return 0;
+            }
+            if (c == 'k' || c == 'K') {
+                n_kings[c == 'k']++;
+            }
+            n_squares++;
+        }
+        if (n_squares != N_FILES || fen[i] != (r > 0 ? '/' : ' ')) {
+            return 0;
+        }
+        i++;
+    }
+    if (n_kings[0] != 1 || n_kings[1] != 1) {
+        return 0;
+    }
+    if ((fen[i] != 'w' && fen[i] != 'b') || (fen[i+1] != ' ' && fen[i+1] != '\0')) {
+        return 0;
+    }
+    i++;
+    /* Castling. */
+    if (fen[i] == ' ') {
+        int len = 0;
+        for (i++; fen[i] != '\0' && fen[i] != ' '; i++, len++) {
+            if (strchr("KQkq-", fen[i]) == NULL || len == 4) {
+                return 0;
+            }
+        }
+        if (len == 0) {
+            return 0;
+        }
+    }
+    /* En passant. */
+    if (fen[i] == ' ') {
+        i++;
+        if (fen[i] == '-') {
+            i++;
+        } else if (
+            fen[i] >= 'a' && fen[i] <= 'h'
+            && (fen[i+1] == '3' || fen[i+1] == '6')
+        ) {
+            i += 2;
+        } else {
+            return 0;
+        }
+        if (fen[i] != ' ' && fen[i] != '\0') {
+            return 0;
+        }
+    }
+    /* Halfmove and fullmove counters. */
+    for (int field = 0; field < 2 && fen[i] == ' '; field++) {
+        int len = 0;
+        for (i++; fen[i] >= '0' && fen[i] <= '9'; i++, len++) {
+            if (len == 4) {
+                return 0;
+            }
+        }
+        if (len == 0) {
+            return 0;
+        }
+    }
+    if (fen[i] != '\0' || i >= FEN_MAX_LEN) {
+        return 0;
+    }
+    char fen_copy[FEN_MAX_LEN];
+    strcpy(fen_copy, fen);
+    Pos pos = decode_fen(fen_copy);
+    /* Castling rights need their king and rook at home. */
+    struct { int right; Piece king; Piece rook; int rook_f; int r; }
+    rights[4] = {
+        { CASTLING_WHITE_KINGSIDE, K_WHITE, R_WHITE, 7, 0 },
+        { CASTLING_WHITE_QUEENSIDE, K_WHITE, R_WHITE, 0, 0 },
+        { CASTLING_BLACK_KINGSIDE, K_BLACK, R_BLACK, 7, 7 },
+        { CASTLING_BLACK_QUEENSIDE, K_BLACK, R_BLACK, 0, 7 },
+    };
+    for (int j = 0; j < 4; j++) {
+        if (
+            (pos.castling & rights[j].right)
+            && (
+                get_piece_at_sq(&pos, make_sq(4, rights[j].r)) != rights[j].king
+                || get_piece_at_sq(&pos, make_sq(rights[j].rook_f, rights[j].r))
+                    != rights[j].rook
+            )
+        ) {
+            return 0;
+        }
+    }
+    /* The attack tables rather than is_king_in_check, which may need the
+     * move buffer of an engine. */
+    Color waiting = toggled_color(pos.active_color);
+    Sq king_sq = find_king(&pos, waiting);
+    return !(waiting == COLOR_WHITE ?
+                    is_sq_attacked_against_white(&pos, king_sq.f, king_sq.r) :
+                    is_sq_attacked_against_black(&pos, king_sq.f, king_sq.r));
+}
+
+
+void append_legal_moves_for_piece(
+    Pos* pos, Sq sq0, Piece piece, int kinds, uint64_t targets
+) {
+    /* Append the legal moves of the piece on sq0 of the given kinds (see
+     * MoveKind). Unless the piece is the king, only moves to squares in
+     * targets, a mask by sq_index, are appended; see evasion_targets. */
+    if (ctx->use_generic_move_generator) {
+        append_legal_moves_for_piece_generic(pos, sq0, piece, kinds, targets);
+        return;
+    }
+    piece_move_generators[(int) piece](pos, sq0, kinds, targets,
+                                    find_king(pos, piece_color(piece)));
+}
+
+int is_quiet_move(Pos *pos, Move *move) {
+    return get_piece_at_sq(pos, move->to) == PIECE_EMPTY
+        && move->promotion_to == PIECE_EMPTY;
+}
+
+uint64_t evasion_targets(Pos *pos) {
+    /* The squares a piece other than the king has to move to when the side
+     * to move is in check: the square of the checking piece and, for a
+     * rook, bishop or queen, the squares between it and the king. None if
+     * there are two checking pieces, and all if there are none. */
+    Color own_color = pos->active_color;
+    Sq sq0 = find_king(pos, own_color);
+    if (sq0.f < 0) {
+        return ALL_SQUARES;
+    }
+    uint64_t targets = 0;
+    int n_checkers = 0;
+    ApplyDirFn dir_fn;
+    for (int i = 0; (dir_fn = queen_dir_fns[i]) != NULL; i++) {
+        /* queen_dir_fns lists the rook directions first. */
+        Piece slider = i < 4 ? R_WHITE : B_WHITE;
+        Sq sq = sq0;
+        uint64_t ray = 0;
+        for (;;) {
+            dir_fn(&sq);
+            if (sq.f < 0 || sq.f > 7 || sq.r < 0 || sq.r > 7) { break; }
+            ray |= (uint64_t) 1 << sq_index(sq);
+            Piece found = get_piece_at_sq(pos, sq);
+            if (found == PIECE_EMPTY) {
+                continue;
+            }
+            Piece found_as_white = piece_as_white(found);
+            if (
+                piece_color(found) != own_color
+                && (found_as_white == slider || found_as_white == Q_WHITE)
+            ) {
+                targets |= ray;
+                n_checkers++;
+            }
+            break;
+        }
+    }
+    ApplyDirFn *pawn_dir_fns = own_color == COLOR_WHITE ?
+                    white_pawn_capture_dir_fns : black_pawn_capture_dir_fns;
+    ApplyDirFn *jump_dir_fns[2] = { knight_dir_fns, pawn_dir_fns };
+    Piece jumpers[2] = { N_WHITE, P_WHITE };
+    for (int j = 0; j < 2; j++) {
+        for (int i = 0; (dir_fn = jump_dir_fns[j][i]) != NULL; i++) {
+            Sq sq = sq0;
+            dir_fn(&sq);
+            if (sq.f < 0 || sq.f > 7 || sq.r < 0 || sq.r > 7) { continue; }
+            Piece found = get_piece_at_sq(pos, sq);
+            if (
+                found != PIECE_EMPTY
+                && piece_color(found) != own_color
+                && piece_as_white(found) == jumpers[j]
+            ) {
+                targets |= (uint64_t) 1 << sq_index(sq);
+                n_checkers++;
+            }
+        }
+    }
+    if (n_checkers == 0) {
+        return ALL_SQUARES;
+    }
+    return n_checkers == 1 ? targets : 0;
+}
+
+void append_legal_moves(Pos *pos, int kinds, uint64_t targets) {
+    Color active_color = pos->active_color;
+    Sq king_sq = find_king(pos, active_color);
+    uint64_t mask = placement_color_mask(pos, active_color);
+    for (; mask != 0; mask &= mask - 1) {
+        Sq sq = placement_bit_to_sq(__builtin_ctzll(mask));
+        Piece found = get_piece_at_sq(pos, sq);
+        if (ctx->use_generic_move_generator) {
+            append_legal_moves_for_piece_generic(
+                                    pos, sq, found, kinds, targets);
+        } else {
+            piece_move_generators[(int) found](
+                                    pos, sq, kinds, targets, king_sq);
+        }
+    }
+}
+
+int has_legal_move_of_kind(Pos *pos, int kinds) {
+    /* Whether pos has a legal move of the given kinds (see MoveKind). Stops
+     * at the first one found, and leaves the moves pos may already have, and
+     * the move buffer, as they were. */
+    if (pos->is_explored) {
+        for (int i = 0; i < pos->moves_len; i++) {
+            int kind = is_quiet_move(pos, &pos->p_moves[i]) ?
+                                        MoveKindQuiets : MoveKindCaptures;
+            if (kinds & kind) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+    Move *move_buffer_mark = ctx->move_buffer_current;
+    Pos scratch = *pos;
+    scratch.p_moves = ctx->move_buffer_current;
+    scratch.moves_len = 0;
+    uint64_t targets = evasion_targets(pos);
+    uint64_t mask = placement_color_mask(pos, pos->active_color);
+    for (; mask != 0 && scratch.moves_len == 0; mask &= mask - 1) {
+        Sq sq = placement_bit_to_sq(__builtin_ctzll(mask));
+        append_legal_moves_for_piece(&scratch, sq,
+                                get_piece_at_sq(pos, sq), kinds, targets);
+    }
+    ctx->move_buffer_current = move_buffer_mark;
+    return scratch.moves_len > 0;
+}
+
+int has_legal_move(Pos *pos) {
+    /* Like checking moves_len after explore_position, but without
+     * generating all the moves. */
+    return has_legal_move_of_kind(pos, MoveKindAll);
+}
+
+void move_to_alg(Move move_in, Pos *pos, char *result) {
+    /* Write move_in in SAN. The moves of pos are only generated when a
+     * piece other than a pawn or the king moves, since only then may the
+     * move need disambiguation. The position after the move is only tested
+     * for check, and its moves only looked for when it is check, to tell
+     * mate. */
+    Piece piece_moving = get_piece_at_sq(pos, move_in.from);
+    Piece wp_in = piece_as_white(piece_moving);
+    int is_capture = 0;
+    if (get_piece_at_sq(pos, move_in.to) != PIECE_EMPTY) {
+        is_capture = 1;
+    }
+    int i = 0;
+    if (wp_in == P_WHITE && is_capture) {
+        result[i++] = f_to_algf(move_in.from.f);
+    }
+    else if (wp_in == R_WHITE) { result[i++] = 'R'; }
+    else if (wp_in == N_WHITE) { result[i++] = 'N'; }
+    else if (wp_in == B_WHITE) { result[i++] = 'B'; }
+    else if (wp_in == Q_WHITE) { result[i++] = 'Q'; }
+    else if (wp_in == K_WHITE) { result[i++] = 'K'; }
+    if (wp_in != P_WHITE && wp_in != K_WHITE) {
+        /* Other pieces of the same kind that can go to the same square, and
+         * how many of them share the file or the rank. */
+        explore_position(pos);
+        int n_same = 0;
+        int n_same_file = 0;
+        int n_same_rank = 0;
+        for (int j = 0; j < pos->moves_len; j++) {
+            Move move = pos->p_moves[j];
+            if (
+                move_eq(move, move_in)
+                || !sq_eq(move.to, move_in.to)
+                || piece_as_white(get_piece_at_sq(pos, move.from)) != wp_in
+            ) {
+                continue;
+            }
+            n_same++;
+            n_same_file += move.from.f == move_in.from.f;
+            n_same_rank += move.from.r == move_in.from.r;
+        }
+        if (n_same > 0) {
+            if (n_same_file == 0) {
+                result[i++] = f_to_algf(move_in.from.f);
+            } else if (n_same_rank == 0) {
+                result[i++] = r_to_algr(move_in.from.r);
+            } else {
+                result[i++] = f_to_algf(move_in.from.f);
+                result[i++] = r_to_algr(move_in.from.r);
+            }
+        }
+    }
+    if (is_capture) {
+        result[i++] = 'x';
+    }
+    sq_to_algsq(move_in.to, result + i);
+    i += 2;
+
+    switch (piece_as_white(move_in.promotion_to)) {
+        case R_WHITE:
+            result[i++] = '=';
+            result[i++] = 'R';
+            break;
+        case N_WHITE:
+            result[i++] = '=';
+            result[i++] = 'N';
+            break;
+        case B_WHITE:
+            result[i++] = '=';
+            result[i++] = 'B';
+            break;
+        case Q_WHITE:
+            result[i++] = '=';
+            result[i++] = 'Q';
+            break;
+    }
+
+    Pos next_pos;
+    position_after_move(pos, &move_in, &next_pos);
+    if (gives_check(&next_pos)) {
+        result[i++] = has_legal_move(&next_pos) ? '+' : '#';
+    }
+
+    result[i++] = '\0';
+}
+
+void print_move(Move move, Pos *pos) {
+    char buf[10];
+    move_to_alg(move, pos, buf);
+    printf("%s", buf);
+}
+
+int parse_san(Pos *pos, char *san, Move *move) {
+    /* Find the legal move of pos written in SAN, e.g. Nbd7, exd5, e8=Q+ or
+     * R1xa3#. The moves of pos are generated once and the move is picked
+     * among them by piece, target square and disambiguation, so no
+     * candidate is checked for legality again. Check and annotation
+     * suffixes are ignored. Return 0 if no legal move or more than one
+     * matches. */
+    int len = strlen(san);
+    while (len > 0 && strchr("+#!?", san[len-1]) != NULL) {
+        len--;
+    }
+    Piece promotion = 0;
+    if (len > 0 && strchr("QRBN", san[len-1]) != NULL) {
+        char c = san[len-1];
+        promotion = c == 'Q' ? UNCOLORED_QUEEN
+            : c == 'R' ? UNCOLORED_ROOK
+            : c == 'B' ? UNCOLORED_BISHOP : UNCOLORED_KNIGHT;
+        len--;
+        if (len > 0 && san[len-1] == '=') {
+            len--;
+        }
+    }
+    if (
+        len < 2
+        || san[len-2] < 'a' || san[len-2] > 'h'
+        || san[len-1] < '1' || san[len-1] > '8'
+    ) {
+        return 0;
+    }
+    Sq to = make_sq(algf_to_f(san[len-2]), algr_to_r(san[len-1]));
+    int i = 0;
+    Piece wp = P_WHITE;
+    if (strchr("KQRBN", san[0]) != NULL) {
+        char c = san[i++];
+        wp = c == 'K' ? K_WHITE
+            : c == 'Q' ? Q_WHITE
+            : c == 'R' ? R_WHITE
+            : c == 'B' ? B_WHITE : N_WHITE;
+    }
+    File from_f = -1;
+    Rank from_r = -1;
+    for (; i < len - 2; i++) {
+        if (san[i] >= 'a' && san[i] <= 'h') {
+            from_f = algf_to_f(san[i]);
+        } else if (san[i] >= '1' && san[i] <= '8') {
+            from_r = algr_to_r(san[i]);
+        } else if (san[i] != 'x') {
+            return 0;
+        }
+    }
+    if (wp == P_WHITE && from_f < 0) {
+        /* Only captures name the file of a pawn. */
+        from_f = to.f;
+    }
+    explore_position(pos);
+    int n_found = 0;
+    for (int j = 0; j < pos->moves_len; j++) {
+        Move candidate = pos->p_moves[j];
+        if (
+            sq_eq(candidate.to, to)
+            && piece_as_white(get_piece_at_sq(pos, candidate.from)) == wp
+            && (from_f < 0 || candidate.from.f == from_f)
+            && (from_r < 0 || candidate.from.r == from_r)
+            && piece_as_white(candidate.promotion_to) == promotion
+        ) {
+            *move = candidate;
+            n_found++;
+        }
+    }
+    return n_found == 1;
+}
+
+void set_legal_moves_for_position(Pos *pos) {
+    /* pos->is_king_in_check must be set. */
+    append_legal_moves(pos, MoveKindAll,
+            pos->is_king_in_check == 1 ? evasion_targets(pos) : ALL_SQUARES);
+}
+
+int is_king_in_checkmate(Pos *pos) {
+    return (pos->is_king_in_check == 1) && (pos->moves_len == 0);
+}
+
+int is_king_in_stalemate(Pos *pos) {
+    return (pos->is_king_in_check == 0) && (pos->moves_len == 0);
+}
+
+void set_is_king_in_checkmate(Pos *pos) {
+    pos->is_king_in_checkmate = is_king_in_checkmate(pos);
+}
+
+void set_is_king_in_stalemate(Pos *pos) {
+    pos->is_king_in_stalemate = is_king_in_stalemate(pos);
+}
+
+void explore_position(Pos *pos) {
+    if (!pos->is_explored) {
+        /* The position may have been made some time before it is explored
+         * (e.g. when unpacked in bulk), so its moves start wherever the move
+         * buffer is now. */
+        pos->p_moves = ctx->move_buffer_current;
+        pos->moves_len = 0;
+        pos->is_king_in_check = is_king_in_check(pos);
+        set_legal_moves_for_position(pos);
+        set_is_king_in_checkmate(pos);
+        set_is_king_in_stalemate(pos);
+        pos->is_explored = 1;
+        ctx->n_pos_explored += 1;
+    }
+}
+
+Val mated_val(Color color, int height) {
+    /* The value of color being checkmated height half-moves from the root. */
+    if (color == COLOR_WHITE) {
+        return -(CHECKMATE_VAL - height);
+    } else {
+        return CHECKMATE_VAL - height;
+    }
+}
+
+int is_mate_val(Val val) {
+    return val >= MATE_VAL_MIN || val <= -MATE_VAL_MIN;
+}
+
+int mate_val_n_moves(Val val) {
+    /* The number of moves, counted as in "mate in n", of a mate value. The
+     * result is negative if black mates. */
+    int n_half_moves = CHECKMATE_VAL - (val > 0 ? val : -val);
+    int n_moves = (n_half_moves + 1) / 2;
+    return val > 0 ? n_moves : -n_moves;
+}
+
+void val_to_str(Val val, char *result) {
+    /* Pawns with two decimals, or e.g. "+M2" for white mating in 2. */
+    if (is_mate_val(val)) {
+        int n_moves = mate_val_n_moves(val);
+        sprintf(result, "%cM%d", n_moves > 0 ? '+' : '-', abs(n_moves));
+    } else {
+        sprintf(result, "%+.2f", val / 100.0);
+    }
+}
+
+/* Evaluation weights.
+ *
+ * Every term of the static evaluation is a count (of pieces, of squares a
+ * piece can move to, of pawns in front of the king...) times a weight, and
+ * every weight has a middlegame and an endgame value, in centipawns. The
+ * middlegame and endgame sums are blended by game phase, the amount of
+ * non-pawn material left. As the value is linear in the weights they can be
+ * fitted to game results; see tune_main. Counts are from white's point of
+ * view, positive for white's pieces and negative for black's.
+ *
+ * Piece-square tables are indexed by sq_index, a1 to h8 rank by rank, from
+ * the point of view of the piece's own side: black pieces look up the
+ * square mirrored across the middle of the board. */
+
+#define MAX_GAME_PHASE 24
+
+typedef struct Score {
+    Val mg;
+    Val eg;
+} Score;
+
+/* Only Score members, so that it can also be used as a flat array of
+ * N_EVAL_WEIGHTS weights. Tables by piece are indexed by uncolored piece. */
+typedef struct EvalWeights {
+    Score material[8];
+    Score pst[8][N_FILES * N_RANKS];
+    Score mobility[8];
+    /* By rank counted from the pawn's own side. */
+    Score passed_pawn[N_RANKS];
+    Score isolated_pawn;
+    Score doubled_pawn;
+    /* Own pawns one and two squares in front of the king. */
+    Score king_shield[2];
+    Score king_zone_attack;
+} EvalWeights;
+
+#define N_EVAL_WEIGHTS ( (int) ( sizeof(EvalWeights) / sizeof(Score) ) )
+
+EvalWeights eval_weights = {
+    .material = {
+        [UNCOLORED_PAWN] = { 100, 100 },
+        [UNCOLORED_ROOK] = { 500, 500 },
+        [UNCOLORED_KNIGHT] = { 300, 300 },
+        [UNCOLORED_BISHOP] = { 300, 300 },
+        [UNCOLORED_QUEEN] = { 900, 900 },
+    },
+    .pst[UNCOLORED_KNIGHT] = {
+        { -25, -25 }, { -20, -20 }, { -15, -15 }, { -15, -15 },
+        { -15, -15 }, { -15, -15 }, { -20, -20 }, { -25, -25 },
+        { -20, -20 }, { -10, -10 }, { 0, 0 }, { 0, 0 },
+        { 0, 0 }, { 0, 0 }, { -10, -10 }, { -20, -20 },
+        { -15, -15 }, { 0, 0 }, { 5, 5 }, { 8, 8 },
+        { 8, 8 }, { 5, 5 }, { 0, 0 }, { -15, -15 },
+        { -15, -15 }, { 3, 3 }, { 8, 8 }, { 10, 10 },
+        { 10, 10 }, { 8, 8 }, { 3, 3 }, { -15, -15 },
+        { -15, -15 }, { 3, 3 }, { 8, 8 }, { 10, 10 },
+        { 10, 10 }, { 8, 8 }, { 3, 3 }, { -15, -15 },
+        { -15, -15 }, { 0, 0 }, { 5, 5 }, { 8, 8 },
+        { 8, 8 }, { 5, 5 }, { 0, 0 }, { -15, -15 },
+        { -20, -20 }, { -10, -10 }, { 0, 0 }, { 0, 0 },
+        { 0, 0 }, { 0, 0 }, { -10, -10 }, { -20, -20 },
+        { -25, -25 }, { -20, -20 }, { -15, -15 }, { -15, -15 },
+        { -15, -15 }, { -15, -15 }, { -20, -20 }, { -25, -25 },
+    },
+    .pst[UNCOLORED_KING] = {
+        { 20, -25 }, { 30, -25 }, { 10, -25 }, { 0, -25 },
+        { 0, -25 }, { 10, -25 }, { 30, -25 }, { 20, -25 },
+        { 10, -25 }, { 10, -10 }, { 0, -10 }, { 0, -10 },
+        { 0, -10 }, { 0, -10 }, { 10, -10 }, { 10, -25 },
+        { -10, -25 }, { -20, -10 }, { -20, 5 }, { -20, 5 },
+        { -20, 5 }, { -20, 5 }, { -20, -10 }, { -10, -25 },
+        { -20, -25 }, { -30, -10 }, { -30, 5 }, { -40, 20 },
+        { -40, 20 }, { -30, 5 }, { -30, -10 }, { -20, -25 },
+        { -30, -25 }, { -40, -10 }, { -40, 5 }, { -50, 20 },
+        { -50, 20 }, { -40, 5 }, { -40, -10 }, { -30, -25 },
+        { -30, -25 }, { -40, -10 }, { -40, 5 }, { -50, 5 },
+        { -50, 5 }, { -40, 5 }, { -40, -10 }, { -30, -25 },
+        { -30, -25 }, { -40, -10 }, { -40, -10 }, { -50, -10 },
+        { -50, -10 }, { -40, -10 }, { -40, -10 }, { -30, -25 },
+        { -30, -25 }, { -40, -25 }, { -40, -25 }, { -50, -25 },
+        { -50, -25 }, { -40, -25 }, { -40, -25 }, { -30, -25 },
+    },
+    .mobility = {
+        [UNCOLORED_KNIGHT] = { 4, 4 },
+        [UNCOLORED_BISHOP] = { 5, 5 },
+        [UNCOLORED_ROOK] = { 2, 2 },
+        [UNCOLORED_QUEEN] = { 1, 1 },
+    },
+    .passed_pawn = {
+        { 0, 0 }, { 5, 5 }, { 10, 10 }, { 20, 20 },
+        { 35, 35 }, { 60, 60 }, { 100, 100 }, { 0, 0 },
+    },
+    .isolated_pawn = { -15, -15 },
+    .doubled_pawn = { -10, -10 },
+    .king_shield = { { 10, 10 }, { 5, 5 } },
+    .king_zone_attack = { 6, 6 },
+};
+
+/* 0 for the weights above, or a hash of the weights read by
+ * read_eval_weights. Mixed into the keys of the evaluation cache. */
+uint64_t eval_weights_key = 0;
+
+/* By uncolored piece: how much it counts towards MAX_GAME_PHASE. */
+int game_phase_vals[8] = {
+    [UNCOLORED_KNIGHT] = 1,
+    [UNCOLORED_BISHOP] = 1,
+    [UNCOLORED_ROOK] = 2,
+    [UNCOLORED_QUEEN] = 4,
+};
+
+/* The count of every evaluation term in a position, by weight index, and
+ * the position's game phase. */
+typedef struct EvalTrace {
+    int coefs[N_EVAL_WEIGHTS];
+    int phase;
+} EvalTrace;
+
+void add_eval_term(Score *acc, Score *weight, int count, EvalTrace *trace) {
+    /* trace may be NULL. */
+    acc->mg += weight->mg * count;
+    acc->eg += weight->eg * count;
+    if (trace != NULL) {
+        trace->coefs[weight - (Score *) &eval_weights] += count;
+    }
+}
+
+int eval_weight_name(int index, char *result) {
+    /* Write the name the weight at index has in weights files, e.g.
+     * "pst.N.e4" or "isolated_pawn", and return 1, or return 0 if no piece
+     * uses it. */
+    EvalWeights *w = &eval_weights;
+    Score *weight = (Score *) w + index;
+    char sq_str[3];
+    int i;
+    if ((i = weight - w->material) >= 0 && i < 8) {
+        if (i < UNCOLORED_PAWN || i > UNCOLORED_KING) { return 0; }
+        sprintf(result, "material.%c", piece_to_fen_char(i));
+    } else if ((i = weight - w->pst[0]) >= 0 && i < 8 * N_FILES * N_RANKS) {
+        Piece wp = i / (N_FILES * N_RANKS);
+        if (wp < UNCOLORED_PAWN || wp > UNCOLORED_KING) { return 0; }
+        sq_to_algsq(index_to_sq(i % (N_FILES * N_RANKS)), sq_str);
+        sprintf(result, "pst.%c.%s", piece_to_fen_char(wp), sq_str);
+    } else if ((i = weight - w->mobility) >= 0 && i < 8) {
+        if (i < UNCOLORED_PAWN || i > UNCOLORED_KING) { return 0; }
+        sprintf(result, "mobility.%c", piece_to_fen_char(i));
+    } else if ((i = weight - w->passed_pawn) >= 0 && i < N_RANKS) {
+        sprintf(result, "passed_pawn.%d", i + 1);
+    } else if (weight == &w->isolated_pawn) {
+        strcpy(result, "isolated_pawn");
+    } else if (weight == &w->doubled_pawn) {
+        strcpy(result, "doubled_pawn");
+    } else if ((i = weight - w->king_shield) >= 0 && i < 2) {
+        sprintf(result, "king_shield.%d", i + 1);
+    } else {
+        strcpy(result, "king_zone_attack");
+    }
+    return 1;
+}
+
+uint64_t hash_eval_weights(EvalWeights *weights) {
+    /* FNV-1a. */
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    unsigned char *bytes = (unsigned char *) weights;
+    for (size_t i = 0; i < sizeof(EvalWeights); i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+int write_eval_weights(char *path) {
+    /* One weight per line: name, middlegame value, endgame value. Return 0
+     * on success and -1 on failure. */
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s for writing.\n", path);
+        return -1;
+    }
+    fprintf(f, "# cwig evaluation weights: name, middlegame, endgame\n");
+    char name[32];
+    for (int i = 0; i < N_EVAL_WEIGHTS; i++) {
+        Score *weight = (Score *) &eval_weights + i;
+        if (eval_weight_name(i, name)) {
+            fprintf(f, "%s %d %d\n", name, weight->mg, weight->eg);
+        }
+    }
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Could not write %s.\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+int read_eval_weights(char *path) {
+    /* Read a file written by write_eval_weights. Weights missing from it
+     * keep their values. Return 0 on success and -1 on failure, in which
+     * case no weight is changed. */
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s for reading.\n", path);
+        return -1;
+    }
+    EvalWeights weights = eval_weights;
+    char line[100];
+    char name[32];
+    char other_name[32];
+    Score score;
+    int line_number = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line_number++;
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        int index = -1;
+        if (sscanf(line, "%31s %d %d", name, &score.mg, &score.eg) == 3) {
+            for (int i = 0; i < N_EVAL_WEIGHTS && index < 0; i++) {
+                if (
+                    eval_weight_name(i, other_name)
+                    && strcmp(name, other_name) == 0
+                ) {
+                    index = i;
+                }
+            }
+        }
+        if (index < 0) {
+            fprintf(stderr, "%s:%d: not a known weight.\n", path, line_number);
+            fclose(f);
+            return -1;
+        }
+        ((Score *) &weights)[index] = score;
+    }
+    fclose(f);
+    eval_weights = weights;
+    eval_weights_key = hash_eval_weights(&weights);
+    return 0;
+}
+
+/* Pawn structure only depends on where the pawns are, so its value is
+ * cached by a key made from the pawns alone. Positions often share their
+ * pawns, as most moves are not pawn moves. */
+#define PAWN_HASH_N_ENTRIES ( 1 << 14 )
+
+typedef struct PawnHashEntry {
+    uint64_t key;
+    Score score;
+} PawnHashEntry;
+
+void add_pawn_structure_terms(Pos *pos, Score *acc, EvalTrace *trace) {
+    /* Passed, isolated and doubled pawns. */
+    int n_pawns[2][N_FILES] = { { 0 } };
+    for (int f = 0; f < N_FILES; f++) {
+        for (int r = 0; r < N_RANKS; r++) {
+            Piece found = pos->placement[f][r];
+            if (piece_as_white(found) == P_WHITE) {
+                n_pawns[piece_color(found) == COLOR_BLACK][f]++;
+            }
+        }
+    }
+    for (int f = 0; f < N_FILES; f++) {
+        for (int r = 0; r < N_RANKS; r++) {
+            Piece found = pos->placement[f][r];
+            if (piece_as_white(found) != P_WHITE) {
+                continue;
+            }
+            int side = piece_color(found) == COLOR_BLACK;
+            int sign = side ? -1 : 1;
+            int is_isolated =
+                (f == 0 || n_pawns[side][f-1] == 0)
+                && (f == N_FILES - 1 || n_pawns[side][f+1] == 0);
+            if (is_isolated) {
+                add_eval_term(acc, &eval_weights.isolated_pawn, sign, trace);
+            }
+            int is_passed = 1;
+            for (int df = -1; df <= 1 && is_passed; df++) {
+                if (f + df < 0 || f + df >= N_FILES) {
+                    continue;
+                }
+                for (int r2 = r + sign; r2 > 0 && r2 < N_RANKS - 1; r2 += sign) {
+                    Piece ahead = pos->placement[f + df][r2];
+                    if (
+                        piece_as_white(ahead) == P_WHITE
+                        && piece_color(ahead) != piece_color(found)
+                    ) {
+                        is_passed = 0;
+                        break;
+                    }
+                }
+            }
+            if (is_passed) {
+                add_eval_term(acc,
+                    &eval_weights.passed_pawn[side ? N_RANKS - 1 - r : r],
+                    sign, trace);
+            }
+        }
+        for (int side = 0; side < 2; side++) {
+            if (n_pawns[side][f] > 1) {
+                add_eval_term(acc, &eval_weights.doubled_pawn,
+                            (side ? -1 : 1) * (n_pawns[side][f] - 1), trace);
+            }
+        }
+    }
+}
+
+void add_cached_pawn_structure_terms(Pos *pos, Score *acc) {
+    uint64_t key = pawn_key(pos);
+    PawnHashEntry *entry = &ctx->pawn_hash[key & (PAWN_HASH_N_ENTRIES - 1)];
+    if (entry->key == key) {
+        ctx->n_pawn_hash_hits++;
+    } else {
+        ctx->n_pawn_hash_misses++;
+        entry->key = key;
+        entry->score.mg = 0;
+        entry->score.eg = 0;
+        add_pawn_structure_terms(pos, &entry->score, NULL);
+    }
+    acc->mg += entry->score.mg;
+    acc->eg += entry->score.eg;
+}
+
+int is_sq_near(Sq a, Sq b) {
+    return abs(a.f - b.f) <= 1 && abs(a.r - b.r) <= 1;
+}
+
+void add_piece_activity_terms(
+    Pos *pos, Sq *king_sqs, int *has_queen, Score *acc, EvalTrace *trace
+) {
+    /* Mobility of the knights, bishops, rooks and queens, and their attacks
+     * on the squares around the opponent's king while the opponent's own
+     * queen is still on the board. Pins and checks are ignored. */
+    for (int f = 0; f < N_FILES; f++) {
+        for (int r = 0; r < N_RANKS; r++) {
+            Piece piece = pos->placement[f][r];
+            Piece wp = piece_as_white(piece);
+            if (
+                piece == PIECE_EMPTY || wp == P_WHITE || wp == K_WHITE
+            ) {
+                continue;
+            }
+            Color color = piece_color(piece);
+            int side = color == COLOR_BLACK;
+            ApplyDirFn *dir_fns;
+            int max_distance = N_FILES;
+            if (wp == N_WHITE) {
+                dir_fns = knight_dir_fns;
+                max_distance = 1;
+            } else if (wp == B_WHITE) {
+                dir_fns = bishop_dir_fns;
+            } else if (wp == R_WHITE) {
+                dir_fns = rook_dir_fns;
+            } else {
+                dir_fns = queen_dir_fns;
+            }
+            int n_moves = 0;
+            int n_king_attacks = 0;
+            ApplyDirFn dir_fn;
+            for (int i = 0; (dir_fn = dir_fns[i]) != NULL; i++) {
+                Sq sq = make_sq(f, r);
+                for (int d = 0; d < max_distance; d++) {
+                    dir_fn(&sq);
+                    if (sq.f < 0 || sq.f > 7 || sq.r < 0 || sq.r > 7) {
+                        break;
+                    }
+                    Piece found = get_piece_at_sq(pos, sq);
+                    if (is_sq_near(sq, king_sqs[!side])) {
+                        n_king_attacks++;
+                    }
+                    if (found != PIECE_EMPTY) {
+                        if (piece_color(found) != color) {
+                            n_moves++;
+                        }
+                        break;
+                    }
+                    n_moves++;
+                }
+            }
+            int sign = side ? -1 : 1;
+            add_eval_term(acc, &eval_weights.mobility[(int) wp],
+                                                    sign * n_moves, trace);
+            if (has_queen[!side]) {
+                add_eval_term(acc, &eval_weights.king_zone_attack,
+                                            sign * n_king_attacks, trace);
+            }
+        }
+    }
+}
+
+void add_king_shield_terms(
+    Pos *pos, Sq king_sq, Color color, Score *acc, EvalTrace *trace
+) {
+    /* Own pawns right in front of the king, or else one square further. */
+    int dir = color == COLOR_WHITE ? 1 : -1;
+    for (int f = king_sq.f - 1; f <= king_sq.f + 1; f++) {
+        if (f < 0 || f >= N_FILES) {
+            continue;
+        }
+        for (int d = 1; d <= 2; d++) {
+            int r = king_sq.r + d * dir;
+            if (
+                r >= 0 && r < N_RANKS
+                && pos->placement[f][r] == (color | UNCOLORED_PAWN)
+            ) {
+                add_eval_term(acc, &eval_weights.king_shield[d - 1],
+                                                            dir, trace);
+                break;
+            }
+        }
+    }
+}
+
+Val tapered_static_val(Pos *pos, EvalTrace *trace) {
+    /* The static value of a position that is neither mate nor stalemate:
+     * material, piece-square tables, pawn structure, mobility and king
+     * safety, blended by game phase. King safety only counts while the
+     * opponent has a queen. Unlike position_static_val it does not generate
+     * moves, and with a trace it does not use the pawn hash either, so with
+     * a trace it can be called from several threads. trace may be NULL;
+     * otherwise it must be zeroed by the caller. */
+    Score acc = { 0, 0 };
+    Sq king_sqs[2] = { make_sq(0, 0), make_sq(0, 0) };
+    int has_queen[2] = { 0, 0 };
+    int phase = 0;
+    /* Material and phase come from the number of pieces of each kind,
+     * counted with one scan of the board per kind. */
+    for (int side = 0; side < 2; side++) {
+        Color color = side ? COLOR_BLACK : COLOR_WHITE;
+        int sign = side ? -1 : 1;
+        for (Piece wp = P_WHITE; wp <= K_WHITE; wp++) {
+            uint64_t mask = placement_piece_mask(pos, color | wp);
+            if (mask == 0) {
+                continue;
+            }
+            int count = __builtin_popcountll(mask);
+            add_eval_term(&acc, &eval_weights.material[(int) wp],
+                                                        sign * count, trace);
+            phase += game_phase_vals[(int) wp] * count;
+            if (wp == K_WHITE) {
+                king_sqs[side] = placement_bit_to_sq(__builtin_ctzll(mask));
+            } else if (wp == Q_WHITE) {
+                has_queen[side] = 1;
+            }
+            for (; mask != 0; mask &= mask - 1) {
+                Sq sq = placement_bit_to_sq(__builtin_ctzll(mask));
+                int index = sq_index(sq) ^ (side ? 56 : 0);
+                add_eval_term(&acc, &eval_weights.pst[(int) wp][index],
+                                                                sign, trace);
+            }
+        }
+    }
+    if (trace == NULL) {
+        add_cached_pawn_structure_terms(pos, &acc);
+    } else {
+        add_pawn_structure_terms(pos, &acc, trace);
+    }
+    add_piece_activity_terms(pos, king_sqs, has_queen, &acc, trace);
+    if (has_queen[1]) {
+        add_king_shield_terms(pos, king_sqs[0], COLOR_WHITE, &acc, trace);
+    }
+    if (has_queen[0]) {
+        add_king_shield_terms(pos, king_sqs[1], COLOR_BLACK, &acc, trace);
+    }
+    if (phase > MAX_GAME_PHASE) {
+        phase = MAX_GAME_PHASE;
+    }
+    if (trace != NULL) {
+        trace->phase = phase;
+    }
+    return (acc.mg * phase + acc.eg * (MAX_GAME_PHASE - phase))
+                                                            / MAX_GAME_PHASE;
+}
+
+/* NNUE evaluation: a network with one hidden layer whose inputs are the
+ * pieces on their squares, 768 of them, seen once from white's side and
+ * once from black's, with the board flipped. The first layer's outputs
+ * for a side, its accumulator, only change in a few columns from one
+ * position to the next, so the accumulators are kept by search height in
+ * nnue_stack and updated from those one height up as the search makes
+ * moves, rather than summed up again. The value is NNUE_SCALE times the
+ * output, in centipawns for the side to move.
+ *
+ * A network file holds "CWNN", NNUE_FILE_VERSION and NNUE_N_HIDDEN as
+ * 32-bit numbers, then the first-layer weights by feature and the
+ * first-layer biases as 16-bit numbers scaled by NNUE_QA, the output
+ * weights, the side to move's first, as 8-bit numbers scaled by NNUE_QB,
+ * and the output bias as a 32-bit number scaled by NNUE_QA * NNUE_QB, all
+ * little-endian. See nnuetrain_main. */
+
+#define NNUE_FILE_VERSION 1
+#define NNUE_FILE_SIZE ( 12 + NNUE_N_FEATURES * NNUE_N_HIDDEN * 2 \
+                            + NNUE_N_HIDDEN * 2 + 2 * NNUE_N_HIDDEN + 4 )
+/* Accumulators are updated rather than computed again if at most this
+ * many squares changed. */
+#define NNUE_MAX_UPDATED_SQUARES 4
+
+typedef struct NnueNetwork {
+    int16_t feature_weights[NNUE_N_FEATURES][NNUE_N_HIDDEN];
+    int16_t feature_biases[NNUE_N_HIDDEN];
+    /* 8-bit in the file, widened for the kernels. */
+    int16_t output_weights[2 * NNUE_N_HIDDEN];
+    int32_t output_bias;
+} NnueNetwork;
+
+typedef struct NnueAccumulator {
+    /* White's side first. */
+    int16_t vals[2][NNUE_N_HIDDEN];
+    /* The placement the accumulators are for, if is_computed. */
+    Piece placement[N_FILES][N_RANKS];
+    int is_computed;
+} NnueAccumulator;
+
+int nnue_feature(Piece piece, Sq sq, int side) {
+    /* The input for piece on sq as seen from side (1 for black). */
+    int is_own = (piece_color(piece) == COLOR_BLACK) == side;
+    int index = sq_index(sq) ^ (side ? 56 : 0);
+    return ((!is_own * 6) + piece_as_white(piece) - 1) * N_FILES * N_RANKS
+                                                                    + index;
+}
+
+int read_nnue_network(const char *path) {
+    /* Read a network file and evaluate with it from now on. Return 0 on
+     * success and -1 on failure. */
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s for reading.\n", path);
+        return -1;
+    }
+    unsigned char *buf = malloc(NNUE_FILE_SIZE + 1);
+    NnueNetwork *network = malloc(sizeof(NnueNetwork));
+    if (buf == NULL || network == NULL) {
+        fprintf(stderr, "Could not allocate memory. Aborting...\n");
+        abort();
+    }
+    size_t n_read = fread(buf, 1, NNUE_FILE_SIZE + 1, f);
+    fclose(f);
+    if (
+        n_read != NNUE_FILE_SIZE
+        || memcmp(buf, "CWNN", 4) != 0
+        || get_le(buf + 4, 4) != NNUE_FILE_VERSION
+        || get_le(buf + 8, 4) != NNUE_N_HIDDEN
+    ) {
+        fprintf(stderr, "%s is not a network file of this version.\n", path);
+        free(buf);
+        free(network);
+        return -1;
+    }
+    unsigned char *p = buf + 12;
+    for (int i = 0; i < NNUE_N_FEATURES; i++) {
+        for (int j = 0; j < NNUE_N_HIDDEN; j++, p += 2) {
+            network->feature_weights[i][j] = (int16_t) get_le(p, 2);
+        }
+    }
+    for (int j = 0; j < NNUE_N_HIDDEN; j++, p += 2) {
+        network->feature_biases[j] = (int16_t) get_le(p, 2);
+    }
+    for (int j = 0; j < 2 * NNUE_N_HIDDEN; j++, p++) {
+        network->output_weights[j] = (int8_t) *p;
+    }
+    network->output_bias = (int32_t) get_le(p, 4);
+    /* FNV-1a of the file. */
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < NNUE_FILE_SIZE; i++) {
+        hash = (hash ^ buf[i]) * 0x100000001b3ULL;
+    }
+    free(buf);
+    free(ctx->nnue_network);
+    ctx->nnue_network = network;
+    ctx->nnue_key = hash;
+    for (int i = 0; i < MAX_SEARCH_PLY + 2; i++) {
+        ctx->nnue_stack[i].is_computed = 0;
+    }
+    return 0;
+}
+
+int write_nnue_network(char *path, NnueNetwork *network) {
+    /* Return 0 on success and -1 on failure. The output weights have to
+     * fit in 8 bits. */
+    unsigned char *buf = malloc(NNUE_FILE_SIZE);
+    if (buf == NULL) {
+        fprintf(stderr, "Could not allocate memory. Aborting...\n");
+        abort();
+    }
+    memcpy(buf, "CWNN", 4);
+    put_le(buf + 4, NNUE_FILE_VERSION, 4);
+    put_le(buf + 8, NNUE_N_HIDDEN, 4);
+    unsigned char *p = buf + 12;
+    for (int i = 0; i < NNUE_N_FEATURES; i++) {
+        for (int j = 0; j < NNUE_N_HIDDEN; j++, p += 2) {
+            put_le(p, (uint16_t) network->feature_weights[i][j], 2);
+        }
+    }
+    for (int j = 0; j < NNUE_N_HIDDEN; j++, p += 2) {
+        put_le(p, (uint16_t) network->feature_biases[j], 2);
+    }
+    for (int j = 0; j < 2 * NNUE_N_HIDDEN; j++, p++) {
+        *p = (uint8_t) (int8_t) network->output_weights[j];
+    }
+    put_le(p, (uint32_t) network->output_bias, 4);
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s for writing.\n", path);
+        free(buf);
+        return -1;
+    }
+    size_t n_written = fwrite(buf, 1, NNUE_FILE_SIZE, f);
+    free(buf);
+    if (fclose(f) != 0 || n_written != NNUE_FILE_SIZE) {
+        fprintf(stderr, "Could not write %s.\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+void nnue_refresh(NnueAccumulator *acc, Pos *pos) {
+    /* Compute the accumulators of pos from scratch. */
+    for (int side = 0; side < 2; side++) {
+        memcpy(acc->vals[side], ctx->nnue_network->feature_biases,
+                                            sizeof(acc->vals[side]));
+    }
+    uint64_t mask = ~placement_piece_mask(pos, PIECE_EMPTY);
+    for (; mask != 0; mask &= mask - 1) {
+        Sq sq = placement_bit_to_sq(__builtin_ctzll(mask));
+        Piece piece = get_piece_at_sq(pos, sq);
+        for (int side = 0; side < 2; side++) {
+            nnue_add(acc->vals[side], ctx->nnue_network->feature_weights[
+                                            nnue_feature(piece, sq, side)]);
+        }
+    }
+}
+
+void nnue_update_accumulator(int height, Pos *pos) {
+    /* Bring nnue_stack[height] up to date with pos, from the accumulators
+     * one height up if they are computed and only a few squares differ,
+     * e.g. after a move. */
+    NnueAccumulator *acc = &ctx->nnue_stack[height];
+    if (
+        acc->is_computed
+        && memcmp(acc->placement, pos->placement, sizeof(pos->placement)) == 0
+    ) {
+        return;
+    }
+    NnueAccumulator *parent = height > 0 ? &ctx->nnue_stack[height - 1] : NULL;
+    uint64_t changed = 0;
+    if (parent != NULL && parent->is_computed) {
+        const Piece *a = &parent->placement[0][0];
+        const Piece *b = &pos->placement[0][0];
+        for (int i = 0; i < N_FILES * N_RANKS; i++) {
+            changed |= (uint64_t) (a[i] != b[i]) << i;
+        }
+    }
+    if (
+        parent == NULL || !parent->is_computed
+        || __builtin_popcountll(changed) > NNUE_MAX_UPDATED_SQUARES
+    ) {
+        nnue_refresh(acc, pos);
+    } else {
+        memcpy(acc->vals, parent->vals, sizeof(acc->vals));
+        for (; changed != 0; changed &= changed - 1) {
+            Sq sq = placement_bit_to_sq(__builtin_ctzll(changed));
+            Piece before = parent->placement[sq.f][sq.r];
+            Piece after = pos->placement[sq.f][sq.r];
+            for (int side = 0; side < 2; side++) {
+                if (before != PIECE_EMPTY) {
+                    nnue_sub(acc->vals[side], ctx->nnue_network->feature_weights[
+                                            nnue_feature(before, sq, side)]);
+                }
+                if (after != PIECE_EMPTY) {
+                    nnue_add(acc->vals[side], ctx->nnue_network->feature_weights[
+                                            nnue_feature(after, sq, side)]);
+                }
+            }
+        }
+    }
+    memcpy(acc->placement, pos->placement, sizeof(pos->placement));
+    acc->is_computed = 1;
+}
+
+void nnue_make_move(int height, Pos *pos, Pos *next_pos) {
+    /* Called by the search as it goes from pos at height to next_pos. As
+     * every height has its own accumulators, going back up needs nothing. */
+    nnue_update_accumulator(height, pos);
+    nnue_update_accumulator(height + 1, next_pos);
+}
+
+Val nnue_static_val(Pos *pos, int height) {
+    /* The value of pos under nnue_network. height is pos's height in the
+     * search, or -1 for a position outside the search. */
+    if (height < 0) {
+        height = MAX_SEARCH_PLY + 1;
+    }
+    nnue_update_accumulator(height, pos);
+    NnueAccumulator *acc = &ctx->nnue_stack[height];
+    int side = pos->active_color == COLOR_BLACK;
+    int64_t output = nnue_output(acc->vals[side], acc->vals[!side],
+                                            ctx->nnue_network->output_weights)
+                                                + ctx->nnue_network->output_bias;
+    Val val = output * NNUE_SCALE / (NNUE_QA * NNUE_QB);
+    /* Clear of the mate values. */
+    if (val > MATE_VAL_MIN - 1) {
+        val = MATE_VAL_MIN - 1;
+    } else if (val < -(MATE_VAL_MIN - 1)) {
+        val = -(MATE_VAL_MIN - 1);
+    }
+    return side ? -val : val;
+}
+
+Val static_val(Pos *pos, int height) {
+    /* The static value of a position that is neither mate nor stalemate,
+     * from nnue_network if one is loaded and tapered_static_val otherwise.
+     * height is as for nnue_static_val. */
+    if (ctx->nnue_network != NULL) {
+        return nnue_static_val(pos, height);
+    }
+    return tapered_static_val(pos, NULL);
+}
+
+Val position_static_val(Pos *pos) {
+    /* Mate and stalemate are told from other positions without generating
+     * all the moves. */
+    if (!has_legal_move(pos)) {
+        return is_king_in_check(pos) == 1 ?
+                                        mated_val(pos->active_color, 0) : 0;
+    }
+    return static_val(pos, -1);
+}
+
+void print_eval_result(EvalResult *er) {
+    char buf[16];
+    val_to_str(er->val, buf);
+    printf("EvalResult: val: %s\n", buf);
+}
+
+
+void reset_buffers() {
+    ctx->move_buffer_current = ctx->move_buffer_start;
+    ctx->eval_result_array_buffer_current = ctx->eval_result_array_buffer_start;
+}
+
+void set_line(MoveLine *line, Move move, MoveLine *rest) {
+    /* Set line to move followed by rest. */
+    int rest_len = rest->len;
+    if (rest_len > MAX_SEARCH_PLY - 1) {
+        rest_len = MAX_SEARCH_PLY - 1;
+    }
+    line->moves[0] = move;
+    memcpy(line->moves + 1, rest->moves, rest_len * sizeof(Move));
+    line->len = rest_len + 1;
+}
+
+void append_line(MoveLine *line, MoveLine *rest) {
+    int rest_len = rest->len;
+    if (rest_len > MAX_SEARCH_PLY - line->len) {
+        rest_len = MAX_SEARCH_PLY - line->len;
+    }
+    memcpy(line->moves + line->len, rest->moves, rest_len * sizeof(Move));
+    line->len += rest_len;
+}
+
+int is_val_better(Val a, Val b, Color color) {
+    /* Return 1 if a is strictly better than b for the side color. */
+    if (color == COLOR_WHITE) {
+        return a > b;
+    } else {
+        return a < b;
+    }
+}
+
+void select_best_results(EvalResult *ers, int n, int k, Color color) {
+    /* Move the k best of the n results to the front of ers, best first. The
+     * order of the rest is unspecified. Ties keep their original order. */
+    if (k > n) {
+        k = n;
+    }
+    for (int i = 0; i < k; i++) {
+        int best = i;
+        for (int j = i + 1; j < n; j++) {
+            if (is_val_better(ers[j].val, ers[best].val, color)) {
+                best = j;
+            }
+        }
+        if (best != i) {
+            EvalResult tmp = ers[i];
+            ers[i] = ers[best];
+            ers[best] = tmp;
+        }
+    }
+}
+
+int has_non_pawn_material(Pos *pos, Color color) {
+    return (placement_color_mask(pos, color)
+                & ~placement_piece_mask(pos, color | UNCOLORED_PAWN)
+                & ~placement_piece_mask(pos, color | UNCOLORED_KING)) != 0;
+}
+
+int gives_check(Pos *next_pos) {
+    /* Whether the move that led to next_pos checks the side now to move. */
+    return is_king_in_check(next_pos) == 1;
+}
+
+int has_checking_move(Pos *pos) {
+    Pos next_pos;
+    explore_position(pos);
+    for (int i = 0; i < pos->moves_len; i++) {
+        position_after_move(pos, &pos->p_moves[i], &next_pos);
+        if (gives_check(&next_pos)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void position_after_null_move(Pos *pos, Pos *new_pos) {
+    /* The side to move passes. */
+    init_position(new_pos);
+    memcpy(new_pos->placement, pos->placement, sizeof(pos->placement));
+    new_pos->castling = pos->castling;
+    new_pos->active_color = toggled_color(pos->active_color);
+}
+
+/* Transposition table.
+ *
+ * One entry per slot, indexed by the low bits of the position key and
+ * replaced unless the slot holds a deeper result for the same position.
+ * Mate values are stored relative to the node instead of the root, so that
+ * they stay right when the position is reached at another height. */
+
+#define TT_DEFAULT_N_ENTRIES ( 1 << 20 )
+
+enum TTBound {
+    TTBoundNone,
+    TTBoundExact,
+    TTBoundLower,
+    TTBoundUpper,
+};
+
+typedef struct TTEntry {
+    uint64_t key;
+    int16_t val;
+    uint16_t best_move;
+    uint8_t ply;
+    uint8_t bound;
+} TTEntry;
+
+void tt_resize(uint64_t n_entries) {
+    /* n_entries must be a power of two. The table is cleared. */
+    free(ctx->tt);
+    ctx->tt = calloc(n_entries, sizeof(TTEntry));
+    if (ctx->tt == NULL) {
+        fprintf(stderr, "Could not allocate memory. Aborting...\n");
+        abort();
+    }
+    ctx->tt_n_entries = n_entries;
+}
+
+void tt_clear() {
+    if (ctx->tt != NULL) {
+        memset(ctx->tt, 0, ctx->tt_n_entries * sizeof(TTEntry));
+    }
+}
+
+TTEntry *tt_entry(uint64_t key) {
+    if (ctx->tt == NULL) {
+        tt_resize(TT_DEFAULT_N_ENTRIES);
+    }
+    return &ctx->tt[key & (ctx->tt_n_entries - 1)];
+}
+
+Val val_to_tt(Val val, int height) {
+    if (val >= MATE_VAL_MIN) { return val + height; }
+    if (val <= -MATE_VAL_MIN) { return val - height; }
+    return val;
+}
+
+Val val_from_tt(Val val, int height) {
+    if (val >= MATE_VAL_MIN) { return val - height; }
+    if (val <= -MATE_VAL_MIN) { return val + height; }
+    return val;
+}
+
+uint64_t search_flags_key(PruneStrategy *prune_strat, int do_quiescence_search) {
+    /* Mixed into position keys so that results of searches with different
+     * settings are kept apart. */
+    uint64_t flags =
+        prune_strat->selectivity << 3
+        | prune_strat->type << 1
+        | (do_quiescence_search != 0);
+    return flags * 0x9E3779B97F4A7C15ULL;
+}
+
+void tt_store(
+    uint64_t key,
+    int height,
+    Ply ply,
+    Val val,
+    Val alpha,
+    Val beta,
+    Move *best_move
+) {
+    /* alpha and beta are the window the value was searched with. */
+    if (ctx->is_interrupted) {
+        return;
+    }
+    TTEntry *entry = tt_entry(key);
+    if (entry->key == key && entry->ply > ply) {
+        return;
+    }
+    entry->key = key;
+    entry->val = val_to_tt(val, height);
+    entry->best_move = best_move == NULL ? 0 : pack_move(*best_move);
+    entry->ply = ply;
+    if (val <= alpha) {
+        entry->bound = TTBoundUpper;
+    } else if (val >= beta) {
+        entry->bound = TTBoundLower;
+    } else {
+        entry->bound = TTBoundExact;
+    }
+}
+
+Val move_material_val(Pos *pos, Move *move) {
+    /* The change in material that move makes, from white's point of view. */
+    Val val = -piece_val(get_piece_at_sq(pos, move->to));
+    if (move->promotion_to != PIECE_EMPTY) {
+        val += piece_val(move->promotion_to)
+                    - piece_val(get_piece_at_sq(pos, move->from));
+    }
+    return val;
+}
+
+int is_move_pruned(Pos *pos, Move *move, PruneStrategy *prune_strat) {
+    if (prune_strat->type == PruneStrategyTypePruneLowValChanges) {
+        Val diff = move_material_val(pos, move);
+        /* Keep evaluating only the moves that change the material by at
+         * least the cutoff. */
+        return diff < prune_strat->cutoff && diff > -prune_strat->cutoff;
+    }
+    return 0;
+}
+
+/* Move ordering rank of each uncolored piece, from pawn (least valuable) to
+ * king. */
+int piece_order_rank[8] = {
+    [UNCOLORED_PAWN] = 1,
+    [UNCOLORED_KNIGHT] = 2,
+    [UNCOLORED_BISHOP] = 3,
+    [UNCOLORED_ROOK] = 4,
+    [UNCOLORED_QUEEN] = 5,
+    [UNCOLORED_KING] = 6,
+};
+
+int move_order_score(Pos *pos, Move *move) {
+    /* Captures first, most valuable victim first and then least valuable
+     * attacker first, followed by promotions and then the rest. */
+    Piece victim = get_piece_at_sq(pos, move->to);
+    int score = 0;
+    if (victim != PIECE_EMPTY) {
+        Piece attacker = get_piece_at_sq(pos, move->from);
+        score += 1000 + 10 * piece_order_rank[piece_as_white(victim)]
+                                - piece_order_rank[piece_as_white(attacker)];
+    }
+    if (move->promotion_to != PIECE_EMPTY) {
+        score += 100 + piece_order_rank[piece_as_white(move->promotion_to)];
+    }
+    return score;
+}
+
+void sort_moves(Pos *pos, Move *moves, int n, uint16_t first_move) {
+    /* Order moves of pos in place so that alpha-beta cuts off early.
+     * first_move, packed, goes first if it is among them; 0 for none. The
+     * sort is stable; moves of equal score stay in generation order. */
+    int scores[n > 0 ? n : 1];
+    for (int i = 0; i < n; i++) {
+        scores[i] = move_order_score(pos, &moves[i]);
+        if (first_move != 0 && pack_move(moves[i]) == first_move) {
+            scores[i] = 1 << 20;
+        }
+    }
+    for (int i = 1; i < n; i++) {
+        Move move = moves[i];
+        int score = scores[i];
+        int j = i;
+        for (; j > 0 && scores[j-1] < score; j--) {
+            moves[j] = moves[j-1];
+            scores[j] = scores[j-1];
+        }
+        moves[j] = move;
+        scores[j] = score;
+    }
+}
+
+void order_moves(Pos *pos, uint16_t first_move) {
+    sort_moves(pos, pos->p_moves, pos->moves_len, first_move);
+}
+
+/* Staged move generation.
+ *
+ * A node that cuts off on its first move should not pay for generating and
+ * legality testing all the others, so search_val takes the moves of an
+ * unexplored position in stages, each generated once the previous one is
+ * used up: the transposition table move, then captures and promotions,
+ * then quiet moves. In check, every move is an evasion; they are generated
+ * in one stage, and only to the squares that can answer the check. The
+ * quiescence search stops after the captures.
+ *
+ * Each stage is appended to the position's move list, so that the list
+ * stays in one piece: the move buffer is first rewound to the end of the
+ * list, over the moves that searching the earlier moves left behind and
+ * that nothing refers to any more. An explored position already has all
+ * its moves, which are only ordered. */
+
+enum MoveStage {
+    MoveStageExplored,
+    MoveStageTT,
+    MoveStageCaptures,
+    MoveStageQuiets,
+    MoveStageEvasions,
+    MoveStageDone,
+};
+
+typedef struct MovePicker {
+    Pos *pos;
+    enum MoveStage stage;
+    uint16_t tt_move;
+    /* Whether the TT stage found tt_move, which later stages then skip. */
+    int has_tt_move;
+    int only_captures;
+    /* The next move of pos->p_moves to hand out. */
+    int index;
+} MovePicker;
+
+void init_move_picker(
+    MovePicker *picker, Pos *pos, uint16_t tt_move, int only_captures
+) {
+    /* tt_move is packed, 0 for none. only_captures leaves out quiet moves
+     * unless the side to move is in check. */
+    picker->pos = pos;
+    picker->tt_move = tt_move;
+    picker->has_tt_move = 0;
+    picker->only_captures = only_captures;
+    picker->index = 0;
+    if (pos->is_explored) {
+        order_moves(pos, tt_move);
+        picker->stage = MoveStageExplored;
+        return;
+    }
+    if (pos->is_king_in_check == -2) {
+        pos->is_king_in_check = is_king_in_check(pos);
+    }
+    pos->p_moves = ctx->move_buffer_current;
+    pos->moves_len = 0;
+    picker->stage = MoveStageTT;
+    ctx->n_pos_explored += 1;
+}
+
+void generate_move_stage(MovePicker *picker) {
+    /* Append the moves of the current stage and go to the next one. */
+    Pos *pos = picker->pos;
+    ctx->move_buffer_current = pos->p_moves + pos->moves_len;
+    int start = pos->moves_len;
+    int is_in_check = pos->is_king_in_check == 1;
+    uint64_t targets = is_in_check ? evasion_targets(pos) : ALL_SQUARES;
+    if (picker->stage == MoveStageTT) {
+        picker->stage = is_in_check ? MoveStageEvasions : MoveStageCaptures;
+        if (picker->tt_move == 0) {
+            return;
+        }
+        /* Only the moves of the piece the move is made with are generated,
+         * which also proves that it is legal here. */
+        Move tt_move = unpack_move(picker->tt_move, pos->active_color);
+        Piece piece = get_piece_at_sq(pos, tt_move.from);
+        if (piece_color(piece) == pos->active_color) {
+            append_legal_moves_for_piece(
+                            pos, tt_move.from, piece, MoveKindAll, targets);
+        }
+        for (int i = start; i < pos->moves_len; i++) {
+            if (pack_move(pos->p_moves[i]) == picker->tt_move) {
+                pos->p_moves[start] = pos->p_moves[i];
+                picker->has_tt_move = 1;
+                break;
+            }
+        }
+        pos->moves_len = start + picker->has_tt_move;
+        ctx->move_buffer_current = pos->p_moves + pos->moves_len;
+        return;
+    }
+    if (picker->stage == MoveStageCaptures) {
+        append_legal_moves(pos, MoveKindCaptures, targets);
+        picker->stage =
+                picker->only_captures ? MoveStageDone : MoveStageQuiets;
+    } else if (picker->stage == MoveStageQuiets) {
+        append_legal_moves(pos, MoveKindQuiets, targets);
+        picker->stage = MoveStageDone;
+    } else if (picker->stage == MoveStageEvasions) {
+        append_legal_moves(pos, MoveKindAll, targets);
+        picker->stage = MoveStageDone;
+    }
+    for (int i = start; picker->has_tt_move && i < pos->moves_len; i++) {
+        if (pack_move(pos->p_moves[i]) == picker->tt_move) {
+            memmove(&pos->p_moves[i], &pos->p_moves[i+1],
+                                (pos->moves_len - i - 1) * sizeof(Move));
+            pos->moves_len--;
+            ctx->move_buffer_current--;
+            break;
+        }
+    }
+    sort_moves(pos, pos->p_moves + start, pos->moves_len - start, 0);
+}
+
+Move *next_move(MovePicker *picker) {
+    /* The next move to search, or NULL once there are no more. */
+    Pos *pos = picker->pos;
+    while (picker->index == pos->moves_len) {
+        if (
+            picker->stage == MoveStageExplored
+            || picker->stage == MoveStageDone
+        ) {
+            return NULL;
+        }
+        generate_move_stage(picker);
+    }
+    return &pos->p_moves[picker->index++];
+}
+
+Val search_val(
+    Pos *pos,
+    Ply ply,
+    int height,
+    Val alpha,
+    Val beta,
+    PruneStrategy *prune_strat,
+    int do_quiescence_search
+);
+
+int move_extension(
+    Pos *next_pos,
+    Ply ply,
+    int height,
+    int extensions,
+    int is_single_reply,
+    int is_singular
+) {
+    /* The number of half-moves to extend the move that led from the node
+     * at height to next_pos by, 0 or 1, and note it in line_extensions. */
+    int extension = 0;
+    if (
+        extensions
+        && ctx->line_extensions[height] < ctx->root_ply
+        && height + ply + 1 < MAX_SEARCH_PLY
+    ) {
+        if (
+            (extensions & SelectivityCheckExtension)
+            && next_pos->is_king_in_check == -2
+        ) {
+            next_pos->is_king_in_check = is_king_in_check(next_pos);
+        }
+        extension =
+            ((extensions & SelectivityCheckExtension)
+                                    && next_pos->is_king_in_check == 1)
+            || ((extensions & SelectivityOneReplyExtension) && is_single_reply)
+            || ((extensions & SelectivitySingularExtension) && is_singular);
+    }
+    ctx->line_extensions[height + 1] = ctx->line_extensions[height] + extension;
+    return extension;
+}
+
+int is_singular_move(
+    Pos *pos,
+    uint16_t tt_move,
+    Ply ply,
+    int height,
+    Val tt_val,
+    PruneStrategy *prune_strat,
+    int do_quiescence_search
+) {
+    /* Whether all the moves of pos but tt_move, which is worth tt_val, fall
+     * short of it by SINGULAR_MARGIN when searched to half of ply. */
+    explore_position(pos);
+    int sign = pos->active_color == COLOR_WHITE ? 1 : -1;
+    Val bound = tt_val - sign * SINGULAR_MARGIN;
+    Pos next_pos;
+    for (int i = 0; i < pos->moves_len; i++) {
+        if (pack_move(pos->p_moves[i]) == tt_move) {
+            continue;
+        }
+        position_after_move(pos, &pos->p_moves[i], &next_pos);
+        if (ctx->nnue_network != NULL) {
+            nnue_make_move(height, pos, &next_pos);
+        }
+        ctx->line_extensions[height + 1] = ctx->line_extensions[height];
+        Val val = search_val(&next_pos, ply / 2, height + 1,
+                bound - (sign > 0 ? 0 : 1), bound + (sign > 0 ? 1 : 0),
+                prune_strat, do_quiescence_search);
+        if (sign * (val - bound) > 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+Val search_node_val(
+    Pos *pos,
+    Ply ply,
+    int height,
+    Val alpha,
+    Val beta,
+    PruneStrategy *prune_strat,
+    int do_quiescence_search
+) {
+    /* Return the value of pos searched to ply with alpha-beta pruning and
+     * leave its best line in pv_table[height]. alpha is the value white is
+     * already assured of and beta the value black is already assured of. A
+     * value strictly between them is exact. A value at or below alpha is an
+     * upper bound and one at or above beta is a lower bound; the line is
+     * then of no use. */
+    ctx->pv_table[height].len = 0;
+    if (ctx->deadline > 0 && --ctx->nodes_until_time_check <= 0) {
+        ctx->nodes_until_time_check = TIME_CHECK_N_NODES;
+        if (seconds_now() >= ctx->deadline) {
+            ctx->stop = 1;
+        }
+    }
+    if (ctx->stop) {
+        ctx->is_interrupted = 1;
+        return 0;
+    }
+    Val tb_val;
+    if (height > 0 && probe_tablebases(pos, height, &tb_val)) {
+        if (beta - alpha > 1) {
+            tablebase_line(pos, &ctx->pv_table[height], MAX_SEARCH_PLY - height);
+        }
+        return tb_val;
+    }
+    /* The transposition table is only used by the main search, not by the
+     * quiescence search. It is probed before the moves are generated. An
+     * exact entry is not used in a node with an open window, since the
+     * line would be lost. */
+    int use_tt = prune_strat->type == PruneStrategyTypeNoPruning && ply > 0;
+    uint64_t key = 0;
+    uint16_t tt_move = 0;
+    /* What the entry says of tt_move, for the singular extension. */
+    int tt_bound = TTBoundNone;
+    Ply tt_ply = 0;
+    Val tt_val = 0;
+    if (use_tt) {
+        key = position_key(pos)
+                        ^ search_flags_key(prune_strat, do_quiescence_search);
+        TTEntry *entry = tt_entry(key);
+        if (entry->key == key && entry->bound != TTBoundNone) {
+            tt_move = entry->best_move;
+            tt_bound = entry->bound;
+            tt_ply = entry->ply;
+            tt_val = val_from_tt(entry->val, height);
+            if (
+                height > 0
+                && entry->ply >= ply
+                && (
+                    (entry->bound == TTBoundExact && beta - alpha <= 1)
+                    || (entry->bound == TTBoundLower && tt_val >= beta)
+                    || (entry->bound == TTBoundUpper && tt_val <= alpha)
+                )
+            ) {
+                return tt_val;
+            }
+        }
+    }
+    Val alpha_orig = alpha;
+    Val beta_orig = beta;
+    if (ply == 0) {
+        if (do_quiescence_search) {
+            return search_val(
+                pos, 20, height, alpha, beta,
+                &prune_strat_prune_low_val_changes, do_quiescence_search);
+        } else if (!has_legal_move(pos)) {
+            return is_king_in_check(pos) == 1 ?
+                                mated_val(pos->active_color, height) : 0;
+        } else {
+            return static_val(pos, height);
+        }
+    }
+    if (height >= MAX_SEARCH_PLY) {
+        fprintf(stderr, "Maximum search ply exceeded. Aborting...\n");
+        abort();
+    }
+    Color color = pos->active_color;
+    if (pos->is_king_in_check == -2) {
+        pos->is_king_in_check = is_king_in_check(pos);
+    }
+    int is_in_check = pos->is_king_in_check == 1;
+    /* Mate and stalemate are only known once all the moves have been
+     * generated, except that the selective techniques below have to know
+     * first. */
+    Val pos_static_val = 0;
+    int selectivity = prune_strat->selectivity & ~SELECTIVITY_EXTENSIONS;
+    int extensions = prune_strat->selectivity & SELECTIVITY_EXTENSIONS;
+    if (selectivity && !has_legal_move(pos)) {
+        return is_in_check ? mated_val(color, height) : 0;
+    }
+    if (prune_strat->type != PruneStrategyTypeNoPruning || selectivity) {
+        pos_static_val = static_val(pos, height);
+    }
+    /* The quiescence search generates captures and promotions only, as all
+     * other moves would be pruned anyway. */
+    int only_captures =
+        prune_strat->type == PruneStrategyTypePruneLowValChanges
+        && prune_strat->cutoff > 0;
+    Pos next_pos;
+    /* Selectivity is never applied at the root, in check or against a mate
+     * bound, since it would hide the mates we are after. own_bound is the
+     * bound the side to move has to improve on and cut_bound the one at
+     * which the opponent stops looking at this node. */
+    Val own_bound = color == COLOR_WHITE ? alpha : beta;
+    Val cut_bound = color == COLOR_WHITE ? beta : alpha;
+    int sign = color == COLOR_WHITE ? 1 : -1;
+    int is_selective = selectivity && height > 0 && !is_in_check;
+    if (
+        is_selective
+        && (selectivity & SelectivityRazoring)
+        && ply <= RAZORING_MAX_PLY
+        && !is_mate_val(own_bound)
+        && sign * (pos_static_val + sign * razoring_margins[ply] - own_bound)
+                                                                        <= 0
+        /* Checks are how sacrifices come back, and mates are what we
+         * are after. */
+        && !has_checking_move(pos)
+    ) {
+        /* Hopelessly behind near the horizon: go straight to the leaf
+         * evaluation, i.e. the quiescence search if there is one. */
+        Val val = search_val(pos, 0, height,
+                own_bound - (sign > 0 ? 0 : 1), own_bound + (sign > 0 ? 1 : 0),
+                prune_strat, do_quiescence_search);
+        if (sign * (val - own_bound) <= 0) {
+            return val;
+        }
+    }
+    if (
+        is_selective
+        && (selectivity & SelectivityNullMove)
+        && ply >= NULL_MOVE_MIN_PLY
+        && !ctx->is_null_move_line[height]
+        && !is_mate_val(cut_bound)
+        && sign * (pos_static_val - cut_bound) >= 0
+        /* Guard against zugzwang, which is common when only pawns are
+         * left. */
+        && has_non_pawn_material(pos, color)
+    ) {
+        /* If passing still keeps the value beyond the window, a real move
+         * will too. */
+        position_after_null_move(pos, &next_pos);
+        if (ctx->nnue_network != NULL) {
+            nnue_make_move(height, pos, &next_pos);
+        }
+        ctx->is_null_move_line[height+1] = 1;
+        ctx->line_extensions[height+1] = ctx->line_extensions[height];
+        Val val = search_val(&next_pos, ply - 1 - NULL_MOVE_REDUCTION,
+                height+1,
+                cut_bound - (sign > 0 ? 1 : 0), cut_bound + (sign > 0 ? 0 : 1),
+                prune_strat, do_quiescence_search);
+        ctx->is_null_move_line[height+1] = 0;
+        if (sign * (val - cut_bound) >= 0) {
+            ctx->pv_table[height].len = 0;
+            return cut_bound;
+        }
+    }
+    /* Near the horizon, quiet moves cannot bring the value back into the
+     * window. */
+    int is_futile =
+        is_selective
+        && (selectivity & SelectivityFutility)
+        && ply <= FUTILITY_MAX_PLY
+        && !is_mate_val(own_bound)
+        && sign * (pos_static_val + sign * futility_margins[ply] - own_bound)
+                                                                        <= 0;
+    /* Evasions are generated all at once anyway, so the number of replies
+     * to a check costs nothing extra to know. */
+    int is_single_reply = 0;
+    if ((extensions & SelectivityOneReplyExtension) && is_in_check) {
+        explore_position(pos);
+        is_single_reply = pos->moves_len == 1;
+    }
+    int is_singular = 0;
+    if (
+        (extensions & SelectivitySingularExtension)
+        && height > 0
+        && tt_move != 0
+        && ply >= SINGULAR_MIN_PLY
+        && tt_ply >= ply - SINGULAR_TT_PLY_MARGIN
+        && (tt_bound == TTBoundExact
+            || tt_bound == (color == COLOR_WHITE ? TTBoundLower : TTBoundUpper))
+        && !is_mate_val(tt_val)
+        && ctx->line_extensions[height] < ctx->root_ply
+    ) {
+        is_singular = is_singular_move(pos, tt_move, ply, height, tt_val,
+                                        prune_strat, do_quiescence_search);
+    }
+    MovePicker picker;
+    init_move_picker(&picker, pos, tt_move, only_captures);
+    Val best_val = 0;
+    Move *best_move = NULL;
+    Move *move_p;
+    for (int i = 0; (move_p = next_move(&picker)) != NULL; i++) {
+        Move move = *move_p;
+        position_after_move(pos, &move, &next_pos);
+        if (ctx->nnue_network != NULL) {
+            nnue_make_move(height, pos, &next_pos);
+        }
+        Ply child_ply = ply - 1 + move_extension(&next_pos, ply, height,
+            extensions, is_single_reply,
+            is_singular && pack_move(move) == tt_move);
+        Val val;
+        int is_pruned = is_move_pruned(pos, &move, prune_strat);
+        int is_quiet = 0;
+        if (
+            !is_pruned
+            && i > 0
+            && (is_futile || (selectivity & SelectivityLateMoveReductions))
+        ) {
+            is_quiet =
+                is_quiet_move(pos, &move) && !gives_check(&next_pos);
+        }
+        if (!is_pruned && is_futile && is_quiet) {
+            is_pruned = 1;
+        }
+        if (is_pruned) {
+            /* Stop evaluating; stay with the static value of pos. */
+            val = pos_static_val;
+        } else if (i == 0) {
+            val = search_val(
+                &next_pos, child_ply, height+1, alpha, beta,
+                prune_strat, do_quiescence_search);
+        } else {
+            /* Principal variation search: the first move is expected to be
+             * the best, so the others are only proven not to improve on it,
+             * with a null window at own_bound. Late quiet moves are unlikely
+             * to be best and are proven so at reduced depth first. Only a
+             * move that does improve is searched again with the full
+             * window. */
+            own_bound = color == COLOR_WHITE ? alpha : beta;
+            Val null_alpha = own_bound - (sign > 0 ? 0 : 1);
+            Val null_beta = own_bound + (sign > 0 ? 1 : 0);
+            Ply scout_ply = child_ply;
+            if (
+                is_selective
+                && (selectivity & SelectivityLateMoveReductions)
+                && is_quiet
+                && ply >= LATE_MOVE_REDUCTION_MIN_PLY
+                && i >= LATE_MOVE_REDUCTION_MIN_MOVES
+            ) {
+                scout_ply = child_ply - LATE_MOVE_REDUCTION;
+            }
+            val = search_val(&next_pos, scout_ply, height+1,
+                null_alpha, null_beta, prune_strat, do_quiescence_search);
+            if (scout_ply < child_ply && sign * (val - own_bound) > 0) {
+                val = search_val(&next_pos, child_ply, height+1,
+                    null_alpha, null_beta, prune_strat, do_quiescence_search);
+            }
+            if (
+                sign * (val - own_bound) > 0
+                && val > alpha && val < beta
+                && beta - alpha > 1
+            ) {
+                val = search_val(
+                    &next_pos, child_ply, height+1, alpha, beta,
+                    prune_strat, do_quiescence_search);
+            }
+        }
+        if (i == 0 || is_val_better(val, best_val, color)) {
+            best_val = val;
+            if (is_pruned) {
+                best_move = NULL;
+                ctx->pv_table[height].len = 0;
+            } else {
+                best_move = move_p;
+                set_line(&ctx->pv_table[height], move, &ctx->pv_table[height+1]);
+            }
+        }
+        if (color == COLOR_WHITE && val > alpha) {
+            alpha = val;
+        } else if (color == COLOR_BLACK && val < beta) {
+            beta = val;
+        }
+        if (alpha >= beta) {
+            break;
+        }
+    }
+    /* The number of moves searched. */
+    int n_moves = picker.index;
+    if (
+        alpha < beta
+        && only_captures && !is_in_check
+        && has_legal_move_of_kind(pos, MoveKindQuiets)
+    ) {
+        /* The quiet moves left out would all have been pruned, staying with
+         * the static value, after the captures. */
+        if (n_moves == 0 || is_val_better(pos_static_val, best_val, color)) {
+            best_val = pos_static_val;
+            best_move = NULL;
+            ctx->pv_table[height].len = 0;
+        }
+        n_moves++;
+    }
+    if (n_moves == 0) {
+        return is_in_check ? mated_val(color, height) : 0;
+    }
+    if (use_tt) {
+        tt_store(key, height, ply, best_val, alpha_orig, beta_orig, best_move);
+    }
+    return best_val;
+}
+
+Val search_val(
+    Pos *pos,
+    Ply ply,
+    int height,
+    Val alpha,
+    Val beta,
+    PruneStrategy *prune_strat,
+    int do_quiescence_search
+) {
+    /* search_node_val, giving back the move buffer the search of pos
+     * took, so that a search only needs room for the moves of the nodes
+     * along one line. A position it explored is left unexplored again,
+     * since its moves are gone. */
+    Move *move_buffer_mark = ctx->move_buffer_current;
+    int was_explored = pos->is_explored;
+    Val val = search_node_val(pos, ply, height, alpha, beta,
+                                        prune_strat, do_quiescence_search);
+    ctx->move_buffer_current = move_buffer_mark;
+    if (!was_explored) {
+        pos->is_explored = 0;
+        pos->moves_len = 0;
+    }
+    return val;
+}
+
+enum RootWindowResult {
+    RootWindowInside,
+    RootWindowBelow,
+    RootWindowAbove,
+};
+
+EvalResult *search_root(
+    Pos *pos,
+    Ply ply,
+    Val alpha,
+    Val beta,
+    PruneStrategy *prune_strat,
+    int do_quiescence_search,
+    int multi_pv,
+    int *window_result
+) {
+    /* Search the moves of pos with the root window (alpha, beta) and return
+     * their results as position_val_at_ply does. *window_result tells
+     * whether the best value was inside the window. If it was not, the
+     * results only say that the value is at or below alpha
+     * (RootWindowBelow) or at or above beta (RootWindowAbove), and the
+     * search has to be repeated with a wider window to learn more. */
+    EvalResult *ret_val;
+    explore_position(pos);
+    ctx->root_ply = ply;
+    ctx->line_extensions[0] = 0;
+    *window_result = RootWindowInside;
+    int is_static =
+        ply == 0
+        || (pos->is_king_in_checkmate == 1)
+        || (pos->is_king_in_stalemate == 1);
+    int n_results = is_static ? 1 : pos->moves_len;
+    if (ctx->eval_result_array_buffer_current + n_results
+                                    > ctx->eval_result_array_buffer_end) {
+        fprintf(stderr,
+            "eval_result_array_buffer exhausted. Aborting...\n");
+        abort();
+    }
+    ret_val = ctx->eval_result_array_buffer_current;
+    ctx->eval_result_array_buffer_current += n_results;
+    if (is_static) {
+        ret_val[0].val = search_val(
+                    pos, ply, 0, -VAL_INFINITY, VAL_INFINITY,
+                    prune_strat, do_quiescence_search);
+        ret_val[0].line = ctx->pv_table[0];
+        return ret_val;
+    }
+    if (multi_pv < 1) {
+        multi_pv = 1;
+    }
+    /* The root has all its moves searched anyway, so of the extensions
+     * only the check extension applies. */
+    int extensions = prune_strat->selectivity & SelectivityCheckExtension;
+    Val pos_static_val = 0;
+    if (prune_strat->type != PruneStrategyTypeNoPruning) {
+        pos_static_val = position_static_val(pos);
+    }
+    uint64_t key = position_key(pos)
+                        ^ search_flags_key(prune_strat, do_quiescence_search);
+    TTEntry *entry = tt_entry(key);
+    order_moves(pos, entry->key == key ? entry->best_move : 0);
+    Color color = pos->active_color;
+    int sign = color == COLOR_WHITE ? 1 : -1;
+    /* The best multi_pv exact values so far, best first. */
+    Val best_vals[multi_pv];
+    int n_exact = 0;
+    Pos next_pos;
+    MoveLine no_line = { .len = 0 };
+    for (int i = 0; i < pos->moves_len; i++) {
+        Move move = pos->p_moves[i];
+        position_after_move(pos, &move, &next_pos);
+        if (ctx->nnue_network != NULL) {
+            nnue_make_move(0, pos, &next_pos);
+        }
+        Ply child_ply = ply - 1 + move_extension(
+                                    &next_pos, ply, 0, extensions, 0, 0);
+        Val val;
+        int is_exact = 1;
+        if (is_move_pruned(pos, &move, prune_strat)) {
+            val = pos_static_val;
+            set_line(&ret_val[i].line, move, &no_line);
+        } else {
+            /* Once there are multi_pv exact values, a move only matters if
+             * it beats the worst of them. */
+            Val lo = alpha;
+            Val hi = beta;
+            if (n_exact >= multi_pv) {
+                if (color == COLOR_WHITE && best_vals[multi_pv - 1] > lo) {
+                    lo = best_vals[multi_pv - 1];
+                } else if (
+                    color == COLOR_BLACK && best_vals[multi_pv - 1] < hi
+                ) {
+                    hi = best_vals[multi_pv - 1];
+                }
+            }
+            if (n_exact < multi_pv) {
+                val = search_val(
+                    &next_pos, child_ply, 1, lo, hi,
+                    prune_strat, do_quiescence_search);
+            } else {
+                /* A null window scout proves most moves worse cheaply. */
+                Val own_bound = color == COLOR_WHITE ? lo : hi;
+                val = search_val(&next_pos, child_ply, 1,
+                    own_bound - (sign > 0 ? 0 : 1),
+                    own_bound + (sign > 0 ? 1 : 0),
+                    prune_strat, do_quiescence_search);
+                if (sign * (val - own_bound) > 0 && val > lo && val < hi) {
+                    val = search_val(
+                        &next_pos, child_ply, 1, lo, hi,
+                        prune_strat, do_quiescence_search);
+                }
+            }
+            is_exact = val > lo && val < hi;
+            if (is_exact) {
+                set_line(&ret_val[i].line, move, &ctx->pv_table[1]);
+            } else {
+                set_line(&ret_val[i].line, move, &no_line);
+            }
+            if (
+                (color == COLOR_WHITE && val >= beta)
+                || (color == COLOR_BLACK && val <= alpha)
+            ) {
+                /* Beyond the root window: no need to look further. */
+                ret_val[i].val = val;
+                if (i != 0) {
+                    EvalResult tmp = ret_val[i];
+                    ret_val[i] = ret_val[0];
+                    ret_val[0] = tmp;
+                }
+                *window_result =
+                    color == COLOR_WHITE ? RootWindowAbove : RootWindowBelow;
+                return ret_val;
+            }
+        }
+        ret_val[i].val = val;
+        if (is_exact) {
+            /* Keep the exact results at the front. */
+            if (i != n_exact) {
+                EvalResult tmp = ret_val[i];
+                ret_val[i] = ret_val[n_exact];
+                ret_val[n_exact] = tmp;
+            }
+            int n_best = n_exact < multi_pv ? n_exact : multi_pv - 1;
+            int j = n_best;
+            for (; j > 0 && is_val_better(val, best_vals[j-1], color); j--) {
+                best_vals[j] = best_vals[j-1];
+            }
+            best_vals[j] = val;
+            n_exact++;
+        }
+    }
+    if (n_exact == 0) {
+        /* Nothing reached the root window. */
+        *window_result =
+            color == COLOR_WHITE ? RootWindowBelow : RootWindowAbove;
+        return ret_val;
+    }
+    select_best_results(ret_val, n_exact, multi_pv, color);
+    tt_store(key, 0, ply, ret_val[0].val, alpha, beta, &ret_val[0].line.moves[0]);
+    return ret_val;
+}
+
+EvalResult *position_val_at_ply(
+    Pos *pos,
+    Ply ply,
+    PruneStrategy *prune_strat,
+    int do_quiescence_search,
+    int multi_pv
+) {
+    /* Return the results of all the moves of pos. The first multi_pv of them
+     * are the best ones, best first, with exact values and their lines. The
+     * rest follow in no particular order and their values are only bounds:
+     * each is no better than the multi_pv-th best value. Pass the number of
+     * moves of pos as multi_pv to get exact values for all of them.
+     *
+     * The root moves are searched with a window that only admits values
+     * better than the multi_pv-th best value found so far, so the search
+     * costs about as much as multi_pv narrow-window searches.
+     *
+     * If pos is evaluated statically (ply is 0 or there are no moves) a
+     * single result with an empty line is returned. The results stay valid
+     * until reset_buffers is called. */
+    int window_result;
+    return search_root(pos, ply, -VAL_INFINITY, VAL_INFINITY,
+            prune_strat, do_quiescence_search, multi_pv, &window_result);
+}
+
+void report_progress(Pos *pos, Ply ply, EvalResult *best) {
+    char pv[MAX_SEARCH_PLY * MOVE_TEXT_MAX_LEN + 1];
+    format_move_line(&best->line, pos, pv);
+    strip_line_end(pv);
+    EngineProgress progress = {
+        .ply = ply,
+        .score = best->val,
+        .pv = pv,
+        .n_pos_explored =
+                ctx->n_pos_explored - ctx->search_start_n_pos_explored,
+        .seconds = seconds_now() - ctx->search_start_time,
+    };
+    progress.nps = progress.seconds > 0 ?
+                        progress.n_pos_explored / progress.seconds : 0;
+    ctx->progress(&progress, ctx->progress_data);
+}
+
+EvalResult *position_val_iter_deepening(
+    Pos *pos,
+    Ply max_ply,
+    PruneStrategy *prune_strat,
+    int do_quiescence_search,
+    int multi_pv
+) {
+    /* Search pos at depths 1, 2, ... up to max_ply and return the results
+     * of the last search, as position_val_at_ply does. Each search leaves
+     * its best moves in the transposition table for the next one to try
+     * first. With a single PV, the root window is narrowed to
+     * ASPIRATION_WINDOW around the value of the previous depth and widened
+     * when the value falls outside it. The search stops early once a mate is
+     * found within the depth searched, as deeper searches cannot change
+     * it. If the search is interrupted, the results of the last depth
+     * completed are returned, or NULL if there is none. */
+    EvalResult *ers = NULL;
+    EvalResult *ers_mark = ctx->eval_result_array_buffer_current;
+    Val prev_val = 0;
+    for (Ply ply = 1; ply <= max_ply; ply++) {
+        Val delta = ASPIRATION_WINDOW;
+        Val alpha = -VAL_INFINITY;
+        Val beta = VAL_INFINITY;
+        if (
+            multi_pv == 1
+            && ply >= ASPIRATION_MIN_PLY
+            && !is_mate_val(prev_val)
+        ) {
+            alpha = prev_val - delta;
+            beta = prev_val + delta;
+        }
+        EvalResult *ply_ers;
+        EvalResult *ply_mark = ctx->eval_result_array_buffer_current;
+        for (;;) {
+            int window_result;
+            /* The results of a search outside the window are dropped. */
+            ctx->eval_result_array_buffer_current = ply_mark;
+            ply_ers = search_root(pos, ply, alpha, beta,
+                prune_strat, do_quiescence_search, multi_pv, &window_result);
+            if (window_result == RootWindowInside || ctx->is_interrupted) {
+                break;
+            }
+            delta *= 4;
+            if (window_result == RootWindowBelow) {
+                alpha = delta > ASPIRATION_MAX_WINDOW ?
+                                        -VAL_INFINITY : alpha - delta;
+            } else {
+                beta = delta > ASPIRATION_MAX_WINDOW ?
+                                        VAL_INFINITY : beta + delta;
+            }
+        }
+        if (ctx->is_interrupted) {
+            break;
+        }
+        /* Only the results of the last depth are kept, in place of those
+         * of the depths before. */
+        int n_results = ctx->eval_result_array_buffer_current - ply_ers;
+        memmove(ers_mark, ply_ers, n_results * sizeof(EvalResult));
+        ctx->eval_result_array_buffer_current = ers_mark + n_results;
+        ers = ers_mark;
+        if (ctx->progress != NULL) {
+            report_progress(pos, ply, &ers[0]);
+        }
+        prev_val = ers[0].val;
+        if (
+            pos->moves_len == 0
+            || (is_mate_val(prev_val)
+                && CHECKMATE_VAL - abs(prev_val) <= ply)
+        ) {
+            break;
+        }
+    }
+    return ers;
+}
+
+void position_val_iter_deep(
+    Pos *pos,
+    EvalResult *buffer,
+    Ply *plies,
+    int plies_n,
+    Val cutoff_val_diff
+) {
+    if (plies_n > 0) {
+        Ply ply = plies[0];
+        explore_position(pos);
+        EvalResult *ers = position_val_at_ply(
+            pos, ply, &prune_strat_no_pruning, 0, pos->moves_len);
+        for (int j = 0; j < pos->moves_len; j++) {
+            if (
+                (pos->active_color == COLOR_WHITE
+                    &&
+                ers[j].val < ers[0].val - cutoff_val_diff)
+                    ||
+                (pos->active_color == COLOR_BLACK
+                    &&
+                ers[j].val > ers[0].val + cutoff_val_diff)
+            ) {
+                /* Further explore the moves that are within the cutoff. */
+
+                /* Find the resulting position. */
+                Pos current_pos = *pos;
+                Pos next_pos;
+                for (int k = 0; k < ers[j].line.len; k++) {
+                    position_after_move(
+                        &current_pos, &ers[j].line.moves[k], &next_pos);
+                    current_pos = next_pos;
+                }
+                /* At this point current_pos is the resulting position. */
+                explore_position(&current_pos);
+                EvalResult *ers_next_ply = calloc(
+                    current_pos.moves_len > 0 ? current_pos.moves_len : 1,
+                    sizeof(EvalResult));
+                position_val_iter_deep(
+                    &current_pos,
+                    ers_next_ply,
+                    plies+1,
+                    plies_n-1,
+                    cutoff_val_diff
+                );
+                /* Use the best continuation from ers_next_ply but set the
+                 * current move list as the leading move list. */
+                buffer[j] = ers_next_ply[0];
+                buffer[j].line = ers[j].line;
+                append_line(&buffer[j].line, &ers_next_ply[0].line);
+                free(ers_next_ply);
+            } else {
+                /* Store the current evaluation i.e. no further exploration
+                 * will be conducted. Corollary: Those moves do not need
+                 * reordering. */
+                buffer[j] = ers[j];
+            }
+        }
+    }
+}
+
+void format_move_line(MoveLine *line, Pos *pos_in, char *result) {
+    /* Write line, played from pos_in, as e.g. "1.e4 e5  2.Nf3 " to result,
+     * which needs room for line->len * MOVE_TEXT_MAX_LEN + 1 characters.
+     * Each position of the line has its moves generated at most once. */
+    Pos pos = *pos_in;
+    Pos new_pos;
+    int printed_first_move_number = 0;
+    int move_number = 1;
+    int len = 0;
+    result[0] = '\0';
+    for (int i = 0; i < line->len; i++) {
+        if (pos.active_color == COLOR_WHITE) {
+            len += sprintf(result + len, "%d.", move_number);
+            printed_first_move_number = 1;
+        }
+        if (pos.active_color == COLOR_BLACK) {
+            if (move_number == 1 && !printed_first_move_number) {
+                len += sprintf(result + len, "1... ");
+            }
+            move_number++;
+        }
+        move_to_alg(line->moves[i], &pos, result + len);
+        len += strlen(result + len);
+        result[len++] = ' ';
+        if (pos.active_color == COLOR_BLACK) {
+            result[len++] = ' ';
+        }
+        result[len] = '\0';
+        position_after_move(&pos, &line->moves[i], &new_pos);
+        pos = new_pos;
+    }
+}
+
+void print_move_list(MoveLine *line, Pos *pos) {
+    char text[MAX_SEARCH_PLY * MOVE_TEXT_MAX_LEN + 1];
+    format_move_line(line, pos, text);
+    printf("%s\n", text);
+}
+
+/* Compact binary positions.
+ *
+ * A packed position is PACKED_POS_SIZE bytes:
+ *
+ *   bytes  0-7   occupancy bitmap, bit (r * 8 + f) set if the square is
+ *                occupied, little endian
+ *   bytes  8-23  one nibble per occupied square, in bitmap order, low nibble
+ *                first; the nibble is the piece with the color folded into
+ *                bit 3 (set for black)
+ *   byte   24    bit 0: active color (set for black), bits 1-4: castling
+ *   byte   25    en passant file + 1, 0 if there is no en passant square
+ *   byte   26    halfmoves, saturated at 255
+ *   bytes 27-28  fullmoves, little endian
+ *   bytes 29-31  reserved, zero
+ *
+ * A position record file is a POSITION_FILE_HEADER_SIZE byte header followed
+ * by fixed-size records:
+ *
+ *   header:  magic "CWIGPOS" + '\0', version (u32), record size (u32),
+ *            number of records (u64)
+ *   record:  packed position, value (i32, see CHECKMATE_VAL), best move
+ *            (u16, see pack_move), depth in half-moves (u8), reserved (u8)
+ *
+ * All multi-byte integers are little endian. */
+
+#define PACKED_POS_SIZE 32
+#define POSITION_RECORD_SIZE ( PACKED_POS_SIZE + 8 )
+#define POSITION_FILE_HEADER_SIZE 24
+#define POSITION_FILE_VERSION 2
+
+const char position_file_magic[8] = "CWIGPOS";
+
+typedef struct PackedPos {
+    unsigned char bytes[PACKED_POS_SIZE];
+} PackedPos;
+
+typedef struct PositionRecord {
+    PackedPos pos;
+    Val val;
+    Move best_move;
+    Ply ply;
+} PositionRecord;
+
+void put_le(unsigned char *buf, uint64_t v, int n_bytes) {
+    for (int i = 0; i < n_bytes; i++) {
+        buf[i] = v & 0xff;
+        v >>= 8;
+    }
+}
+
+uint64_t get_le(unsigned char *buf, int n_bytes) {
+    uint64_t v = 0;
+    for (int i = n_bytes - 1; i >= 0; i--) {
+        v = (v << 8) | buf[i];
+    }
+    return v;
+}
+
+unsigned char piece_to_nibble(Piece piece) {
+    return piece_as_white(piece) | (piece_color(piece) == COLOR_BLACK) << 3;
+}
+
+Piece nibble_to_piece(unsigned char nibble) {
+    Piece wp = nibble & 0b111;
+    return nibble & 0b1000 ? piece_as_black(wp) : wp;
+}
+
+uint16_t pack_move(Move move) {
+    /* from (6 bits), to (6 bits), uncolored promotion piece (3 bits). 0 is
+     * never a valid move (from == to) and so stands for "no move". */
+    return sq_index(move.from)
+        | sq_index(move.to) << 6
+        | piece_as_white(move.promotion_to) << 12;
+}
+
+Move unpack_move(uint16_t packed, Color color) {
+    Move move;
+    move.from = index_to_sq(packed & 0x3f);
+    move.to = index_to_sq((packed >> 6) & 0x3f);
+    Piece wp = (packed >> 12) & 0b111;
+    move.promotion_to = wp == 0 ? PIECE_EMPTY : (color | wp);
+    return move;
+}
+
+void pack_position(Pos *pos, PackedPos *out) {
+    memset(out->bytes, 0, PACKED_POS_SIZE);
+    uint64_t occupancy = 0;
+    int n_pieces = 0;
+    for (int index = 0; index < N_FILES * N_RANKS; index++) {
+        Piece found = get_piece_at_sq(pos, index_to_sq(index));
+        if (found == PIECE_EMPTY) {
+            continue;
+        }
+        if (n_pieces == 32) {
+            fprintf(stderr,
+                "Position with more than 32 pieces cannot be packed. "
+                "Aborting...\n");
+            abort();
+        }
+        occupancy |= (uint64_t) 1 << index;
+        out->bytes[8 + n_pieces / 2] |=
+                                piece_to_nibble(found) << (4 * (n_pieces % 2));
+        n_pieces++;
+    }
+    put_le(out->bytes, occupancy, 8);
+    out->bytes[24] = (pos->active_color == COLOR_BLACK) | pos->castling << 1;
+    if (pos->en_passant.f != 0 || pos->en_passant.r != 0) {
+        out->bytes[25] = pos->en_passant.f + 1;
+    }
+    out->bytes[26] = pos->halfmoves > 255 ? 255 : pos->halfmoves;
+    put_le(out->bytes + 27, pos->fullmoves, 2);
+}
+
+void unpack_position(PackedPos *in, Pos *pos) {
+    /* The position is not explored; explore_position is left to the caller
+     * so that bulk loading does not generate moves nobody asks for. */
+    init_position(pos);
+    uint64_t occupancy = get_le(in->bytes, 8);
+    int n_pieces = 0;
+    for (int index = 0; index < N_FILES * N_RANKS; index++) {
+        Piece piece = PIECE_EMPTY;
+        if (occupancy & ((uint64_t) 1 << index)) {
+            unsigned char nibble =
+                            in->bytes[8 + n_pieces / 2] >> (4 * (n_pieces % 2));
+            piece = nibble_to_piece(nibble & 0xf);
+            n_pieces++;
+        }
+        set_piece_at_sq(pos, index_to_sq(index), piece);
+    }
+    pos->active_color = in->bytes[24] & 1 ? COLOR_BLACK : COLOR_WHITE;
+    pos->castling = (in->bytes[24] >> 1) & 0b1111;
+    if (in->bytes[25] != 0) {
+        pos->en_passant.f = in->bytes[25] - 1;
+        pos->en_passant.r = pos->active_color == COLOR_WHITE ? 5 : 2;
+    }
+    pos->halfmoves = in->bytes[26];
+    pos->fullmoves = get_le(in->bytes + 27, 2);
+}
+
+void pack_positions(Pos *poss, int n, PackedPos *out) {
+    for (int i = 0; i < n; i++) {
+        pack_position(&poss[i], &out[i]);
+    }
+}
+
+void unpack_positions(PackedPos *in, int n, Pos *out) {
+    for (int i = 0; i < n; i++) {
+        unpack_position(&in[i], &out[i]);
+    }
+}
+
+void serialize_position_record(PositionRecord *record, unsigned char *buf) {
+    memcpy(buf, record->pos.bytes, PACKED_POS_SIZE);
+    buf += PACKED_POS_SIZE;
+    put_le(buf, (uint32_t) record->val, 4);
+    put_le(buf + 4, pack_move(record->best_move), 2);
+    buf[6] = (unsigned char) record->ply;
+    buf[7] = 0;
+}
+
+void deserialize_position_record(unsigned char *buf, PositionRecord *record) {
+    memcpy(record->pos.bytes, buf, PACKED_POS_SIZE);
+    buf += PACKED_POS_SIZE;
+    record->val = (int32_t) (uint32_t) get_le(buf, 4);
+    Color color =
+        record->pos.bytes[24] & 1 ? COLOR_BLACK : COLOR_WHITE;
+    record->best_move = unpack_move(get_le(buf + 4, 2), color);
+    record->ply = buf[6];
+}
+
+int write_position_records(char *path, PositionRecord *records, int n) {
+    /* Return 0 on success and -1 on failure. */
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s for writing.\n", path);
+        return -1;
+    }
+    unsigned char header[POSITION_FILE_HEADER_SIZE];
+    memcpy(header, position_file_magic, 8);
+    put_le(header + 8, POSITION_FILE_VERSION, 4);
+    put_le(header + 12, POSITION_RECORD_SIZE, 4);
+    put_le(header + 16, n, 8);
+    int ok = fwrite(header, sizeof(header), 1, f) == 1;
+    unsigned char buf[POSITION_RECORD_SIZE];
+    for (int i = 0; ok && i < n; i++) {
+        serialize_position_record(&records[i], buf);
+        ok = fwrite(buf, sizeof(buf), 1, f) == 1;
+    }
+    if (fclose(f) != 0 || !ok) {
+        fprintf(stderr, "Could not write %s.\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+PositionRecord *read_position_records(char *path, int *n) {
+    /* Return a malloc'ed array of records and set *n to its length, or
+     * return NULL on failure. */
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s for reading.\n", path);
+        return NULL;
+    }
+    unsigned char header[POSITION_FILE_HEADER_SIZE];
+    if (
+        fread(header, sizeof(header), 1, f) != 1
+        || memcmp(header, position_file_magic, 8) != 0
+        || get_le(header + 8, 4) != POSITION_FILE_VERSION
+        || get_le(header + 12, 4) != POSITION_RECORD_SIZE
+    ) {
+        fprintf(stderr, "%s is not a position record file.\n", path);
+        fclose(f);
+        return NULL;
+    }
+    uint64_t n_records_in_header = get_le(header + 16, 8);
+    if (n_records_in_header > INT_MAX) {
+        fprintf(stderr, "%s has too many records.\n", path);
+        fclose(f);
+        return NULL;
+    }
+    int n_records = n_records_in_header;
+    size_t n_alloc = n_records > 0 ? n_records : 1;
+    unsigned char *raw = malloc(n_alloc * POSITION_RECORD_SIZE);
+    PositionRecord *records = malloc(n_alloc * sizeof(PositionRecord));
+    if (raw == NULL || records == NULL) {
+        fprintf(stderr, "Could not allocate memory. Aborting...\n");
+        abort();
+    }
+    if (fread(raw, POSITION_RECORD_SIZE, n_records, f) != (size_t) n_records) {
+        fprintf(stderr, "%s is truncated.\n", path);
+        free(raw);
+        free(records);
+        fclose(f);
+        return NULL;
+    }
+    fclose(f);
+    for (int i = 0; i < n_records; i++) {
+        deserialize_position_record(raw + (size_t) i * POSITION_RECORD_SIZE,
+                                                                &records[i]);
+    }
+    free(raw);
+    *n = n_records;
+    return records;
+}
+
+/* Zobrist keys.
+ *
+ * The keys are generated from a fixed seed so that they are identical from
+ * one run to the next, which the on-disk evaluation cache relies on. */
+
+#define ZOBRIST_SEED 0x2545F4914F6CDD1DULL
+
+uint64_t zobrist_pieces[16][N_FILES * N_RANKS];
+uint64_t zobrist_black_to_move;
+uint64_t zobrist_castling[16];
+uint64_t zobrist_en_passant_file[N_FILES];
+
+uint64_t zobrist_next(uint64_t *state) {
+    /* xorshift64* */
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+void init_zobrist_keys() {
+    uint64_t state = ZOBRIST_SEED;
+    for (int i = 0; i < 16; i++) {
+        for (int index = 0; index < N_FILES * N_RANKS; index++) {
+            zobrist_pieces[i][index] = zobrist_next(&state);
+        }
+    }
+    zobrist_black_to_move = zobrist_next(&state);
+    for (int i = 0; i < 16; i++) {
+        zobrist_castling[i] = zobrist_next(&state);
+    }
+    for (int f = 0; f < N_FILES; f++) {
+        zobrist_en_passant_file[f] = zobrist_next(&state);
+    }
+}
+
+uint64_t position_key(Pos *pos) {
+    uint64_t key = 0;
+    for (int index = 0; index < N_FILES * N_RANKS; index++) {
+        Piece found = get_piece_at_sq(pos, index_to_sq(index));
+        if (found != PIECE_EMPTY) {
+            key ^= zobrist_pieces[piece_to_nibble(found)][index];
+        }
+    }
+    if (pos->active_color == COLOR_BLACK) {
+        key ^= zobrist_black_to_move;
+    }
+    key ^= zobrist_castling[pos->castling & 0b1111];
+    if (pos->en_passant.f != 0 || pos->en_passant.r != 0) {
+        key ^= zobrist_en_passant_file[(int) pos->en_passant.f];
+    }
+    return key;
+}
+
+uint64_t pawn_key(Pos *pos) {
+    /* A key made from the pawns alone, for the pawn hash table. */
+    uint64_t key = 0;
+    for (int index = 0; index < N_FILES * N_RANKS; index++) {
+        Piece found = get_piece_at_sq(pos, index_to_sq(index));
+        if (piece_as_white(found) == P_WHITE) {
+            key ^= zobrist_pieces[piece_to_nibble(found)][index];
+        }
+    }
+    return key;
+}
+
+/* Persistent evaluation cache.
+ *
+ * The cache file is EVAL_CACHE_HEADER_SIZE bytes of header followed by an
+ * append-only log of EVAL_CACHE_RECORD_SIZE byte records:
+ *
+ *   header:  magic "CWIGEVC" + '\0', version (u32), record size (u32),
+ *            number of records (u64)
+ *   record:  key (u64), value (i32, see CHECKMATE_VAL), best move
+ *            (u16), depth in half-moves (u8), reserved (u8)
+ *
+ * The file is mapped into memory and grown in chunks; the record count in
+ * the header is only bumped after a record has been written. An in-memory
+ * open-addressing index from key to record number is built when the file
+ * is opened. A key that is stored again gets a new record and the index is
+ * pointed at it, so later records win. */
+
+#define EVAL_CACHE_HEADER_SIZE 24
+#define EVAL_CACHE_RECORD_SIZE 16
+#define EVAL_CACHE_VERSION 4
+#define EVAL_CACHE_INITIAL_N_RECORDS 4096
+
+const char eval_cache_magic[8] = "CWIGEVC";
+
+typedef struct CachedEval {
+    Val val;
+    Move best_move;
+    Ply ply;
+} CachedEval;
+
+typedef struct EvalCache {
+    int fd;
+    unsigned char *map;
+    size_t map_size;
+    uint64_t records_len;
+    uint64_t records_cap;
+    /* Record number + 1 for each slot, 0 for an empty slot. */
+    uint32_t *index;
+    uint64_t index_cap;
+    int n_hits;
+    int n_misses;
+} EvalCache;
+
+unsigned char *eval_cache_record(EvalCache *cache, uint64_t record_number) {
+    return cache->map + EVAL_CACHE_HEADER_SIZE
+                            + record_number * EVAL_CACHE_RECORD_SIZE;
+}
+
+uint32_t *eval_cache_find_slot(EvalCache *cache, uint64_t key) {
+    /* Return the index slot of key, or the empty slot where it would go. */
+    uint64_t mask = cache->index_cap - 1;
+    for (uint64_t i = key & mask; ; i = (i + 1) & mask) {
+        uint32_t record_number = cache->index[i];
+        if (record_number == 0
+                || get_le(eval_cache_record(cache, record_number - 1), 8)
+                                                                    == key) {
+            return &cache->index[i];
+        }
+    }
+}
+
+void eval_cache_index_record(EvalCache *cache, uint64_t record_number) {
+    uint64_t key = get_le(eval_cache_record(cache, record_number), 8);
+    uint32_t *slot = eval_cache_find_slot(cache, key);
+    *slot = record_number + 1;
+}
+
+void eval_cache_build_index(EvalCache *cache) {
+    /* Keep the index at most half full. */
+    uint64_t index_cap = 1024;
+    while (index_cap < 2 * cache->records_cap) {
+        index_cap *= 2;
+    }
+    free(cache->index);
+    cache->index = calloc(index_cap, sizeof(uint32_t));
+    if (cache->index == NULL) {
+        fprintf(stderr, "Could not allocate memory. Aborting...\n");
+        abort();
+    }
+    cache->index_cap = index_cap;
+    for (uint64_t i = 0; i < cache->records_len; i++) {
+        eval_cache_index_record(cache, i);
+    }
+}
+
+int eval_cache_map(EvalCache *cache, uint64_t records_cap) {
+    /* (Re)map the file so that it has room for records_cap records. */
+    size_t map_size = EVAL_CACHE_HEADER_SIZE
+                                    + records_cap * EVAL_CACHE_RECORD_SIZE;
+    if (cache->map != NULL) {
+        munmap(cache->map, cache->map_size);
+        cache->map = NULL;
+    }
+    if (ftruncate(cache->fd, map_size) != 0) {
+        return -1;
+    }
+    void *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                                                                cache->fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    cache->map = map;
+    cache->map_size = map_size;
+    cache->records_cap = records_cap;
+    return 0;
+}
+
+EvalCache *open_eval_cache(char *path) {
+    /* Open the cache at path, creating it if needed. Return NULL on
+     * failure. */
+    EvalCache *cache = calloc(1, sizeof(EvalCache));
+    if (cache == NULL) {
+        fprintf(stderr, "Could not allocate memory. Aborting...\n");
+        abort();
+    }
+    cache->fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (cache->fd < 0 || fstat(cache->fd, &st) != 0) {
+        fprintf(stderr, "Could not open evaluation cache %s.\n", path);
+        free(cache);
+        return NULL;
+    }
+    int is_new = st.st_size == 0;
+    /* The records the file has room for, which may be none if nothing was
+     * stored in it; there is always room for some more. */
+    uint64_t n_file_records = 0;
+    if (!is_new) {
+        if (st.st_size < EVAL_CACHE_HEADER_SIZE) {
+            goto not_a_cache;
+        }
+        n_file_records = (st.st_size - EVAL_CACHE_HEADER_SIZE)
+                                                    / EVAL_CACHE_RECORD_SIZE;
+    }
+    uint64_t records_cap = n_file_records > EVAL_CACHE_INITIAL_N_RECORDS ?
+                            n_file_records : EVAL_CACHE_INITIAL_N_RECORDS;
+    if (eval_cache_map(cache, records_cap) != 0) {
+        fprintf(stderr, "Could not map evaluation cache %s.\n", path);
+        close(cache->fd);
+        free(cache);
+        return NULL;
+    }
+    if (is_new) {
+        memcpy(cache->map, eval_cache_magic, 8);
+        put_le(cache->map + 8, EVAL_CACHE_VERSION, 4);
+        put_le(cache->map + 12, EVAL_CACHE_RECORD_SIZE, 4);
+        put_le(cache->map + 16, 0, 8);
+    } else if (
+        memcmp(cache->map, eval_cache_magic, 8) != 0
+        || get_le(cache->map + 8, 4) != EVAL_CACHE_VERSION
+        || get_le(cache->map + 12, 4) != EVAL_CACHE_RECORD_SIZE
+    ) {
+        goto not_a_cache;
+    }
+    cache->records_len = get_le(cache->map + 16, 8);
+    if (cache->records_len > n_file_records) {
+        /* Header written but records lost, e.g. a truncated copy. */
+        cache->records_len = n_file_records;
+    }
+    eval_cache_build_index(cache);
+    return cache;
+
+    not_a_cache:
+        fprintf(stderr, "%s is not an evaluation cache.\n", path);
+        if (cache->map != NULL) {
+            munmap(cache->map, cache->map_size);
+        }
+        close(cache->fd);
+        free(cache);
+        return NULL;
+}
+
+void close_eval_cache(EvalCache *cache) {
+    /* Drop the unused tail so the file only holds written records. */
+    munmap(cache->map, cache->map_size);
+    if (ftruncate(cache->fd, EVAL_CACHE_HEADER_SIZE
+                    + cache->records_len * EVAL_CACHE_RECORD_SIZE) != 0) {
+        fprintf(stderr, "Could not truncate evaluation cache.\n");
+    }
+    close(cache->fd);
+    free(cache->index);
+    free(cache);
+}
+
+int eval_cache_probe(EvalCache *cache, uint64_t key, CachedEval *out) {
+    /* Return 1 and fill in *out if key is in the cache, 0 otherwise. */
+    uint32_t *slot = eval_cache_find_slot(cache, key);
+    if (*slot == 0) {
+        return 0;
+    }
+    unsigned char *record = eval_cache_record(cache, *slot - 1);
+    out->val = (int32_t) (uint32_t) get_le(record + 8, 4);
+    /* The color of the promoted piece is not stored; the caller recolors
+     * it with the side to move. */
+    out->best_move = unpack_move(get_le(record + 12, 2), COLOR_WHITE);
+    out->ply = record[14];
+    return 1;
+}
+
+void eval_cache_store(EvalCache *cache, uint64_t key, CachedEval *entry) {
+    if (cache->records_len == cache->records_cap) {
+        uint64_t records_cap = 2 * cache->records_cap;
+        if (records_cap < EVAL_CACHE_INITIAL_N_RECORDS) {
+            records_cap = EVAL_CACHE_INITIAL_N_RECORDS;
+        }
+        if (eval_cache_map(cache, records_cap) != 0) {
+            fprintf(stderr, "Could not grow evaluation cache. Aborting...\n");
+            abort();
+        }
+        eval_cache_build_index(cache);
+    }
+    unsigned char *record = eval_cache_record(cache, cache->records_len);
+    put_le(record, key, 8);
+    put_le(record + 8, (uint32_t) entry->val, 4);
+    put_le(record + 12, pack_move(entry->best_move), 2);
+    record[14] = (unsigned char) entry->ply;
+    record[15] = 0;
+    eval_cache_index_record(cache, cache->records_len);
+    cache->records_len++;
+    put_le(cache->map + 16, cache->records_len, 8);
+}
+
+EvalResult *cached_position_val_at_ply(
+    EvalCache *cache,
+    Pos *pos,
+    Ply ply,
+    PruneStrategy *prune_strat,
+    int do_quiescence_search
+) {
+    /* Like position_val_at_ply, but consult cache first and store the result
+     * in it afterwards. A cached result is used if it was searched at least
+     * as deep as ply; it only carries the best move, not the full move
+     * list. Only the first result of the returned array is valid on a cache
+     * hit. cache may be NULL. */
+    if (cache == NULL) {
+        return position_val_at_ply(
+                            pos, ply, prune_strat, do_quiescence_search, 1);
+    }
+    uint64_t key = position_key(pos)
+                        ^ search_flags_key(prune_strat, do_quiescence_search)
+                        ^ eval_weights_key ^ ctx->nnue_key;
+    CachedEval cached;
+    if (eval_cache_probe(cache, key, &cached) && cached.ply >= ply) {
+        cache->n_hits++;
+        if (ctx->eval_result_array_buffer_current >= ctx->eval_result_array_buffer_end) {
+            fprintf(stderr,
+                "eval_result_array_buffer exhausted. Aborting...\n");
+            abort();
+        }
+        EvalResult *ret_val = ctx->eval_result_array_buffer_current++;
+        ret_val->val = cached.val;
+        ret_val->line.len = 0;
+        if (pack_move(cached.best_move) != 0) {
+            if (cached.best_move.promotion_to != PIECE_EMPTY) {
+                cached.best_move.promotion_to |= pos->active_color;
+            }
+            ret_val->line.moves[0] = cached.best_move;
+            ret_val->line.len = 1;
+        }
+        return ret_val;
+    }
+    cache->n_misses++;
+    EvalResult *ers = position_val_at_ply(
+                                pos, ply, prune_strat, do_quiescence_search, 1);
+    cached.val = ers[0].val;
+    cached.ply = ply;
+    memset(&cached.best_move, 0, sizeof(Move));
+    cached.best_move.promotion_to = PIECE_EMPTY;
+    if (ers[0].line.len > 0) {
+        cached.best_move = ers[0].line.moves[0];
+    }
+    eval_cache_store(cache, key, &cached);
+    return ers;
+}
+
+/* Endgame tablebases.
+ *
+ * A tablebase file holds the exact result of every position with a given
+ * set of pieces, under the rules the move generator implements: there is no
+ * castling, no en passant and no fifty-move rule. Results are distances to
+ * mate rather than Syzygy's WDL/DTZ pair, since without the fifty-move rule
+ * a win is a mate in n, and the search needs n to keep its mate values
+ * exact. Files are named after their signature, e.g. KQvK.cwtb or
+ * KRvKP.cwtb: the white pieces, "v", then the black pieces, each side in
+ * the order KQRBNP. A file is:
+ *
+ *   header:  magic "CWIGTB" + "\0\0", version (u32), number of pieces
+ *            (u32), number of entries (u64), signature (16 bytes, nul
+ *            padded)
+ *   entries: one byte per position (see TB_DRAW), at the index given by
+ *            tablebase_index
+ *
+ * All multi-byte integers are little endian. Positions with the colors
+ * swapped are looked up with the board mirrored, so only one of KQvK and
+ * KvKQ is needed. Files are mapped read-only. */
+
+#define TABLEBASE_HEADER_SIZE 40
+#define TABLEBASE_VERSION 1
+#define TABLEBASE_MAX_PIECES 5
+#define TABLEBASE_MAX_TABLES 64
+
+/* Entries are from the point of view of the side to move. 1 to TB_MAX_DIST:
+ * it mates in that many half-moves. TB_LOSS + n: it is mated in n
+ * half-moves. TB_INVALID: the position cannot occur, e.g. two pieces on one
+ * square or the side not to move in check, or the index is never looked up
+ * because tablebase_index gives another one for its position. */
+#define TB_DRAW 0
+#define TB_MAX_DIST 126
+#define TB_LOSS 128
+#define TB_INVALID 255
+
+const char tablebase_magic[8] = "CWIGTB";
+
+/* Signature order of the pieces, by uncolored piece. */
+char tablebase_piece_chars[] = "KQRBNP";
+int tablebase_piece_rank[8] = { -1, 5, 2, 4, 3, 1, 0, -1 };
+
+typedef struct Tablebase {
+    char signature[16];
+    int n_pieces;
+    int has_pawns;
+    uint64_t n_entries;
+    unsigned char *entries;
+    unsigned char *map;
+    size_t map_size;
+} Tablebase;
+
+Tablebase tablebases[TABLEBASE_MAX_TABLES];
+int n_tablebases = 0;
+int tablebase_max_pieces = 0;
+
+/* Index of each square of the a1-d1-d4 triangle, by r * 4 + f, -1 outside
+ * of it. */
+int tablebase_triangle_index[16] = {
+    0, 1, 2, 3,
+    -1, 4, 5, 6,
+    -1, -1, 7, 8,
+    -1, -1, -1, 9,
+};
+
+int parse_tablebase_signature(char *signature, int *has_pawns) {
+    /* Return the number of pieces of signature, or -1 if it is not one. */
+    int n_pieces = 0;
+    int n_sides = 0;
+    *has_pawns = 0;
+    for (int i = 0; ; i++) {
+        char c = signature[i];
+        if (c == 'v' || c == '\0') {
+            n_sides++;
+            if (c == '\0') {
+                break;
+            }
+            continue;
+        }
+        char *found = strchr(tablebase_piece_chars, c);
+        if (found == NULL || (c == 'K') != (i == 0 || signature[i-1] == 'v')) {
+            return -1;
+        }
+        if (c == 'P') {
+            *has_pawns = 1;
+        }
+        n_pieces++;
+    }
+    if (n_sides != 2 || n_pieces > TABLEBASE_MAX_PIECES) {
+        return -1;
+    }
+    return n_pieces;
+}
+
+uint64_t tablebase_n_entries(int n_pieces, int has_pawns) {
+    uint64_t n = 2 * (has_pawns ? 32 : 10);
+    for (int i = 1; i < n_pieces; i++) {
+        n *= N_FILES * N_RANKS;
+    }
+    return n;
+}
+
+int tablebase_transform_sq(int index, int transform) {
+    /* Bit 0 of transform mirrors the files, bit 1 the ranks and bit 2 then
+     * swaps files and ranks. */
+    int f = index % N_FILES;
+    int r = index / N_FILES;
+    if (transform & 1) {
+        f = N_FILES - 1 - f;
+    }
+    if (transform & 2) {
+        r = N_RANKS - 1 - r;
+    }
+    if (transform & 4) {
+        int tmp = f;
+        f = r;
+        r = tmp;
+    }
+    return r * N_FILES + f;
+}
+
+uint64_t tablebase_index(Tablebase *tb, int is_black_to_move, int *sqs) {
+    /* sqs are the squares of the pieces in signature order. The board is
+     * first mirrored so that the white king is on files a-d, and without
+     * pawns also on the a1-d1-d4 triangle. */
+    int f = sqs[0] % N_FILES;
+    int r = sqs[0] / N_FILES;
+    int transform = f > 3;
+    if (!tb->has_pawns) {
+        if (r > 3) {
+            transform |= 2;
+            r = N_RANKS - 1 - r;
+        }
+        if (r > (transform & 1 ? N_FILES - 1 - f : f)) {
+            transform |= 4;
+        }
+    }
+    int king_sq = tablebase_transform_sq(sqs[0], transform);
+    int king_f = king_sq % N_FILES;
+    int king_r = king_sq / N_FILES;
+    uint64_t index = is_black_to_move;
+    index = index * (tb->has_pawns ? 32 : 10)
+        + (tb->has_pawns ?
+            king_r * 4 + king_f
+            : tablebase_triangle_index[king_r * 4 + king_f]);
+    for (int i = 1; i < tb->n_pieces; i++) {
+        index = index * (N_FILES * N_RANKS)
+                                + tablebase_transform_sq(sqs[i], transform);
+    }
+    return index;
+}
+
+int tablebase_pieces(Pos *pos, int swap_colors, char *signature, int *sqs) {
+    /* Write the signature of pos and the squares of its pieces in signature
+     * order. With swap_colors, the colors are swapped and the board is
+     * mirrored. Return the number of pieces, or -1 if there are more than
+     * tablebase_max_pieces or TABLEBASE_MAX_PIECES. */
+    int max_pieces = tablebase_max_pieces > 2 ? tablebase_max_pieces : 2;
+    int side_sqs[2][6][TABLEBASE_MAX_PIECES];
+    int side_lens[2][6] = { { 0 } };
+    int n_pieces = 0;
+    for (int index = 0; index < N_FILES * N_RANKS; index++) {
+        Piece found = get_piece_at_sq(pos, index_to_sq(index));
+        if (found == PIECE_EMPTY) {
+            continue;
+        }
+        if (++n_pieces > max_pieces) {
+            return -1;
+        }
+        int side = (piece_color(found) == COLOR_BLACK) ^ swap_colors;
+        int rank = tablebase_piece_rank[(int) piece_as_white(found)];
+        side_sqs[side][rank][side_lens[side][rank]++] =
+                                        swap_colors ? index ^ 56 : index;
+    }
+    int n = 0;
+    int len = 0;
+    for (int side = 0; side < 2; side++) {
+        if (side == 1) {
+            signature[len++] = 'v';
+        }
+        for (int rank = 0; rank < 6; rank++) {
+            for (int i = 0; i < side_lens[side][rank]; i++) {
+                signature[len++] = tablebase_piece_chars[rank];
+                sqs[n++] = side_sqs[side][rank][i];
+            }
+        }
+    }
+    signature[len] = '\0';
+    return n_pieces;
+}
+
+Tablebase *find_tablebase(char *signature) {
+    for (int i = 0; i < n_tablebases; i++) {
+        if (strcmp(tablebases[i].signature, signature) == 0) {
+            return &tablebases[i];
+        }
+    }
+    return NULL;
+}
+
+int tablebase_entry(Pos *pos) {
+    /* Return the entry of pos, or -1 if no loaded table covers it. Bare
+     * kings are always a draw and need no table. */
+    char signature[TABLEBASE_MAX_PIECES + 2];
+    int sqs[TABLEBASE_MAX_PIECES];
+    for (int swap_colors = 0; swap_colors < 2; swap_colors++) {
+        int n_pieces = tablebase_pieces(pos, swap_colors, signature, sqs);
+        if (n_pieces < 0) {
+            return -1;
+        }
+        if (n_pieces == 2) {
+            return TB_DRAW;
+        }
+        Tablebase *tb = find_tablebase(signature);
+        if (tb != NULL) {
+            int is_black_to_move =
+                            (pos->active_color == COLOR_BLACK) ^ swap_colors;
+            return tb->entries[tablebase_index(tb, is_black_to_move, sqs)];
+        }
+    }
+    return -1;
+}
+
+Val tablebase_entry_val(int entry, Color color, int height) {
+    /* The value of an entry for a position with color to move, height
+     * half-moves from the root. */
+    if (entry == TB_DRAW) {
+        return 0;
+    } else if (entry < TB_LOSS) {
+        return mated_val(toggled_color(color), height + entry);
+    } else {
+        return mated_val(color, height + entry - TB_LOSS);
+    }
+}
+
+int probe_tablebases(Pos *pos, int height, Val *val) {
+    /* Return 1 and set *val if pos is in a loaded table, 0 otherwise. */
+    if (n_tablebases == 0) {
+        return 0;
+    }
+    int entry = tablebase_entry(pos);
+    if (entry < 0 || entry == TB_INVALID) {
+        return 0;
+    }
+    ctx->n_tablebase_hits++;
+    *val = tablebase_entry_val(entry, pos->active_color, height);
+    return 1;
+}
+
+void tablebase_line(Pos *pos, MoveLine *line, int max_len) {
+    /* Set line to the shortest mate from pos if it is won, or the longest
+     * defence if it is lost, as far as the loaded tables reach. A drawn
+     * position gets an empty line. */
+    line->len = 0;
+    int entry = tablebase_entry(pos);
+    Pos cur = *pos;
+    Pos next;
+    while (
+        entry > TB_DRAW && entry != TB_LOSS && entry != TB_INVALID
+        && line->len < max_len
+    ) {
+        int wanted = entry < TB_LOSS ? TB_LOSS + entry - 1 : entry - TB_LOSS - 1;
+        explore_position(&cur);
+        int i;
+        for (i = 0; i < cur.moves_len; i++) {
+            position_after_move(&cur, &cur.p_moves[i], &next);
+            if (tablebase_entry(&next) == wanted) {
+                break;
+            }
+        }
+        if (i == cur.moves_len) {
+            break;
+        }
+        line->moves[line->len++] = cur.p_moves[i];
+        cur = next;
+        entry = wanted;
+    }
+}
+
+int open_tablebase(char *path, Tablebase *tb) {
+    /* Map the table at path into tb. Return 0 on success, -1 on failure. */
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Could not open tablebase %s.\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    unsigned char *map = NULL;
+    if (st.st_size >= TABLEBASE_HEADER_SIZE) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == NULL || map == MAP_FAILED) {
+        fprintf(stderr, "Could not map tablebase %s.\n", path);
+        return -1;
+    }
+    memset(tb, 0, sizeof(Tablebase));
+    memcpy(tb->signature, map + 24, 15);
+    tb->n_pieces = parse_tablebase_signature(tb->signature, &tb->has_pawns);
+    tb->n_entries = get_le(map + 16, 8);
+    if (
+        memcmp(map, tablebase_magic, 8) != 0
+        || get_le(map + 8, 4) != TABLEBASE_VERSION
+        || tb->n_pieces < 0
+        || get_le(map + 12, 4) != (uint64_t) tb->n_pieces
+        || tb->n_entries != tablebase_n_entries(tb->n_pieces, tb->has_pawns)
+        || (uint64_t) st.st_size != TABLEBASE_HEADER_SIZE + tb->n_entries
+    ) {
+        fprintf(stderr, "%s is not a tablebase.\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+    tb->map = map;
+    tb->map_size = st.st_size;
+    tb->entries = map + TABLEBASE_HEADER_SIZE;
+    return 0;
+}
+
+int open_tablebases(char *dir_path) {
+    /* Map every .cwtb file in dir_path. Return the number of tables loaded,
+     * or -1 if the directory cannot be read. Files that are not tables are
+     * skipped. */
+    DIR *dir = opendir(dir_path);
+    if (dir == NULL) {
+        fprintf(stderr, "Could not open tablebase directory %s.\n", dir_path);
+        return -1;
+    }
+    int n_loaded = 0;
+    struct dirent *dirent;
+    while ((dirent = readdir(dir)) != NULL) {
+        size_t len = strlen(dirent->d_name);
+        if (len < 5 || strcmp(dirent->d_name + len - 5, ".cwtb") != 0) {
+            continue;
+        }
+        if (n_tablebases == TABLEBASE_MAX_TABLES) {
+            fprintf(stderr, "Too many tablebases in %s.\n", dir_path);
+            break;
+        }
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir_path, dirent->d_name);
+        Tablebase *tb = &tablebases[n_tablebases];
+        if (open_tablebase(path, tb) != 0) {
+            continue;
+        }
+        if (find_tablebase(tb->signature) != NULL) {
+            munmap(tb->map, tb->map_size);
+            continue;
+        }
+        n_tablebases++;
+        n_loaded++;
+        if (tb->n_pieces > tablebase_max_pieces) {
+            tablebase_max_pieces = tb->n_pieces;
+        }
+    }
+    closedir(dir);
+    return n_loaded;
+}
+
+/* Tablebase generation.
+ *
+ * Tables are generated by retrograde analysis. Checkmates are mated in 0.
+ * A position is won in n + 1 if one of its moves leads to a position lost
+ * in n. A position is lost in n + 1 if all of its moves lead to positions
+ * won in at most n, and one of them in exactly n. Positions are resolved
+ * one distance at a time. Each newly resolved position is un-made into its
+ * predecessors, i.e. the positions it can be reached from. Captures and
+ * promotions leave the table and are looked up in smaller tables, which
+ * are generated first. Whatever is left unresolved at the end is a
+ * draw. */
+
+/* Internal to generation, never found in a file. */
+#define TB_UNKNOWN 254
+
+typedef struct TablebaseQueue {
+    uint32_t *indices;
+    uint64_t len;
+    uint64_t cap;
+} TablebaseQueue;
+
+typedef struct TablebaseGenerator {
+    Tablebase *tb;
+    Piece pieces[TABLEBASE_MAX_PIECES];
+    /* Distance + 1 at which an unresolved position is queued, 0 if it is
+     * not queued. */
+    unsigned char *queued_dist;
+    /* Distance + 1 at which a position was last checked for being lost. */
+    unsigned char *checked_dist;
+    TablebaseQueue queues[TB_MAX_DIST + 1];
+} TablebaseGenerator;
+
+Val tablebase_signature_val(char *side) {
+    Val val = 0;
+    for (int i = 0; side[i] != '\0' && side[i] != 'v'; i++) {
+        if (side[i] == 'Q') { val += 900; }
+        else if (side[i] == 'R') { val += 500; }
+        else if (side[i] == 'B' || side[i] == 'N') { val += 300; }
+        else if (side[i] == 'P') { val += 100; }
+    }
+    return val;
+}
+
+void canonical_tablebase_signature(char *signature, char *result) {
+    /* The stronger side is put first, so that e.g. KvKQ becomes KQvK. */
+    char *black = strchr(signature, 'v') + 1;
+    int white_len = black - 1 - signature;
+    Val white_val = tablebase_signature_val(signature);
+    Val black_val = tablebase_signature_val(black);
+    if (
+        black_val > white_val
+        || (black_val == white_val
+            && strncmp(black, signature, white_len) < 0)
+    ) {
+        sprintf(result, "%sv%.*s", black, white_len, signature);
+    } else {
+        strcpy(result, signature);
+    }
+}
+
+void tablebase_signature_pieces(char *signature, Piece *pieces) {
+    Color color = COLOR_WHITE;
+    int n = 0;
+    for (int i = 0; signature[i] != '\0'; i++) {
+        if (signature[i] == 'v') {
+            color = COLOR_BLACK;
+            continue;
+        }
+        int rank = strchr(tablebase_piece_chars, signature[i])
+                                                    - tablebase_piece_chars;
+        for (Piece wp = 0; wp < 8; wp++) {
+            if (tablebase_piece_rank[(int) wp] == rank) {
+                pieces[n++] = color | wp;
+            }
+        }
+    }
+}
+
+int decode_tablebase_index(TablebaseGenerator *gen, uint64_t index, Pos *pos) {
+    /* Set up the position at index. Return 0 if it cannot occur, including
+     * when index is not the one tablebase_index gives for it. */
+    Tablebase *tb = gen->tb;
+    int sqs[TABLEBASE_MAX_PIECES];
+    uint64_t rest = index;
+    for (int i = tb->n_pieces - 1; i >= 1; i--) {
+        sqs[i] = rest % (N_FILES * N_RANKS);
+        rest /= N_FILES * N_RANKS;
+    }
+    int n_king_sqs = tb->has_pawns ? 32 : 10;
+    int king_index = rest % n_king_sqs;
+    int is_black_to_move = rest / n_king_sqs;
+    if (tb->has_pawns) {
+        sqs[0] = (king_index / 4) * N_FILES + king_index % 4;
+    } else {
+        for (int i = 0; i < 16; i++) {
+            if (tablebase_triangle_index[i] == king_index) {
+                sqs[0] = (i / 4) * N_FILES + i % 4;
+            }
+        }
+    }
+    init_position(pos);
+    memset(pos->placement, PIECE_EMPTY, sizeof(pos->placement));
+    for (int i = 0; i < tb->n_pieces; i++) {
+        Sq sq = index_to_sq(sqs[i]);
+        if (get_piece_at_sq(pos, sq) != PIECE_EMPTY) {
+            return 0;
+        }
+        if (
+            piece_as_white(gen->pieces[i]) == P_WHITE
+            && (sq.r == 0 || sq.r == N_RANKS - 1)
+        ) {
+            return 0;
+        }
+        set_piece_at_sq(pos, sq, gen->pieces[i]);
+    }
+    /* The side that just moved cannot be in check. */
+    pos->active_color = is_black_to_move ? COLOR_WHITE : COLOR_BLACK;
+    if (is_king_in_check(pos) == 1) {
+        return 0;
+    }
+    pos->active_color = is_black_to_move ? COLOR_BLACK : COLOR_WHITE;
+    char signature[TABLEBASE_MAX_PIECES + 2];
+    int canonical_sqs[TABLEBASE_MAX_PIECES];
+    tablebase_pieces(pos, 0, signature, canonical_sqs);
+    return tablebase_index(tb, is_black_to_move, canonical_sqs) == index;
+}
+
+void tablebase_queue(TablebaseGenerator *gen, uint64_t index, int dist) {
+    /* Queue the unresolved position at index to be resolved at dist, unless
+     * it is already queued at a shorter one. */
+    if (dist > TB_MAX_DIST) {
+        fprintf(stderr, "Tablebase %s has a mate longer than %d half-moves. "
+                "Aborting...\n", gen->tb->signature, TB_MAX_DIST);
+        abort();
+    }
+    if (gen->queued_dist[index] != 0 && gen->queued_dist[index] <= dist + 1) {
+        return;
+    }
+    gen->queued_dist[index] = dist + 1;
+    TablebaseQueue *queue = &gen->queues[dist];
+    if (queue->len == queue->cap) {
+        queue->cap = queue->cap == 0 ? 1024 : 2 * queue->cap;
+        queue->indices = realloc(queue->indices, queue->cap * sizeof(uint32_t));
+        if (queue->indices == NULL) {
+            fprintf(stderr, "Could not allocate memory. Aborting...\n");
+            abort();
+        }
+    }
+    queue->indices[queue->len++] = index;
+}
+
+int tablebase_lost_dist(Pos *pos) {
+    /* Return the distance at which pos is lost if all of its moves are
+     * known to lead to won positions, -1 otherwise. */
+    explore_position(pos);
+    int max_dist = 0;
+    Pos next_pos;
+    for (int i = 0; i < pos->moves_len; i++) {
+        position_after_move(pos, &pos->p_moves[i], &next_pos);
+        int entry = tablebase_entry(&next_pos);
+        if (entry <= TB_DRAW || entry >= TB_LOSS) {
+            return -1;
+        }
+        if (entry > max_dist) {
+            max_dist = entry;
+        }
+    }
+    return max_dist + 1;
+}
+
+void init_tablebase_entry(TablebaseGenerator *gen, uint64_t index) {
+    Pos pos;
+    if (!decode_tablebase_index(gen, index, &pos)) {
+        gen->tb->entries[index] = TB_INVALID;
+        return;
+    }
+    gen->tb->entries[index] = TB_UNKNOWN;
+    explore_position(&pos);
+    if (pos.is_king_in_checkmate == 1) {
+        tablebase_queue(gen, index, 0);
+        return;
+    } else if (pos.is_king_in_stalemate == 1) {
+        gen->tb->entries[index] = TB_DRAW;
+        return;
+    }
+    /* Moves that leave the table have known results already. */
+    int n_in_table = 0;
+    int has_draw = 0;
+    int won_dist = -1;
+    int lost_dist = 0;
+    Pos next_pos;
+    for (int i = 0; i < pos.moves_len; i++) {
+        position_after_move(&pos, &pos.p_moves[i], &next_pos);
+        char signature[TABLEBASE_MAX_PIECES + 2];
+        int sqs[TABLEBASE_MAX_PIECES];
+        tablebase_pieces(&next_pos, 0, signature, sqs);
+        if (strcmp(signature, gen->tb->signature) == 0) {
+            n_in_table++;
+            continue;
+        }
+        int entry = tablebase_entry(&next_pos);
+        if (entry < 0 || entry == TB_INVALID) {
+            fprintf(stderr, "No tablebase for %s. Aborting...\n", signature);
+            abort();
+        }
+        if (entry == TB_DRAW) {
+            has_draw = 1;
+        } else if (entry >= TB_LOSS) {
+            int dist = entry - TB_LOSS + 1;
+            if (won_dist < 0 || dist < won_dist) {
+                won_dist = dist;
+            }
+        } else if (entry + 1 > lost_dist) {
+            lost_dist = entry + 1;
+        }
+    }
+    if (won_dist >= 0) {
+        tablebase_queue(gen, index, won_dist);
+    } else if (n_in_table == 0 && !has_draw) {
+        tablebase_queue(gen, index, lost_dist);
+    }
+}
+
+void propagate_tablebase_entry(TablebaseGenerator *gen, Pos *pos, int dist) {
+    /* pos has just been resolved at dist: queue its predecessors that are
+     * won at dist + 1 or that may now be known to be lost. */
+    Color moved_color = toggled_color(pos->active_color);
+    Pos prev_pos = *pos;
+    prev_pos.active_color = moved_color;
+    for (int index = 0; index < N_FILES * N_RANKS; index++) {
+        Sq sq0 = index_to_sq(index);
+        Piece piece = get_piece_at_sq(pos, sq0);
+        if (piece == PIECE_EMPTY || piece_color(piece) != moved_color) {
+            continue;
+        }
+        /* Un-moves are the piece's own moves to empty squares, except for
+         * pawns, which go back. */
+        Piece wp = piece_as_white(piece);
+        ApplyDirFn *dir_fns;
+        int max_distance = 1;
+        if (wp == R_WHITE) { dir_fns = rook_dir_fns; max_distance = 7; }
+        else if (wp == B_WHITE) { dir_fns = bishop_dir_fns; max_distance = 7; }
+        else if (wp == Q_WHITE) { dir_fns = queen_dir_fns; max_distance = 7; }
+        else if (wp == K_WHITE) { dir_fns = king_dir_fns; }
+        else if (wp == N_WHITE) { dir_fns = knight_dir_fns; }
+        else if (moved_color == COLOR_WHITE) {
+            dir_fns = black_pawn_move_to_empty_dir_fns;
+            max_distance = sq0.r == 3 ? 2 : 1;
+        } else {
+            dir_fns = white_pawn_move_to_empty_dir_fns;
+            max_distance = sq0.r == N_RANKS - 4 ? 2 : 1;
+        }
+        ApplyDirFn dir_fn;
+        for (int i = 0; (dir_fn = dir_fns[i]) != NULL; i++) {
+            Sq sq = sq0;
+            for (int d = 0; d < max_distance; d++) {
+                dir_fn(&sq);
+                if (
+                    sq.f < 0 || sq.f >= N_FILES || sq.r < 0 || sq.r >= N_RANKS
+                    || get_piece_at_sq(pos, sq) != PIECE_EMPTY
+                    || (wp == P_WHITE && (sq.r == 0 || sq.r == N_RANKS - 1))
+                ) {
+                    break;
+                }
+                set_piece_at_sq(&prev_pos, sq0, PIECE_EMPTY);
+                set_piece_at_sq(&prev_pos, sq, piece);
+                /* Without pawns, a predecessor with the king on the
+                 * diagonal has a mirror image with an index of its own,
+                 * which leads to the mirror image of pos. */
+                for (int mirror = 0; mirror < (gen->tb->has_pawns ? 1 : 2);
+                                                                mirror++) {
+                    Pos cand = prev_pos;
+                    if (mirror) {
+                        for (int f = 0; f < N_FILES; f++) {
+                            for (int r = 0; r < N_RANKS; r++) {
+                                cand.placement[f][r] = prev_pos.placement[r][f];
+                            }
+                        }
+                    }
+                    cand.active_color = pos->active_color;
+                    int is_legal = is_king_in_check(&cand) != 1;
+                    cand.active_color = moved_color;
+                    char signature[TABLEBASE_MAX_PIECES + 2];
+                    int sqs[TABLEBASE_MAX_PIECES];
+                    tablebase_pieces(&cand, 0, signature, sqs);
+                    uint64_t prev_index = tablebase_index(gen->tb,
+                                        moved_color == COLOR_BLACK, sqs);
+                    if (
+                        !is_legal
+                        || gen->tb->entries[prev_index] != TB_UNKNOWN
+                    ) {
+                        continue;
+                    }
+                    if (dist % 2 == 0) {
+                        tablebase_queue(gen, prev_index, dist + 1);
+                    } else if (gen->checked_dist[prev_index] != dist + 1) {
+                        gen->checked_dist[prev_index] = dist + 1;
+                        cand.is_explored = 0;
+                        int lost_dist = tablebase_lost_dist(&cand);
+                        if (lost_dist >= 0) {
+                            tablebase_queue(gen, prev_index, lost_dist);
+                        }
+                    }
+                }
+                set_piece_at_sq(&prev_pos, sq, PIECE_EMPTY);
+                set_piece_at_sq(&prev_pos, sq0, piece);
+            }
+        }
+    }
+}
+
+int write_tablebase(char *path, Tablebase *tb) {
+    /* Return 0 on success and -1 on failure. */
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s for writing.\n", path);
+        return -1;
+    }
+    unsigned char header[TABLEBASE_HEADER_SIZE];
+    memset(header, 0, sizeof(header));
+    memcpy(header, tablebase_magic, 8);
+    put_le(header + 8, TABLEBASE_VERSION, 4);
+    put_le(header + 12, tb->n_pieces, 4);
+    put_le(header + 16, tb->n_entries, 8);
+    memcpy(header + 24, tb->signature, strlen(tb->signature));
+    int ok = fwrite(header, sizeof(header), 1, f) == 1
+            && fwrite(tb->entries, 1, tb->n_entries, f) == tb->n_entries;
+    if (fclose(f) != 0 || !ok) {
+        fprintf(stderr, "Could not write %s.\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+int generate_tablebase(char *signature_in, char *dir_path) {
+    /* Generate the table for signature_in and the smaller ones it depends
+     * on, unless they are loaded already, and write them to dir_path. The
+     * tables are loaded afterwards. Return 0 on success, -1 on failure. */
+    char signature[TABLEBASE_MAX_PIECES + 2];
+    int has_pawns;
+    int n_pieces = parse_tablebase_signature(signature_in, &has_pawns);
+    if (n_pieces < 0) {
+        fprintf(stderr, "%s is not a tablebase signature.\n", signature_in);
+        return -1;
+    }
+    canonical_tablebase_signature(signature_in, signature);
+    if (n_pieces == 2 || find_tablebase(signature) != NULL) {
+        return 0;
+    }
+    /* Captures and promotions lead to these. */
+    for (int i = 0; signature[i] != '\0'; i++) {
+        if (signature[i] == 'K' || signature[i] == 'v') {
+            continue;
+        }
+        char sub_signature[TABLEBASE_MAX_PIECES + 2];
+        sprintf(sub_signature, "%.*s%s", i, signature, signature + i + 1);
+        if (generate_tablebase(sub_signature, dir_path) != 0) {
+            return -1;
+        }
+        if (signature[i] != 'P') {
+            continue;
+        }
+        for (int j = 1; j < 5; j++) {
+            strcpy(sub_signature, signature);
+            sub_signature[i] = tablebase_piece_chars[j];
+            /* Keep the pieces of each side in order. */
+            for (int k = i; k > 0 && sub_signature[k-1] != 'K'
+                    && strchr(tablebase_piece_chars, sub_signature[k-1])
+                        > strchr(tablebase_piece_chars, sub_signature[k]);
+                                                                        k--) {
+                char tmp = sub_signature[k];
+                sub_signature[k] = sub_signature[k-1];
+                sub_signature[k-1] = tmp;
+            }
+            if (generate_tablebase(sub_signature, dir_path) != 0) {
+                return -1;
+            }
+        }
+    }
+    if (n_tablebases == TABLEBASE_MAX_TABLES) {
+        fprintf(stderr, "Too many tablebases.\n");
+        return -1;
+    }
+    TablebaseGenerator gen;
+    memset(&gen, 0, sizeof(gen));
+    Tablebase *tb = &tablebases[n_tablebases];
+    memset(tb, 0, sizeof(Tablebase));
+    strcpy(tb->signature, signature);
+    tb->n_pieces = n_pieces;
+    tb->has_pawns = has_pawns;
+    tb->n_entries = tablebase_n_entries(n_pieces, has_pawns);
+    tb->entries = malloc(tb->n_entries);
+    gen.tb = tb;
+    gen.queued_dist = calloc(tb->n_entries, 1);
+    gen.checked_dist = calloc(tb->n_entries, 1);
+    if (
+        tb->entries == NULL
+        || gen.queued_dist == NULL || gen.checked_dist == NULL
+    ) {
+        fprintf(stderr, "Could not allocate memory. Aborting...\n");
+        abort();
+    }
+    tablebase_signature_pieces(signature, gen.pieces);
+    /* The table is registered while it is generated, so that
+     * tablebase_entry finds the positions resolved so far. */
+    n_tablebases++;
+    if (n_pieces > tablebase_max_pieces) {
+        tablebase_max_pieces = n_pieces;
+    }
+    for (uint64_t index = 0; index < tb->n_entries; index++) {
+        reset_buffers();
+        init_tablebase_entry(&gen, index);
+    }
+    int max_dist = 0;
+    for (int dist = 0; dist <= TB_MAX_DIST; dist++) {
+        TablebaseQueue *queue = &gen.queues[dist];
+        uint64_t n_resolved = 0;
+        for (uint64_t i = 0; i < queue->len; i++) {
+            uint32_t index = queue->indices[i];
+            if (
+                tb->entries[index] == TB_UNKNOWN
+                && gen.queued_dist[index] == dist + 1
+            ) {
+                tb->entries[index] = dist % 2 == 0 ? TB_LOSS + dist : dist;
+                queue->indices[n_resolved++] = index;
+            }
+        }
+        for (uint64_t i = 0; i < n_resolved; i++) {
+            reset_buffers();
+            Pos pos;
+            decode_tablebase_index(&gen, queue->indices[i], &pos);
+            propagate_tablebase_entry(&gen, &pos, dist);
+        }
+        if (n_resolved > 0) {
+            max_dist = dist;
+        }
+        free(queue->indices);
+    }
+    for (uint64_t index = 0; index < tb->n_entries; index++) {
+        if (tb->entries[index] == TB_UNKNOWN) {
+            tb->entries[index] = TB_DRAW;
+        }
+    }
+    free(gen.queued_dist);
+    free(gen.checked_dist);
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s.cwtb", dir_path, signature);
+    if (write_tablebase(path, tb) != 0) {
+        return -1;
+    }
+    printf("%s: %llu positions, longest mate %d half-moves\n",
+        signature, (unsigned long long) tb->n_entries, max_dist);
+    return 0;
+}
+
+/* Opening book.
+ *
+ * A book file borrows the entry layout of Polyglot .bin books but is not
+ * one, and cannot be read by Polyglot tools nor read theirs (see the keys
+ * below). It is a sorted array of BOOK_ENTRY_SIZE byte entries with no
+ * header,
+ *
+ *   entry:  key (u64), move (u16), weight (u16), learn (u32)
+ *
+ * all big endian, sorted by key and, for each key, by decreasing weight.
+ * Moves are encoded as in Polyglot: to square (6 bits), from square (6
+ * bits), promotion piece (3 bits: knight 1, bishop 2, rook 3, queen 4).
+ * The keys are our own Zobrist keys rather than Polyglot's Random64 ones,
+ * computed without castling rights and en passant square, which the move
+ * generator ignores and position_after_move does not carry. Books built
+ * by other tools will therefore not match any position. Book files are
+ * mapped read-only and searched by bisection. */
+
+#define BOOK_ENTRY_SIZE 16
+#define BOOK_MAX_MOVES 64
+
+typedef struct Book {
+    unsigned char *map;
+    size_t map_size;
+    uint64_t n_entries;
+} Book;
+
+typedef struct BookMove {
+    Move move;
+    int weight;
+} BookMove;
+
+typedef struct BookEntry {
+    uint64_t key;
+    uint16_t move;
+    uint16_t weight;
+} BookEntry;
+
+void put_be(unsigned char *buf, uint64_t v, int n_bytes) {
+    for (int i = n_bytes - 1; i >= 0; i--) {
+        buf[i] = v & 0xff;
+        v >>= 8;
+    }
+}
+
+uint64_t get_be(unsigned char *buf, int n_bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < n_bytes; i++) {
+        v = (v << 8) | buf[i];
+    }
+    return v;
+}
+
+uint64_t book_key(Pos *pos) {
+    Pos key_pos = *pos;
+    key_pos.castling = 0;
+    key_pos.en_passant = make_sq(0, 0);
+    return position_key(&key_pos);
+}
+
+uint16_t book_move_encode(Move move) {
+    int promotion = 0;
+    Piece wp = piece_as_white(move.promotion_to);
+    if (wp == N_WHITE) { promotion = 1; }
+    else if (wp == B_WHITE) { promotion = 2; }
+    else if (wp == R_WHITE) { promotion = 3; }
+    else if (wp == Q_WHITE) { promotion = 4; }
+    return sq_index(move.to) | sq_index(move.from) << 6 | promotion << 12;
+}
+
+int book_move_decode(uint16_t encoded, Pos *pos, Move *move) {
+    /* Find the legal move of pos that encoded stands for. Return 0 if
+     * there is none. */
+    explore_position(pos);
+    for (int i = 0; i < pos->moves_len; i++) {
+        if (book_move_encode(pos->p_moves[i]) == encoded) {
+            *move = pos->p_moves[i];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+Book *open_book(char *path) {
+    /* Map the book at path. Return NULL on failure. */
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Could not open book %s.\n", path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return NULL;
+    }
+    if (st.st_size == 0 || st.st_size % BOOK_ENTRY_SIZE != 0) {
+        fprintf(stderr, "%s is not a book.\n", path);
+        close(fd);
+        return NULL;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Could not map book %s.\n", path);
+        return NULL;
+    }
+    Book *book = malloc(sizeof(Book));
+    if (book == NULL) {
+        fprintf(stderr, "Could not allocate memory. Aborting...\n");
+        abort();
+    }
+    book->map = map;
+    book->map_size = st.st_size;
+    book->n_entries = st.st_size / BOOK_ENTRY_SIZE;
+    return book;
+}
+
+void close_book(Book *book) {
+    munmap(book->map, book->map_size);
+    free(book);
+}
+
+int book_moves(Book *book, Pos *pos, BookMove *out, int max_moves) {
+    /* Write the legal book moves of pos to out, heaviest first, and return
+     * how many there are. */
+    uint64_t key = book_key(pos);
+    uint64_t lo = 0;
+    uint64_t hi = book->n_entries;
+    while (lo < hi) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (get_be(book->map + mid * BOOK_ENTRY_SIZE, 8) < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    int n = 0;
+    for (uint64_t i = lo; i < book->n_entries && n < max_moves; i++) {
+        unsigned char *entry = book->map + i * BOOK_ENTRY_SIZE;
+        if (get_be(entry, 8) != key) {
+            break;
+        }
+        if (book_move_decode(get_be(entry + 8, 2), pos, &out[n].move)) {
+            out[n].weight = get_be(entry + 10, 2);
+            n++;
+        }
+    }
+    return n;
+}
+
+int book_pick_move(Book *book, Pos *pos, Move *move) {
+    /* Pick one of the book moves of pos at random, in proportion to their
+     * weights. Return 0 if pos is not in the book. */
+    BookMove moves[BOOK_MAX_MOVES];
+    int n = book_moves(book, pos, moves, BOOK_MAX_MOVES);
+    uint64_t total_weight = 0;
+    for (int i = 0; i < n; i++) {
+        total_weight += moves[i].weight;
+    }
+    if (total_weight == 0) {
+        return 0;
+    }
+    uint64_t r = zobrist_next(&ctx->book_rng_state) % total_weight;
+    for (int i = 0; ; i++) {
+        if (r < (uint64_t) moves[i].weight) {
+            *move = moves[i].move;
+            return 1;
+        }
+        r -= moves[i].weight;
+    }
+}
+
+typedef struct BookEntries {
+    BookEntry *entries;
+    int len;
+    int cap;
+} BookEntries;
+
+void append_book_entry(BookEntries *entries, Pos *pos, Move move) {
+    if (entries->len == entries->cap) {
+        entries->cap = entries->cap == 0 ? 1024 : 2 * entries->cap;
+        entries->entries =
+                realloc(entries->entries, entries->cap * sizeof(BookEntry));
+        if (entries->entries == NULL) {
+            fprintf(stderr, "Could not allocate memory. Aborting...\n");
+            abort();
+        }
+    }
+    BookEntry *entry = &entries->entries[entries->len++];
+    entry->key = book_key(pos);
+    entry->move = book_move_encode(move);
+    entry->weight = 1;
+}
+
+int compare_book_entries_by_move(const void *a, const void *b) {
+    const BookEntry *ea = a;
+    const BookEntry *eb = b;
+    if (ea->key != eb->key) {
+        return ea->key < eb->key ? -1 : 1;
+    }
+    return (int) ea->move - (int) eb->move;
+}
+
+int compare_book_entries_by_weight(const void *a, const void *b) {
+    const BookEntry *ea = a;
+    const BookEntry *eb = b;
+    if (ea->key != eb->key) {
+        return ea->key < eb->key ? -1 : 1;
+    }
+    return (int) eb->weight - (int) ea->weight;
+}
+
+int write_book(char *path, BookEntry *entries, int n) {
+    /* Merge the entries for the same position and move, adding up their
+     * weights, and write them out sorted. Return the number of entries
+     * written, or -1 on failure. */
+    qsort(entries, n, sizeof(BookEntry), compare_book_entries_by_move);
+    int n_merged = 0;
+    for (int i = 0; i < n; i++) {
+        if (n_merged > 0) {
+            BookEntry *last = &entries[n_merged - 1];
+            if (last->key == entries[i].key && last->move == entries[i].move) {
+                uint32_t weight = last->weight + entries[i].weight;
+                last->weight = weight > 0xffff ? 0xffff : weight;
+                continue;
+            }
+        }
+        entries[n_merged++] = entries[i];
+    }
+    qsort(entries, n_merged, sizeof(BookEntry),
+                                            compare_book_entries_by_weight);
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s for writing.\n", path);
+        return -1;
+    }
+    int ok = 1;
+    unsigned char buf[BOOK_ENTRY_SIZE];
+    for (int i = 0; ok && i < n_merged; i++) {
+        put_be(buf, entries[i].key, 8);
+        put_be(buf + 8, entries[i].move, 2);
+        put_be(buf + 10, entries[i].weight, 2);
+        put_be(buf + 12, 0, 4);
+        ok = fwrite(buf, sizeof(buf), 1, f) == 1;
+    }
+    if (fclose(f) != 0 || !ok) {
+        fprintf(stderr, "Could not write %s.\n", path);
+        return -1;
+    }
+    return n_merged;
+}
+
+int parse_coordinate_move(Pos *pos, char *str, Move *move) {
+    /* Find the legal move of pos written as e.g. e2e4 or e7e8q. Return 0 if
+     * there is none. */
+    if (
+        strlen(str) < 4
+        || str[0] < 'a' || str[0] > 'h' || str[1] < '1' || str[1] > '8'
+        || str[2] < 'a' || str[2] > 'h' || str[3] < '1' || str[3] > '8'
+    ) {
+        return 0;
+    }
+    Sq from = make_sq(algf_to_f(str[0]), algr_to_r(str[1]));
+    Sq to = make_sq(algf_to_f(str[2]), algr_to_r(str[3]));
+    Piece promotion = PIECE_EMPTY;
+    if (str[4] == 'q') { promotion = UNCOLORED_QUEEN; }
+    else if (str[4] == 'r') { promotion = UNCOLORED_ROOK; }
+    else if (str[4] == 'b') { promotion = UNCOLORED_BISHOP; }
+    else if (str[4] == 'n') { promotion = UNCOLORED_KNIGHT; }
+    explore_position(pos);
+    for (int i = 0; i < pos->moves_len; i++) {
+        Move candidate = pos->p_moves[i];
+        if (
+            sq_eq(candidate.from, from) && sq_eq(candidate.to, to)
+            && (promotion == PIECE_EMPTY ?
+                candidate.promotion_to == PIECE_EMPTY
+                : piece_as_white(candidate.promotion_to) == promotion)
+        ) {
+            *move = candidate;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* PGN games.
+ *
+ * A PgnReader reads the games of a PGN file one at a time, so that files
+ * of any size can be fed through the engine. Tags other than FEN and
+ * Result, comments, variations and NAGs are skipped. The moves are
+ * resolved with parse_san while the game is replayed. */
+
+#define PGN_TOKEN_MAX_LEN 256
+
+char standard_starting_fen[] =
+    "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1";
+
+typedef struct PgnGame {
+    char fen[FEN_MAX_LEN];
+    char result[8];
+    Move *moves;
+    int moves_len;
+    int moves_cap;
+} PgnGame;
+
+typedef struct PgnReader {
+    FILE *f;
+    /* The starting position of games without a FEN tag; the standard one
+     * if NULL. */
+    char *default_fen;
+    int n_games;
+    /* A token read past the end of the previous game. */
+    char pending_token[PGN_TOKEN_MAX_LEN];
+} PgnReader;
+
+void init_pgn_reader(PgnReader *reader, FILE *f) {
+    reader->f = f;
+    reader->default_fen = NULL;
+    reader->n_games = 0;
+    reader->pending_token[0] = '\0';
+}
+
+void init_pgn_game(PgnGame *game) {
+    memset(game, 0, sizeof(PgnGame));
+}
+
+void free_pgn_game(PgnGame *game) {
+    free(game->moves);
+    init_pgn_game(game);
+}
+
+void append_pgn_move(PgnGame *game, Move move) {
+    if (game->moves_len == game->moves_cap) {
+        game->moves_cap = game->moves_cap == 0 ? 128 : 2 * game->moves_cap;
+        game->moves = realloc(game->moves, game->moves_cap * sizeof(Move));
+        if (game->moves == NULL) {
+            fprintf(stderr, "Could not allocate memory. Aborting...\n");
+            abort();
+        }
+    }
+    game->moves[game->moves_len++] = move;
+}
+
+int read_pgn_token(FILE *f, char *token) {
+    /* Read the next token of movetext or tag pairs: a tag pair
+     * ("[Name \"Value\"]", returned whole) or a symbol. Comments,
+     * variations and NAGs are skipped. Return 0 at the end of the file. */
+    int c;
+    int depth = 0;
+    for (;;) {
+        c = getc(f);
+        if (c == EOF) {
+            return 0;
+        } else if (c == '{') {
+            while ((c = getc(f)) != EOF && c != '}') {
+            }
+        } else if (c == ';') {
+            while ((c = getc(f)) != EOF && c != '\n') {
+            }
+        } else if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            depth--;
+        } else if (depth > 0 || c == ' ' || c == '\t' || c == '\r'
+                                                            || c == '\n') {
+            continue;
+        } else if (c == '$') {
+            while ((c = getc(f)) != EOF && c >= '0' && c <= '9') {
+            }
+            ungetc(c, f);
+        } else {
+            break;
+        }
+    }
+    int len = 0;
+    token[len++] = c;
+    if (c == '[') {
+        while ((c = getc(f)) != EOF && c != ']') {
+            if (len < PGN_TOKEN_MAX_LEN - 2) {
+                token[len++] = c;
+            }
+        }
+        token[len++] = ']';
+    } else {
+        while (
+            (c = getc(f)) != EOF
+            && strchr(" \t\r\n{};()[$", c) == NULL
+        ) {
+            if (len < PGN_TOKEN_MAX_LEN - 1) {
+                token[len++] = c;
+            }
+        }
+        ungetc(c, f);
+    }
+    token[len] = '\0';
+    return 1;
+}
+
+int is_pgn_result(char *token) {
+    return strcmp(token, "1-0") == 0 || strcmp(token, "0-1") == 0
+        || strcmp(token, "1/2-1/2") == 0 || strcmp(token, "*") == 0;
+}
+
+int read_pgn_game(PgnReader *reader, PgnGame *game) {
+    /* Read the next game into game. Return 1 if a game was read, 0 at the
+     * end of the file, and -1 if the game has a move that cannot be read,
+     * e.g. castling, which the move generator does not know. The moves up
+     * to it are kept and the rest of the game is skipped. A game with a FEN
+     * tag that is not valid also gives -1, and no moves. */
+    char token[PGN_TOKEN_MAX_LEN];
+    game->moves_len = 0;
+    strcpy(game->result, "*");
+    strcpy(game->fen, reader->default_fen != NULL ?
+                            reader->default_fen : standard_starting_fen);
+    Pos pos;
+    int has_content = 0;
+    int has_moves = 0;
+    int is_valid = 1;
+    for (;;) {
+        if (reader->pending_token[0] != '\0') {
+            strcpy(token, reader->pending_token);
+            reader->pending_token[0] = '\0';
+        } else if (!read_pgn_token(reader->f, token)) {
+            break;
+        }
+        if (token[0] == '[') {
+            if (has_moves) {
+                /* The next game; this one has no result token. */
+                strcpy(reader->pending_token, token);
+                break;
+            }
+            has_content = 1;
+            char fen[FEN_MAX_LEN];
+            if (sscanf(token, "[FEN \"%99[^\"]\"", fen) == 1) {
+                /* A game from a FEN that is not valid keeps the default
+                 * one, but none of its moves. */
+                if (is_valid_fen(fen)) {
+                    strcpy(game->fen, fen);
+                } else {
+                    fprintf(stderr, "Game %d: FEN is not valid.\n",
+                                                    reader->n_games + 1);
+                    is_valid = 0;
+                }
+            } else {
+                sscanf(token, "[Result \"%7[^\"]\"", game->result);
+            }
+            continue;
+        }
+        has_content = 1;
+        if (is_pgn_result(token)) {
+            strcpy(game->result, token);
+            break;
+        }
+        /* Move numbers, possibly run into the move as in 1.e4. */
+        char *san = token;
+        while (*san >= '0' && *san <= '9') {
+            san++;
+        }
+        while (*san == '.') {
+            san++;
+        }
+        if (*san == '\0' || !is_valid) {
+            continue;
+        }
+        /* Only the position being replayed needs its moves, so the move
+         * buffer is rewound after each move. */
+        Move *move_buffer_mark = ctx->move_buffer_current;
+        if (!has_moves) {
+            pos = decode_fen(game->fen);
+            has_moves = 1;
+        }
+        pos.is_explored = 0;
+        Move move;
+        if (!parse_san(&pos, san, &move)) {
+            fprintf(stderr, "Game %d: cannot read move %s.\n",
+                                                reader->n_games + 1, san);
+            is_valid = 0;
+        } else {
+            append_pgn_move(game, move);
+            Pos next_pos;
+            position_after_move(&pos, &move, &next_pos);
+            pos = next_pos;
+        }
+        ctx->move_buffer_current = move_buffer_mark;
+    }
+    if (!has_content) {
+        return 0;
+    }
+    reader->n_games++;
+    return is_valid ? 1 : -1;
+}
+
+int is_fen_line(char *line) {
+    /* The FEN lines in e.g. mates_in_2.txt are the only ones whose first
+     * field has seven slashes. Only the first field counts, since what
+     * follows it on EPD lines, e.g. c9 "1/2-1/2", may have more. */
+    int slashes_found = 0;
+    for (int i = 0; line[i] != '\0' && line[i] != ' '; i++) {
+        if (line[i] == '/') {
+            slashes_found++;
+        }
+    }
+    return slashes_found == 7;
+}
+
+void strip_line_end(char *line) {
+    int len = strlen(line);
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'
+                                                || line[len - 1] == ' ')) {
+        line[--len] = '\0';
+    }
+}
+
+void epd_to_fen(char *line, char *fen) {
+    /* Copy the position fields of an EPD line to fen, adding the move
+     * counters that EPD does not have. fen must have room for FEN_MAX_LEN
+     * characters. */
+    int n_fields = 0;
+    int len = 0;
+    for (int i = 0; line[i] != '\0' && len < FEN_MAX_LEN - 5; i++) {
+        if (line[i] == ' ' && ++n_fields == 4) {
+            break;
+        }
+        fen[len++] = line[i];
+    }
+    strcpy(fen + len, " 0 1");
+}
+
+int pack_main(int argc, char **argv) {
+    /* Evaluate every FEN found in a text file and store the results in a
+     * position record file. */
+    Ply ply = 2;
+    EvalCache *cache = NULL;
+    int opt;
+    while ((opt = getopt(argc - 1, argv + 1, "p:c:w:N:")) != -1) {
+        if (opt == 'p') {
+            ply = atoi(optarg);
+        } else if (opt == 'w') {
+            if (read_eval_weights(optarg) < 0) {
+                return 1;
+            }
+        } else if (opt == 'N') {
+            if (read_nnue_network(optarg) < 0) {
+                return 1;
+            }
+        } else if (opt == 'c') {
+            if ((cache = open_eval_cache(optarg)) == NULL) {
+                return 1;
+            }
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind + 2 >= argc) {
+        fprintf(stderr,
+            "Usage: %s pack [-p PLY] [-c CACHE_FILE] [-w WEIGHTS_FILE] "
+            "[-N NETWORK_FILE] FEN_FILE RECORD_FILE\n",
+            argv[0]);
+        return 1;
+    }
+    char *fen_path = argv[optind + 1];
+    char *record_path = argv[optind + 2];
+    FILE *f = fopen(fen_path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s for reading.\n", fen_path);
+        return 1;
+    }
+    int records_cap = 1024;
+    int records_len = 0;
+    PositionRecord *records = malloc(records_cap * sizeof(PositionRecord));
+    if (records == NULL) {
+        fprintf(stderr, "Could not allocate memory. Aborting...\n");
+        abort();
+    }
+    char line[500];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        strip_line_end(line);
+        if (!is_fen_line(line) || !is_valid_fen(line)) {
+            continue;
+        }
+        reset_buffers();
+        Pos pos = decode_fen(line);
+        EvalResult *ers = cached_position_val_at_ply(
+                            cache, &pos, ply, &prune_strat_no_pruning, 0);
+        if (records_len == records_cap) {
+            records_cap *= 2;
+            records = realloc(records, records_cap * sizeof(PositionRecord));
+        }
+        if (records == NULL) {
+            fprintf(stderr, "Could not allocate memory. Aborting...\n");
+            abort();
+        }
+        PositionRecord *record = &records[records_len++];
+        pack_position(&pos, &record->pos);
+        record->val = ers[0].val;
+        record->ply = ply;
+        if (ers[0].line.len > 0) {
+            record->best_move = ers[0].line.moves[0];
+        } else {
+            memset(&record->best_move, 0, sizeof(Move));
+            record->best_move.promotion_to = PIECE_EMPTY;
+        }
+    }
+    fclose(f);
+    int ret =
+        write_position_records(record_path, records, records_len) == 0 ? 0 : 1;
+    free(records);
+    printf("Packed %d positions.\n", records_len);
+    if (cache != NULL) {
+        printf("Cache hits: %d, misses: %d\n", cache->n_hits, cache->n_misses);
+        close_eval_cache(cache);
+    }
+    return ret;
+}
+
+int parse_selectivity(char *str) {
+    /* Letters n(ull move), l(ate move reductions), f(utility),
+     * r(azoring), and c(heck), o(ne reply) and s(ingular) extensions, or -1
+     * for anything else. */
+    int selectivity = 0;
+    for (int i = 0; str[i] != '\0'; i++) {
+        if (str[i] == 'n') { selectivity |= SelectivityNullMove; }
+        else if (str[i] == 'l') {
+            selectivity |= SelectivityLateMoveReductions;
+        }
+        else if (str[i] == 'f') { selectivity |= SelectivityFutility; }
+        else if (str[i] == 'r') { selectivity |= SelectivityRazoring; }
+        else if (str[i] == 'c') { selectivity |= SelectivityCheckExtension; }
+        else if (str[i] == 'o') {
+            selectivity |= SelectivityOneReplyExtension;
+        }
+        else if (str[i] == 's') {
+            selectivity |= SelectivitySingularExtension;
+        }
+        else { return -1; }
+    }
+    return selectivity;
+}
+
+int solve_main(int argc, char **argv) {
+    /* Search every FEN found in a text file and print the best line, or the
+     * best multi_pv lines with their values. */
+    Ply ply = 3;
+    int multi_pv = 1;
+    int iter_deepening = 0;
+    EvalCache *cache = NULL;
+    PruneStrategy prune_strat = prune_strat_no_pruning;
+    int opt;
+    Book *book = NULL;
+    while ((opt = getopt(argc - 1, argv + 1, "p:m:c:s:it:b:w:N:")) != -1) {
+        if (opt == 'p') {
+            ply = atoi(optarg);
+        } else if (opt == 'w') {
+            if (read_eval_weights(optarg) < 0) {
+                return 1;
+            }
+        } else if (opt == 'N') {
+            if (read_nnue_network(optarg) < 0) {
+                return 1;
+            }
+        } else if (opt == 's') {
+            if ((prune_strat.selectivity = parse_selectivity(optarg)) < 0) {
+                optind = argc;
+                break;
+            }
+        } else if (opt == 'm') {
+            multi_pv = atoi(optarg);
+        } else if (opt == 'i') {
+            iter_deepening = 1;
+        } else if (opt == 't') {
+            if (open_tablebases(optarg) < 0) {
+                return 1;
+            }
+        } else if (opt == 'b') {
+            if ((book = open_book(optarg)) == NULL) {
+                return 1;
+            }
+        } else if (opt == 'c') {
+            if ((cache = open_eval_cache(optarg)) == NULL) {
+                return 1;
+            }
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind + 1 >= argc || multi_pv < 1) {
+        fprintf(stderr,
+            "Usage: %s solve [-i] [-p PLY] [-m MULTI_PV] [-s nlfrcos] "
+            "[-c CACHE_FILE] [-t TABLEBASE_DIR] [-b BOOK_FILE] "
+            "[-w WEIGHTS_FILE] [-N NETWORK_FILE] FEN_FILE\n",
+            argv[0]);
+        return 1;
+    }
+    char *path = argv[optind + 1];
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s for reading.\n", path);
+        return 1;
+    }
+    char line[500];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        strip_line_end(line);
+        if (!is_fen_line(line)) {
+            continue;
+        }
+        printf("%s\n", line);
+        if (!is_valid_fen(line)) {
+            printf("FEN is not valid.\n\n");
+            continue;
+        }
+        reset_buffers();
+        Pos pos = decode_fen(line);
+        BookMove book_moves_found[BOOK_MAX_MOVES];
+        int n_book_moves = book == NULL ? 0
+                : book_moves(book, &pos, book_moves_found, BOOK_MAX_MOVES);
+        if (n_book_moves > 0) {
+            /* Book moves are played without searching; show their share of
+             * the weight instead of a value. */
+            int total_weight = 0;
+            for (int i = 0; i < n_book_moves; i++) {
+                total_weight += book_moves_found[i].weight;
+            }
+            MoveLine book_line = { .len = 1 };
+            for (int i = 0; i < n_book_moves; i++) {
+                book_line.moves[0] = book_moves_found[i].move;
+                printf("book %d%% ", total_weight == 0 ? 0 :
+                        100 * book_moves_found[i].weight / total_weight);
+                print_move_list(&book_line, &pos);
+            }
+        } else if (multi_pv == 1 && !iter_deepening) {
+            EvalResult *ers = cached_position_val_at_ply(
+                            cache, &pos, ply, &prune_strat, 0);
+            print_move_list(&ers[0].line, &pos);
+        } else {
+            /* The cache only holds the best move at a fixed depth, so it is
+             * not used. */
+            EvalResult *ers = iter_deepening ?
+                position_val_iter_deepening(
+                            &pos, ply, &prune_strat, 0, multi_pv)
+                : position_val_at_ply(&pos, ply, &prune_strat, 0, multi_pv);
+            for (int i = 0; i < multi_pv && i < pos.moves_len; i++) {
+                char val_str[16];
+                val_to_str(ers[i].val, val_str);
+                printf("%s ", val_str);
+                print_move_list(&ers[i].line, &pos);
+            }
+        }
+        printf("\n");
+    }
+    fclose(f);
+    if (cache != NULL) {
+        printf("Cache hits: %d, misses: %d\n", cache->n_hits, cache->n_misses);
+        close_eval_cache(cache);
+    }
+    if (book != NULL) {
+        close_book(book);
+    }
+    if (n_tablebases > 0) {
+        printf("Tablebase hits: %d\n", ctx->n_tablebase_hits);
+    }
+    printf("Number of positions explored: %d\n", ctx->n_pos_explored);
+    return 0;
+}
+
+int tbgen_main(int argc, char **argv) {
+    /* Generate tablebases, e.g. KQvK or KRvKP, into a directory. Tables
+     * already in the directory are used rather than generated again. */
+    char *dir_path = ".";
+    int opt;
+    while ((opt = getopt(argc - 1, argv + 1, "d:")) != -1) {
+        if (opt == 'd') {
+            dir_path = optarg;
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind + 1 >= argc) {
+        fprintf(stderr, "Usage: %s tbgen [-d DIR] SIGNATURE...\n", argv[0]);
+        return 1;
+    }
+    if (open_tablebases(dir_path) < 0) {
+        return 1;
+    }
+    for (int i = optind + 1; i < argc; i++) {
+        if (generate_tablebase(argv[i], dir_path) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void read_epd_book_entries(FILE *f, BookEntries *entries) {
+    /* Each line is a position followed by a bm opcode listing book moves in
+     * coordinate notation, e.g.
+     *
+     *   rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - bm e2e4 d2d4;
+     */
+    char line[500];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        strip_line_end(line);
+        char *moves = strstr(line, " bm ");
+        if (!is_fen_line(line) || moves == NULL) {
+            continue;
+        }
+        char fen[FEN_MAX_LEN];
+        epd_to_fen(line, fen);
+        if (!is_valid_fen(fen)) {
+            continue;
+        }
+        reset_buffers();
+        Pos pos = decode_fen(fen);
+        char *end = strchr(moves, ';');
+        if (end != NULL) {
+            *end = '\0';
+        }
+        for (
+            char *token = strtok(moves + 4, " ");
+            token != NULL;
+            token = strtok(NULL, " ")
+        ) {
+            Move move;
+            if (!parse_coordinate_move(&pos, token, &move)) {
+                fprintf(stderr, "Skipping illegal move %s in %s\n",
+                                                                token, fen);
+                continue;
+            }
+            append_book_entry(entries, &pos, move);
+        }
+    }
+}
+
+void read_pgn_book_entries(FILE *f, Ply max_ply, BookEntries *entries) {
+    /* Every move played in the first max_ply half-moves of a game. */
+    PgnReader reader;
+    init_pgn_reader(&reader, f);
+    PgnGame game;
+    init_pgn_game(&game);
+    while (read_pgn_game(&reader, &game) != 0) {
+        reset_buffers();
+        Pos pos = decode_fen(game.fen);
+        for (int i = 0; i < game.moves_len && i < max_ply; i++) {
+            append_book_entry(entries, &pos, game.moves[i]);
+            Pos next_pos;
+            position_after_move(&pos, &game.moves[i], &next_pos);
+            pos = next_pos;
+        }
+    }
+    free_pgn_game(&game);
+}
+
+int book_main(int argc, char **argv) {
+    /* Build a book from an EPD file or, if its name ends in .pgn, a PGN
+     * file. Every occurrence of a move adds one to its weight. */
+    Ply max_ply = 20;
+    int opt;
+    while ((opt = getopt(argc - 1, argv + 1, "p:")) != -1) {
+        if (opt == 'p') {
+            max_ply = atoi(optarg);
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind + 2 >= argc) {
+        fprintf(stderr,
+            "Usage: %s book [-p PLY] EPD_OR_PGN_FILE BOOK_FILE\n", argv[0]);
+        return 1;
+    }
+    char *in_path = argv[optind + 1];
+    char *book_path = argv[optind + 2];
+    FILE *f = fopen(in_path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s for reading.\n", in_path);
+        return 1;
+    }
+    BookEntries entries = { .entries = NULL, .len = 0, .cap = 0 };
+    size_t len = strlen(in_path);
+    if (len >= 4 && strcmp(in_path + len - 4, ".pgn") == 0) {
+        read_pgn_book_entries(f, max_ply, &entries);
+    } else {
+        read_epd_book_entries(f, &entries);
+    }
+    fclose(f);
+    int n_written = write_book(book_path, entries.entries, entries.len);
+    free(entries.entries);
+    if (n_written < 0) {
+        return 1;
+    }
+    printf("Wrote %d book entries.\n", n_written);
+    return 0;
+}
+
+int verify_main(int argc, char **argv) {
+    /* Check a puzzle file such as mates_in_2.txt, where each FEN is
+     * followed by a line with its solution, e.g. "1. Qd5+ Ka6 2. cxb8=N#".
+     * Every solution has to be legal and end in mate, and the solver has
+     * to find its first move. */
+    Ply ply = 3;
+    PruneStrategy prune_strat = prune_strat_no_pruning;
+    int opt;
+    while ((opt = getopt(argc - 1, argv + 1, "p:s:")) != -1) {
+        if (opt == 'p') {
+            ply = atoi(optarg);
+        } else if (opt == 's') {
+            if ((prune_strat.selectivity = parse_selectivity(optarg)) < 0) {
+                optind = argc;
+                break;
+            }
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind + 1 >= argc) {
+        fprintf(stderr,
+            "Usage: %s verify [-p PLY] [-s nlfrcos] PUZZLE_FILE\n", argv[0]);
+        return 1;
+    }
+    char *path = argv[optind + 1];
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s for reading.\n", path);
+        return 1;
+    }
+    int n_puzzles = 0;
+    int n_bad_solutions = 0;
+    int n_solved = 0;
+    char fen[500];
+    char line[500];
+    PgnGame game;
+    init_pgn_game(&game);
+    while (fgets(fen, sizeof(fen), f) != NULL) {
+        strip_line_end(fen);
+        if (!is_fen_line(fen)) {
+            continue;
+        }
+        if (fgets(line, sizeof(line), f) == NULL) {
+            break;
+        }
+        n_puzzles++;
+        if (!is_valid_fen(fen)) {
+            printf("%s\nFEN is not valid.\n", fen);
+            n_bad_solutions++;
+            continue;
+        }
+        reset_buffers();
+        FILE *solution = fmemopen(line, strlen(line), "r");
+        if (solution == NULL) {
+            fprintf(stderr, "Could not read solution. Aborting...\n");
+            abort();
+        }
+        PgnReader reader;
+        init_pgn_reader(&reader, solution);
+        reader.default_fen = fen;
+        int ret = read_pgn_game(&reader, &game);
+        fclose(solution);
+        Pos pos = decode_fen(fen);
+        Pos end_pos = pos;
+        for (int i = 0; i < game.moves_len; i++) {
+            Pos next_pos;
+            position_after_move(&end_pos, &game.moves[i], &next_pos);
+            end_pos = next_pos;
+        }
+        explore_position(&end_pos);
+        if (ret != 1 || game.moves_len == 0 || !end_pos.is_king_in_checkmate) {
+            printf("%s\nsolution does not mate: %s", fen, line);
+            n_bad_solutions++;
+            continue;
+        }
+        EvalResult *ers = position_val_iter_deepening(
+                                    &pos, ply, &prune_strat, 0, 1);
+        if (ers[0].line.len > 0 && move_eq(ers[0].line.moves[0], game.moves[0])
+                && ers[0].line.moves[0].promotion_to
+                                            == game.moves[0].promotion_to) {
+            n_solved++;
+        } else {
+            printf("%s\nexpected %s", fen, line);
+            print_move_list(&ers[0].line, &pos);
+        }
+    }
+    fclose(f);
+    free_pgn_game(&game);
+    printf("Puzzles: %d, bad solutions: %d, solved: %d\n",
+                                    n_puzzles, n_bad_solutions, n_solved);
+    return 0;
+}
+
+/* Evaluation tuning.
+ *
+ * Texel's method: the evaluation weights are fitted by gradient descent so
+ * that a sigmoid of the static value predicts the result of the game each
+ * position was taken from. Positions are read from an EPD file whose lines
+ * hold a position and the game's result, either as a PGN result or as a
+ * score from white's point of view in brackets, e.g.
+ *
+ *   rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq - c9 "1/2-1/2";
+ *   8/5k2/8/8/8/3K4/4R3/8 w - - [1.0]
+ *
+ * The positions are packed as they are read and shared out between the
+ * threads, each of which unpacks its share in batches and turns every
+ * position into the counts of its evaluation terms (see EvalTrace). As the
+ * value is linear in the weights, the descent then only needs those counts:
+ * at every step each thread sums the error and its gradient over its share,
+ * and the sums are added up and applied by the main thread. */
+
+#define TUNE_BATCH_N_POSITIONS 256
+#define TUNE_MAX_THREADS 64
+#define TUNE_ADAM_BETA1 0.9
+#define TUNE_ADAM_BETA2 0.999
+
+typedef struct TuneCoef {
+    uint16_t index;
+    int16_t count;
+} TuneCoef;
+
+typedef struct TuneEntry {
+    double result;
+    int phase;
+    int coefs_start;
+    int n_coefs;
+} TuneEntry;
+
+/* One thread's share of the positions, and what it computes from them. */
+typedef struct TuneShard {
+    PackedPos *packed;
+    double *results;
+    int n;
+    TuneEntry *entries;
+    TuneCoef *coefs;
+    int coefs_len;
+    int coefs_cap;
+    /* Weights by index, middlegame then endgame, shared by all shards. */
+    double (*weights)[2];
+    double k;
+    double error;
+    double (*gradient)[2];
+} TuneShard;
+
+int parse_epd_result(char *line, double *result) {
+    /* Return 1 and set result to the result from white's point of view, or
+     * return 0 if the line has none. */
+    if (strstr(line, "1/2-1/2") != NULL || strstr(line, "[0.5]") != NULL) {
+        *result = 0.5;
+    } else if (strstr(line, "1-0") != NULL || strstr(line, "[1.0]") != NULL) {
+        *result = 1;
+    } else if (strstr(line, "0-1") != NULL || strstr(line, "[0.0]") != NULL) {
+        *result = 0;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+void *tune_shard_extract(void *arg) {
+    /* Fill in the shard's entries and coefficients, with an engine of the
+     * shard's own to unpack the positions in. */
+    TuneShard *shard = arg;
+    ctx = engine_create();
+    if (ctx == NULL) {
+        fprintf(stderr, "Could not allocate memory. Aborting...\n");
+        abort();
+    }
+    Pos batch[TUNE_BATCH_N_POSITIONS];
+    EvalTrace trace;
+    shard->entries = malloc((shard->n > 0 ? shard->n : 1) * sizeof(TuneEntry));
+    if (shard->entries == NULL) {
+        fprintf(stderr, "Could not allocate memory. Aborting...\n");
+        abort();
+    }
+    for (int start = 0; start < shard->n; start += TUNE_BATCH_N_POSITIONS) {
+        int n = shard->n - start;
+        if (n > TUNE_BATCH_N_POSITIONS) {
+            n = TUNE_BATCH_N_POSITIONS;
+        }
+        unpack_positions(shard->packed + start, n, batch);
+        for (int i = 0; i < n; i++) {
+            memset(&trace, 0, sizeof(trace));
+            tapered_static_val(&batch[i], &trace);
+            TuneEntry *entry = &shard->entries[start + i];
+            entry->result = shard->results[start + i];
+            entry->phase = trace.phase;
+            entry->coefs_start = shard->coefs_len;
+            entry->n_coefs = 0;
+            for (int index = 0; index < N_EVAL_WEIGHTS; index++) {
+                if (trace.coefs[index] == 0) {
+                    continue;
+                }
+                if (shard->coefs_len == shard->coefs_cap) {
+                    shard->coefs_cap =
+                        shard->coefs_cap == 0 ? 4096 : shard->coefs_cap * 2;
+                    shard->coefs = realloc(shard->coefs,
+                                        shard->coefs_cap * sizeof(TuneCoef));
+                    if (shard->coefs == NULL) {
+                        fprintf(stderr,
+                            "Could not allocate memory. Aborting...\n");
+                        abort();
+                    }
+                }
+                TuneCoef *coef = &shard->coefs[shard->coefs_len++];
+                coef->index = index;
+                coef->count = trace.coefs[index];
+                entry->n_coefs++;
+            }
+        }
+    }
+    engine_destroy(ctx);
+    ctx = &default_engine;
+    return NULL;
+}
+
+void *tune_shard_error(void *arg) {
+    /* Sum the squared error of the shard's positions, and its gradient,
+     * under the current weights. */
+    TuneShard *shard = arg;
+    double c = shard->k * log(10) / 400;
+    memset(shard->gradient, 0, N_EVAL_WEIGHTS * sizeof(*shard->gradient));
+    shard->error = 0;
+    for (int i = 0; i < shard->n; i++) {
+        TuneEntry *entry = &shard->entries[i];
+        TuneCoef *coefs = shard->coefs + entry->coefs_start;
+        double mg = 0;
+        double eg = 0;
+        for (int j = 0; j < entry->n_coefs; j++) {
+            mg += coefs[j].count * shard->weights[coefs[j].index][0];
+            eg += coefs[j].count * shard->weights[coefs[j].index][1];
+        }
+        double mg_part = entry->phase / (double) MAX_GAME_PHASE;
+        double val = mg * mg_part + eg * (1 - mg_part);
+        double predicted = 1 / (1 + exp(-c * val));
+        double diff = predicted - entry->result;
+        shard->error += diff * diff;
+        double d = 2 * diff * predicted * (1 - predicted) * c;
+        for (int j = 0; j < entry->n_coefs; j++) {
+            double *g = shard->gradient[coefs[j].index];
+            g[0] += d * coefs[j].count * mg_part;
+            g[1] += d * coefs[j].count * (1 - mg_part);
+        }
+    }
+    return NULL;
+}
+
+void run_tune_shards(TuneShard *shards, int n_shards, void *(*fn)(void *)) {
+    /* Run fn on every shard, one thread each, and wait for them all. */
+    pthread_t threads[TUNE_MAX_THREADS];
+    for (int i = 0; i < n_shards; i++) {
+        if (pthread_create(&threads[i], NULL, fn, &shards[i]) != 0) {
+            fprintf(stderr, "Could not start a thread. Aborting...\n");
+            abort();
+        }
+    }
+    for (int i = 0; i < n_shards; i++) {
+        pthread_join(threads[i], NULL);
+    }
+}
+
+double tune_error(
+    TuneShard *shards, int n_shards, int n_positions, double k,
+    double (*gradient)[2]
+) {
+    /* The mean squared error over all positions, with its gradient in
+     * gradient. */
+    for (int i = 0; i < n_shards; i++) {
+        shards[i].k = k;
+    }
+    run_tune_shards(shards, n_shards, tune_shard_error);
+    double error = 0;
+    memset(gradient, 0, N_EVAL_WEIGHTS * sizeof(*gradient));
+    for (int i = 0; i < n_shards; i++) {
+        error += shards[i].error;
+        for (int index = 0; index < N_EVAL_WEIGHTS; index++) {
+            gradient[index][0] += shards[i].gradient[index][0] / n_positions;
+            gradient[index][1] += shards[i].gradient[index][1] / n_positions;
+        }
+    }
+    return error / n_positions;
+}
+
+int read_tune_positions(
+    char *path, PackedPos **packed_out, double **results_out
+) {
+    /* Read and pack the positions of an EPD file with results. Mates and
+     * stalemates are skipped, as the static evaluation does not score them
+     * with the weights. Return the number of positions, or -1 on failure. */
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s for reading.\n", path);
+        return -1;
+    }
+    int cap = TUNE_BATCH_N_POSITIONS;
+    int len = 0;
+    PackedPos *packed = malloc(cap * sizeof(PackedPos));
+    double *results = malloc(cap * sizeof(double));
+    Pos batch[TUNE_BATCH_N_POSITIONS];
+    int batch_len = 0;
+    char line[500];
+    char fen[FEN_MAX_LEN];
+    int is_eof = 0;
+    while (!is_eof) {
+        is_eof = fgets(line, sizeof(line), f) == NULL;
+        double result;
+        if (!is_eof && is_fen_line(line) && parse_epd_result(line, &result)) {
+            epd_to_fen(line, fen);
+            if (!is_valid_fen(fen)) {
+                continue;
+            }
+            reset_buffers();
+            Pos pos = decode_fen(fen);
+            if (!has_legal_move(&pos)) {
+                continue;
+            }
+            if (len + batch_len == cap) {
+                cap *= 2;
+                packed = realloc(packed, cap * sizeof(PackedPos));
+                results = realloc(results, cap * sizeof(double));
+            }
+            if (packed == NULL || results == NULL) {
+                fprintf(stderr, "Could not allocate memory. Aborting...\n");
+                abort();
+            }
+            results[len + batch_len] = result;
+            batch[batch_len++] = pos;
+        }
+        if (batch_len == TUNE_BATCH_N_POSITIONS || (is_eof && batch_len > 0)) {
+            pack_positions(batch, batch_len, packed + len);
+            len += batch_len;
+            batch_len = 0;
+        }
+    }
+    fclose(f);
+    *packed_out = packed;
+    *results_out = results;
+    return len;
+}
+
+int tune_main(int argc, char **argv) {
+    /* Fit the evaluation weights to the positions of an EPD file with
+     * results and write them to a weights file. K scales values before the
+     * sigmoid; if not given, it is first fitted with the weights fixed. */
+    int n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int n_iterations = 1000;
+    double rate = 1;
+    double k = 0;
+    int opt;
+    while ((opt = getopt(argc - 1, argv + 1, "j:n:r:k:w:")) != -1) {
+        if (opt == 'j') {
+            n_threads = atoi(optarg);
+        } else if (opt == 'n') {
+            n_iterations = atoi(optarg);
+        } else if (opt == 'r') {
+            rate = atof(optarg);
+        } else if (opt == 'k') {
+            k = atof(optarg);
+        } else if (opt == 'w') {
+            if (read_eval_weights(optarg) < 0) {
+                return 1;
+            }
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind + 2 >= argc) {
+        fprintf(stderr,
+            "Usage: %s tune [-j THREADS] [-n ITERATIONS] [-r RATE] [-k K] "
+            "[-w WEIGHTS_FILE] EPD_FILE WEIGHTS_FILE\n",
+            argv[0]);
+        return 1;
+    }
+    if (n_threads < 1) {
+        n_threads = 1;
+    } else if (n_threads > TUNE_MAX_THREADS) {
+        n_threads = TUNE_MAX_THREADS;
+    }
+    PackedPos *packed;
+    double *results;
+    int n_positions = read_tune_positions(argv[optind + 1], &packed, &results);
+    if (n_positions < 0) {
+        return 1;
+    }
+    if (n_positions == 0) {
+        fprintf(stderr, "No positions with results in %s.\n",
+                                                            argv[optind + 1]);
+        return 1;
+    }
+    printf("Positions: %d, threads: %d\n", n_positions, n_threads);
+
+    double (*weights)[2] = malloc(N_EVAL_WEIGHTS * sizeof(*weights));
+    double (*gradient)[2] = malloc(N_EVAL_WEIGHTS * sizeof(*gradient));
+    double (*m)[2] = calloc(N_EVAL_WEIGHTS, sizeof(*m));
+    double (*v)[2] = calloc(N_EVAL_WEIGHTS, sizeof(*v));
+    TuneShard shards[TUNE_MAX_THREADS];
+    memset(shards, 0, sizeof(shards));
+    for (int i = 0; i < n_threads; i++) {
+        int start = (int64_t) n_positions * i / n_threads;
+        int end = (int64_t) n_positions * (i + 1) / n_threads;
+        shards[i].packed = packed + start;
+        shards[i].results = results + start;
+        shards[i].n = end - start;
+        shards[i].weights = weights;
+        shards[i].gradient = malloc(N_EVAL_WEIGHTS * sizeof(*gradient));
+        if (shards[i].gradient == NULL) {
+            fprintf(stderr, "Could not allocate memory. Aborting...\n");
+            abort();
+        }
+    }
+    if (weights == NULL || gradient == NULL || m == NULL || v == NULL) {
+        fprintf(stderr, "Could not allocate memory. Aborting...\n");
+        abort();
+    }
+    for (int index = 0; index < N_EVAL_WEIGHTS; index++) {
+        Score *weight = (Score *) &eval_weights + index;
+        weights[index][0] = weight->mg;
+        weights[index][1] = weight->eg;
+    }
+    run_tune_shards(shards, n_threads, tune_shard_extract);
+
+    if (k <= 0) {
+        /* A coarse scan, then a finer one around the best K found. */
+        double best_error = 1;
+        double best_k = 1;
+        for (int i = 1; i <= 30; i++) {
+            double error = tune_error(
+                        shards, n_threads, n_positions, i * 0.1, gradient);
+            if (error < best_error) {
+                best_error = error;
+                best_k = i * 0.1;
+            }
+        }
+        k = best_k;
+        for (int i = -9; i <= 9; i++) {
+            double error = tune_error(
+                    shards, n_threads, n_positions, k + i * 0.01, gradient);
+            if (error < best_error) {
+                best_error = error;
+                best_k = k + i * 0.01;
+            }
+        }
+        k = best_k;
+    }
+    double error =
+                tune_error(shards, n_threads, n_positions, k, gradient);
+    printf("K: %.2f, initial error: %.6f\n", k, error);
+
+    /* Adam, which copes with the very different scales of the gradients of
+     * e.g. material and piece-square weights. */
+    for (int iteration = 1; iteration <= n_iterations; iteration++) {
+        double beta1_t = pow(TUNE_ADAM_BETA1, iteration);
+        double beta2_t = pow(TUNE_ADAM_BETA2, iteration);
+        for (int index = 0; index < N_EVAL_WEIGHTS; index++) {
+            for (int part = 0; part < 2; part++) {
+                double g = gradient[index][part];
+                m[index][part] = TUNE_ADAM_BETA1 * m[index][part]
+                                            + (1 - TUNE_ADAM_BETA1) * g;
+                v[index][part] = TUNE_ADAM_BETA2 * v[index][part]
+                                            + (1 - TUNE_ADAM_BETA2) * g * g;
+                double m_hat = m[index][part] / (1 - beta1_t);
+                double v_hat = v[index][part] / (1 - beta2_t);
+                weights[index][part] -= rate * m_hat / (sqrt(v_hat) + 1e-8);
+            }
+        }
+        error = tune_error(shards, n_threads, n_positions, k, gradient);
+        if (iteration % 100 == 0 || iteration == n_iterations) {
+            printf("Iteration %d, error: %.6f\n", iteration, error);
+        }
+    }
+
+    for (int index = 0; index < N_EVAL_WEIGHTS; index++) {
+        Score *weight = (Score *) &eval_weights + index;
+        weight->mg = lround(weights[index][0]);
+        weight->eg = lround(weights[index][1]);
+    }
+    int ret = write_eval_weights(argv[optind + 2]) == 0 ? 0 : 1;
+    for (int i = 0; i < n_threads; i++) {
+        free(shards[i].entries);
+        free(shards[i].coefs);
+        free(shards[i].gradient);
+    }
+    free(weights);
+    free(gradient);
+    free(m);
+    free(v);
+    free(packed);
+    free(results);
+    return ret;
+}
+
+/* NNUE training. Like the weights in tune_main, the network is fitted so
+ * that a sigmoid of its value predicts the results of the positions of an
+ * EPD file. It is trained in floating point, with Adam on mini-batches of
+ * shuffled positions, and then quantised. Weights are kept within
+ * NNUE_TRAIN_MAX_WEIGHT, so that the accumulators fit in 16 bits and the
+ * output weights in 8. */
+
+#define NNUE_TRAIN_MAX_WEIGHT 1.98
+#define NNUE_TRAIN_MAX_PIECES 32
+
+typedef struct NnueTrainParams {
+    float feature_weights[NNUE_N_FEATURES][NNUE_N_HIDDEN];
+    float feature_biases[NNUE_N_HIDDEN];
+    float output_weights[2 * NNUE_N_HIDDEN];
+    float output_bias;
+} NnueTrainParams;
+
+#define NNUE_N_TRAIN_PARAMS ( sizeof(NnueTrainParams) / sizeof(float) )
+
+typedef struct NnueTrainEntry {
+    /* The result for the side to move. */
+    float result;
+    int n_pieces;
+    /* The inputs seen from the side to move, then from the opponent. */
+    uint16_t features[2][NNUE_TRAIN_MAX_PIECES];
+} NnueTrainEntry;
+
+double nnue_train_error(
+    NnueTrainParams *params, NnueTrainEntry *entry, double c,
+    NnueTrainParams *gradient
+) {
+    /* The squared error of entry, whose gradient is added to gradient
+     * unless it is NULL. c scales the value before the sigmoid. */
+    float hidden[2][NNUE_N_HIDDEN];
+    double y = params->output_bias;
+    for (int side = 0; side < 2; side++) {
+        memcpy(hidden[side], params->feature_biases, sizeof(hidden[side]));
+        for (int k = 0; k < entry->n_pieces; k++) {
+            float *column = params->feature_weights[entry->features[side][k]];
+            for (int i = 0; i < NNUE_N_HIDDEN; i++) {
+                hidden[side][i] += column[i];
+            }
+        }
+        float *weights = params->output_weights + side * NNUE_N_HIDDEN;
+        for (int i = 0; i < NNUE_N_HIDDEN; i++) {
+            float h = hidden[side][i];
+            y += (h < 0 ? 0 : h > 1 ? 1 : h) * weights[i];
+        }
+    }
+    double predicted = 1 / (1 + exp(-c * y * NNUE_SCALE));
+    double diff = predicted - entry->result;
+    if (gradient == NULL) {
+        return diff * diff;
+    }
+    double d = 2 * diff * predicted * (1 - predicted) * c * NNUE_SCALE;
+    gradient->output_bias += d;
+    for (int side = 0; side < 2; side++) {
+        float *weights = params->output_weights + side * NNUE_N_HIDDEN;
+        float *weights_gradient =
+                            gradient->output_weights + side * NNUE_N_HIDDEN;
+        float hidden_gradient[NNUE_N_HIDDEN];
+        for (int i = 0; i < NNUE_N_HIDDEN; i++) {
+            float h = hidden[side][i];
+            weights_gradient[i] += d * (h < 0 ? 0 : h > 1 ? 1 : h);
+            hidden_gradient[i] = h > 0 && h < 1 ? d * weights[i] : 0;
+            gradient->feature_biases[i] += hidden_gradient[i];
+        }
+        for (int k = 0; k < entry->n_pieces; k++) {
+            float *column =
+                    gradient->feature_weights[entry->features[side][k]];
+            for (int i = 0; i < NNUE_N_HIDDEN; i++) {
+                column[i] += hidden_gradient[i];
+            }
+        }
+    }
+    return diff * diff;
+}
+
+int nnuetrain_main(int argc, char **argv) {
+    /* Train a network on the positions of an EPD file with results and
+     * write it to a network file. */
+    int n_epochs = 10;
+    int batch_size = 1024;
+    double rate = 0.001;
+    double k = 1;
+    unsigned int seed = 1;
+    int opt;
+    while ((opt = getopt(argc - 1, argv + 1, "n:b:r:k:s:")) != -1) {
+        if (opt == 'n') {
+            n_epochs = atoi(optarg);
+        } else if (opt == 'b') {
+            batch_size = atoi(optarg);
+        } else if (opt == 'r') {
+            rate = atof(optarg);
+        } else if (opt == 'k') {
+            k = atof(optarg);
+        } else if (opt == 's') {
+            seed = atoi(optarg);
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind + 2 >= argc || batch_size < 1) {
+        fprintf(stderr,
+            "Usage: %s nnuetrain [-n EPOCHS] [-b BATCH_SIZE] [-r RATE] [-k K] "
+            "[-s SEED] EPD_FILE NETWORK_FILE\n",
+            argv[0]);
+        return 1;
+    }
+    PackedPos *packed;
+    double *results;
+    int n_positions = read_tune_positions(argv[optind + 1], &packed, &results);
+    if (n_positions < 0) {
+        return 1;
+    }
+    if (n_positions == 0) {
+        fprintf(stderr, "No positions with results in %s.\n",
+                                                            argv[optind + 1]);
+        return 1;
+    }
+    printf("Positions: %d\n", n_positions);
+
+    NnueTrainEntry *entries = malloc(n_positions * sizeof(NnueTrainEntry));
+    int *order = malloc(n_positions * sizeof(int));
+    NnueTrainParams *params = malloc(sizeof(NnueTrainParams));
+    NnueTrainParams *gradient = malloc(sizeof(NnueTrainParams));
+    float *m = calloc(NNUE_N_TRAIN_PARAMS, sizeof(float));
+    float *v = calloc(NNUE_N_TRAIN_PARAMS, sizeof(float));
+    NnueNetwork *network = malloc(sizeof(NnueNetwork));
+    if (
+        entries == NULL || order == NULL || params == NULL
+        || gradient == NULL || m == NULL || v == NULL || network == NULL
+    ) {
+        fprintf(stderr, "Could not allocate memory. Aborting...\n");
+        abort();
+    }
+    Pos batch[TUNE_BATCH_N_POSITIONS];
+    for (int start = 0; start < n_positions; start += TUNE_BATCH_N_POSITIONS) {
+        int n = n_positions - start;
+        if (n > TUNE_BATCH_N_POSITIONS) {
+            n = TUNE_BATCH_N_POSITIONS;
+        }
+        unpack_positions(packed + start, n, batch);
+        for (int i = 0; i < n; i++) {
+            Pos *pos = &batch[i];
+            NnueTrainEntry *entry = &entries[start + i];
+            int side = pos->active_color == COLOR_BLACK;
+            entry->result = side ? 1 - results[start + i] : results[start + i];
+            entry->n_pieces = 0;
+            uint64_t mask = ~placement_piece_mask(pos, PIECE_EMPTY);
+            for (; mask != 0; mask &= mask - 1) {
+                Sq sq = placement_bit_to_sq(__builtin_ctzll(mask));
+                Piece piece = get_piece_at_sq(pos, sq);
+                entry->features[0][entry->n_pieces] =
+                                            nnue_feature(piece, sq, side);
+                entry->features[1][entry->n_pieces] =
+                                            nnue_feature(piece, sq, !side);
+                entry->n_pieces++;
+            }
+        }
+    }
+    free(packed);
+    free(results);
+
+    /* The first-layer biases start in the middle of the range the
+     * accumulators are clipped to, where the gradient passes. */
+    float *p = (float *) params;
+    for (size_t i = 0; i < NNUE_N_TRAIN_PARAMS; i++) {
+        p[i] = 0.2 * rand_r(&seed) / RAND_MAX - 0.1;
+    }
+    for (int i = 0; i < NNUE_N_HIDDEN; i++) {
+        params->feature_biases[i] = 0.5;
+    }
+    params->output_bias = 0;
+    for (int i = 0; i < n_positions; i++) {
+        order[i] = i;
+    }
+
+    double c = k * log(10) / 400;
+    float *g = (float *) gradient;
+    int t = 0;
+    for (int epoch = 1; epoch <= n_epochs; epoch++) {
+        for (int i = n_positions - 1; i > 0; i--) {
+            int j = rand_r(&seed) % (i + 1);
+            int tmp = order[i];
+            order[i] = order[j];
+            order[j] = tmp;
+        }
+        double error = 0;
+        for (int start = 0; start < n_positions; start += batch_size) {
+            int n = n_positions - start;
+            if (n > batch_size) {
+                n = batch_size;
+            }
+            memset(gradient, 0, sizeof(NnueTrainParams));
+            for (int i = 0; i < n; i++) {
+                error += nnue_train_error(
+                            params, &entries[order[start + i]], c, gradient);
+            }
+            t++;
+            double beta1_t = pow(TUNE_ADAM_BETA1, t);
+            double beta2_t = pow(TUNE_ADAM_BETA2, t);
+            for (size_t i = 0; i < NNUE_N_TRAIN_PARAMS; i++) {
+                float gi = g[i] / n;
+                m[i] = TUNE_ADAM_BETA1 * m[i] + (1 - TUNE_ADAM_BETA1) * gi;
+                v[i] = TUNE_ADAM_BETA2 * v[i] + (1 - TUNE_ADAM_BETA2) * gi * gi;
+                p[i] -= rate * (m[i] / (1 - beta1_t))
+                                        / (sqrt(v[i] / (1 - beta2_t)) + 1e-8);
+                if (p[i] > NNUE_TRAIN_MAX_WEIGHT) {
+                    p[i] = NNUE_TRAIN_MAX_WEIGHT;
+                } else if (p[i] < -NNUE_TRAIN_MAX_WEIGHT) {
+                    p[i] = -NNUE_TRAIN_MAX_WEIGHT;
+                }
+            }
+        }
+        printf("Epoch %d, error: %.6f\n", epoch, error / n_positions);
+    }
+
+    for (int f = 0; f < NNUE_N_FEATURES; f++) {
+        for (int i = 0; i < NNUE_N_HIDDEN; i++) {
+            network->feature_weights[f][i] =
+                            lround(params->feature_weights[f][i] * NNUE_QA);
+        }
+    }
+    for (int i = 0; i < NNUE_N_HIDDEN; i++) {
+        network->feature_biases[i] = lround(params->feature_biases[i] * NNUE_QA);
+    }
+    for (int i = 0; i < 2 * NNUE_N_HIDDEN; i++) {
+        long w = lround(params->output_weights[i] * NNUE_QB);
+        network->output_weights[i] = w > 127 ? 127 : w < -128 ? -128 : w;
+    }
+    network->output_bias = lround(params->output_bias * NNUE_QA * NNUE_QB);
+    int ret = write_nnue_network(argv[optind + 2], network) == 0 ? 0 : 1;
+    free(entries);
+    free(order);
+    free(params);
+    free(gradient);
+    free(m);
+    free(v);
+    free(network);
+    return ret;
+}
+
+uint64_t perft(Pos *pos, int depth, int height, int64_t *val_sum) {
+    /* The number of move sequences of length depth from pos. With val_sum,
+     * the static values of the positions they end in are added to it.
+     * height is as for nnue_static_val. */
+    if (depth == 0) {
+        if (val_sum != NULL) {
+            *val_sum += static_val(pos, height);
+        }
+        return 1;
+    }
+    Move *move_buffer_mark = ctx->move_buffer_current;
+    pos->is_explored = 0;
+    explore_position(pos);
+    uint64_t n = 0;
+    if (depth == 1 && val_sum == NULL) {
+        n = pos->moves_len;
+    } else {
+        for (int i = 0; i < pos->moves_len; i++) {
+            Pos next_pos;
+            position_after_move(pos, &pos->p_moves[i], &next_pos);
+            if (ctx->nnue_network != NULL && height >= 0) {
+                nnue_make_move(height, pos, &next_pos);
+            }
+            n += perft(&next_pos, depth - 1, height < 0 ? -1 : height + 1,
+                                                                    val_sum);
+        }
+    }
+    ctx->move_buffer_current = move_buffer_mark;
+    return n;
+}
+
+double seconds_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+typedef struct BenchRun {
+    const char *name;
+    int is_generic;
+    /* The SIMD kernel, or NULL for the best one. */
+    const char *kernel;
+    int with_vals;
+    int with_nnue;
+    /* Whether NNUE accumulators are updated along the moves or computed
+     * from scratch at every leaf. */
+    int is_incremental;
+} BenchRun;
+
+BenchRun bench_runs[] = {
+    { "specialised", 0, NULL, 0, 0, 0 },
+    { "generic", 1, NULL, 0, 0, 0 },
+    { "scalar", 0, "scalar", 1, 0, 0 },
+    { "sse2", 0, "sse2", 1, 0, 0 },
+    { "avx2", 0, "avx2", 1, 0, 0 },
+    { "nnue", 0, NULL, 1, 1, 1 },
+    { "nnue-refresh", 0, NULL, 1, 1, 0 },
+    { "nnue-scalar", 0, "scalar", 1, 1, 1 },
+};
+
+#define BENCH_N_RUNS ( (int) (sizeof(bench_runs) / sizeof(BenchRun)) )
+
+double fitted_error(Val *vals, double *results, int n, double *k_out) {
+    /* The mean squared error of a sigmoid of vals as a prediction of
+     * results, with the scale K fitted as in tune_main. */
+    double best_error = 1;
+    double best_k = 1;
+    for (int pass = 0; pass < 2; pass++) {
+        double k0 = best_k;
+        for (int i = pass ? -9 : 1; i <= (pass ? 9 : 30); i++) {
+            double k = pass ? k0 + i * 0.01 : i * 0.1;
+            double c = k * log(10) / 400;
+            double error = 0;
+            for (int j = 0; j < n; j++) {
+                double diff = 1 / (1 + exp(-c * vals[j])) - results[j];
+                error += diff * diff;
+            }
+            error /= n;
+            if (error < best_error) {
+                best_error = error;
+                best_k = k;
+            }
+        }
+    }
+    *k_out = best_k;
+    return best_error;
+}
+
+int bench_accuracy(char *epd_path, NnueNetwork *network) {
+    /* Print how fast and how well the hand-written evaluation and the
+     * network, if any, predict the results of the positions of an EPD
+     * file. Return -1 on failure. */
+    PackedPos *packed;
+    double *results;
+    int n = read_tune_positions(epd_path, &packed, &results);
+    if (n <= 0) {
+        fprintf(stderr, "No positions with results in %s.\n", epd_path);
+        return -1;
+    }
+    Val *vals = malloc(n * sizeof(Val));
+    if (vals == NULL) {
+        fprintf(stderr, "Could not allocate memory. Aborting...\n");
+        abort();
+    }
+    printf("%d positions with results:\n", n);
+    for (int with_nnue = 0; with_nnue <= (network != NULL); with_nnue++) {
+        ctx->nnue_network = with_nnue ? network : NULL;
+        double seconds = 0;
+        Pos batch[TUNE_BATCH_N_POSITIONS];
+        for (int start = 0; start < n; start += TUNE_BATCH_N_POSITIONS) {
+            int batch_n = n - start;
+            if (batch_n > TUNE_BATCH_N_POSITIONS) {
+                batch_n = TUNE_BATCH_N_POSITIONS;
+            }
+            unpack_positions(packed + start, batch_n, batch);
+            double t = seconds_now();
+            for (int i = 0; i < batch_n; i++) {
+                vals[start + i] = static_val(&batch[i], -1);
+            }
+            seconds += seconds_now() - t;
+        }
+        double k;
+        double error = fitted_error(vals, results, n, &k);
+        printf("%-12s error %.6f (K %.2f) %12.0f evals/s\n",
+                with_nnue ? "nnue" : "tapered", error, k,
+                seconds > 0 ? n / seconds : 0);
+    }
+    ctx->nnue_network = NULL;
+    free(vals);
+    free(packed);
+    free(results);
+    return 0;
+}
+
+int bench_main(int argc, char **argv) {
+    /* Time move generation, as perft to a fixed depth from each FEN in a
+     * file, with the specialised generator and with the generic one; then
+     * the static evaluation, as perft with the value of every leaf, with
+     * each SIMD kernel the CPU has and, given a network, with NNUE. Runs
+     * have to agree on the counts, and those with the same evaluation on
+     * the values. Given an EPD file with results, also compare how well
+     * the evaluations predict them. */
+    int depth = 3;
+    NnueNetwork *network = NULL;
+    char *epd_path = NULL;
+    int opt;
+    while ((opt = getopt(argc - 1, argv + 1, "d:N:e:")) != -1) {
+        if (opt == 'd') {
+            depth = atoi(optarg);
+        } else if (opt == 'N') {
+            if (read_nnue_network(optarg) < 0) {
+                return 1;
+            }
+            network = ctx->nnue_network;
+            ctx->nnue_network = NULL;
+        } else if (opt == 'e') {
+            epd_path = optarg;
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind + 1 >= argc || depth < 1) {
+        fprintf(stderr,
+            "Usage: %s bench [-d DEPTH] [-N NETWORK_FILE] [-e EPD_FILE] "
+            "FEN_FILE\n",
+            argv[0]);
+        return 1;
+    }
+    char *path = argv[optind + 1];
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s for reading.\n", path);
+        return 1;
+    }
+    uint64_t totals[BENCH_N_RUNS] = { 0 };
+    double seconds[BENCH_N_RUNS] = { 0 };
+    int is_available[BENCH_N_RUNS];
+    for (int run = 0; run < BENCH_N_RUNS; run++) {
+        BenchRun *spec = &bench_runs[run];
+        init_simd_kernels(spec->kernel);
+        is_available[run] =
+            (spec->kernel == NULL || strcmp(simd_kernel, spec->kernel) == 0)
+            && (!spec->with_nnue || network != NULL);
+    }
+    int n_fens = 0;
+    int n_mismatches = 0;
+    char line[500];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        strip_line_end(line);
+        if (!is_fen_line(line) || !is_valid_fen(line)) {
+            continue;
+        }
+        n_fens++;
+        uint64_t counts[BENCH_N_RUNS];
+        int64_t val_sums[BENCH_N_RUNS];
+        /* The first run with the same evaluation, by with_nnue. */
+        int first_runs[2] = { -1, -1 };
+        for (int run = 0; run < BENCH_N_RUNS; run++) {
+            BenchRun *spec = &bench_runs[run];
+            if (!is_available[run]) {
+                continue;
+            }
+            ctx->use_generic_move_generator = spec->is_generic;
+            init_simd_kernels(spec->kernel);
+            ctx->nnue_network = spec->with_nnue ? network : NULL;
+            for (int i = 0; i < MAX_SEARCH_PLY + 2; i++) {
+                ctx->nnue_stack[i].is_computed = 0;
+            }
+            reset_buffers();
+            Pos pos = decode_fen(line);
+            val_sums[run] = 0;
+            double start = seconds_now();
+            counts[run] = perft(&pos, depth, spec->is_incremental ? 0 : -1,
+                                        spec->with_vals ? &val_sums[run] : NULL);
+            seconds[run] += seconds_now() - start;
+            totals[run] += counts[run];
+            int first_run = run;
+            if (spec->with_vals) {
+                if (first_runs[spec->with_nnue] < 0) {
+                    first_runs[spec->with_nnue] = run;
+                }
+                first_run = first_runs[spec->with_nnue];
+            }
+            if (
+                counts[run] != counts[0]
+                || val_sums[run] != val_sums[first_run]
+            ) {
+                printf("%s\n%s differs\n", line, spec->name);
+                n_mismatches++;
+            }
+        }
+    }
+    fclose(f);
+    ctx->use_generic_move_generator = 0;
+    init_simd_kernels(NULL);
+    ctx->nnue_network = NULL;
+    for (int run = 0; run < BENCH_N_RUNS; run++) {
+        if (run == 0 || bench_runs[run].with_vals != bench_runs[run-1].with_vals) {
+            printf(bench_runs[run].with_vals ?
+                    "perft with static values:\n" : "perft:\n");
+        }
+        if (!is_available[run]) {
+            printf("%-12s not available\n", bench_runs[run].name);
+            continue;
+        }
+        printf("%-12s %12llu nodes %8.3f s %12.0f nodes/s\n",
+            bench_runs[run].name, (unsigned long long) totals[run],
+            seconds[run], seconds[run] > 0 ? totals[run] / seconds[run] : 0);
+    }
+    printf("%d positions, depth %d, %d mismatches\n",
+                                        n_fens, depth, n_mismatches);
+    if (epd_path != NULL && bench_accuracy(epd_path, network) < 0) {
+        return 1;
+    }
+    free(network);
+    return n_mismatches > 0;
+}
+
+int unpack_main(int argc, char **argv) {
+    /* Print the contents of a position record file, one position per line:
+     * FEN, value and best move. */
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s unpack RECORD_FILE\n", argv[0]);
+        return 1;
+    }
+    int n;
+    PositionRecord *records = read_position_records(argv[2], &n);
+    if (records == NULL) {
+        return 1;
+    }
+    char fen[FEN_MAX_LEN];
+    for (int i = 0; i < n; i++) {
+        reset_buffers();
+        Pos pos;
+        unpack_position(&records[i].pos, &pos);
+        encode_fen(&pos, fen);
+        char val_str[16];
+        val_to_str(records[i].val, val_str);
+        printf("%s; val %s; depth %d; best ", fen, val_str, records[i].ply);
+        if (pack_move(records[i].best_move) != 0) {
+            print_move(records[i].best_move, &pos);
+        } else {
+            printf("-");
+        }
+        printf("\n");
+    }
+    free(records);
+    return 0;
+}
+
+/* The engine state and the library interface of cwig.h. */
+
+int init_engine(Engine *engine) {
+    /* 0, or -1 with nothing left allocated if memory runs out. */
+    memset(engine, 0, sizeof(Engine));
+    engine->move_buffer_start = malloc(MOVE_BUFFER_N_MOVES * sizeof(Move));
+    engine->eval_result_array_buffer_start =
+                    malloc(EVAL_RESULT_ARRAY_BUFFER_N * sizeof(EvalResult));
+    engine->pawn_hash = calloc(PAWN_HASH_N_ENTRIES, sizeof(PawnHashEntry));
+    engine->nnue_stack = calloc(MAX_SEARCH_PLY + 2, sizeof(NnueAccumulator));
+    if (
+        engine->move_buffer_start == NULL
+        || engine->eval_result_array_buffer_start == NULL
+        || engine->pawn_hash == NULL
+        || engine->nnue_stack == NULL
+    ) {
+        free(engine->move_buffer_start);
+        free(engine->eval_result_array_buffer_start);
+        free(engine->pawn_hash);
+        free(engine->nnue_stack);
+        return -1;
+    }
+    engine->move_buffer_end = engine->move_buffer_start + MOVE_BUFFER_N_MOVES;
+    engine->move_buffer_current = engine->move_buffer_start;
+    engine->eval_result_array_buffer_end =
+        engine->eval_result_array_buffer_start + EVAL_RESULT_ARRAY_BUFFER_N;
+    engine->eval_result_array_buffer_current =
+                                    engine->eval_result_array_buffer_start;
+    engine->book_rng_state = ZOBRIST_SEED;
+    return 0;
+}
+
+pthread_once_t engine_process_init_once = PTHREAD_ONCE_INIT;
+
+void engine_process_init(void) {
+    init_zobrist_keys();
+    init_simd_kernels(NULL);
+}
+
+Engine *engine_create(void) {
+    pthread_once(&engine_process_init_once, engine_process_init);
+    Engine *engine = malloc(sizeof(Engine));
+    if (engine == NULL) {
+        return NULL;
+    }
+    if (init_engine(engine) != 0) {
+        free(engine);
+        return NULL;
+    }
+    return engine;
+}
+
+void engine_destroy(Engine *engine) {
+    if (engine == NULL) {
+        return;
+    }
+    if (engine->is_searching) {
+        engine_stop(engine);
+        engine_wait(engine);
+    }
+    free(engine->move_buffer_start);
+    free(engine->eval_result_array_buffer_start);
+    free(engine->tt);
+    free(engine->pawn_hash);
+    free(engine->nnue_network);
+    free(engine->nnue_stack);
+    free(engine);
+}
+
+int engine_load_network(Engine *engine, const char *path) {
+    if (engine->is_searching) {
+        return -1;
+    }
+    Engine *prev = ctx;
+    ctx = engine;
+    int ret = read_nnue_network(path);
+    ctx = prev;
+    return ret;
+}
+
+int engine_set_position(Engine *engine, const char *fen) {
+    /* The results of the last search are dropped. */
+    if (engine->is_searching || strlen(fen) >= FEN_MAX_LEN) {
+        return -1;
+    }
+    /* Decoding the FEN to check it counts a position made. */
+    Engine *prev = ctx;
+    ctx = engine;
+    int is_valid = is_valid_fen(fen);
+    ctx = prev;
+    if (!is_valid) {
+        return -1;
+    }
+    strcpy(engine->fen, fen);
+    engine->n_results = 0;
+    return 0;
+}
+
+int engine_run_search(Engine *engine, const EngineLimits *limits) {
+    /* As solve without a cache or book. The stop flag is left as it is, so
+     * that a stop asked for before the search starts is not lost. */
+    if (engine->fen[0] == '\0' || limits->ply < 1 || limits->multi_pv < 1) {
+        return -1;
+    }
+    PruneStrategy prune_strat = prune_strat_no_pruning;
+    if (limits->selectivity != NULL) {
+        char selectivity[16];
+        if (strlen(limits->selectivity) >= sizeof(selectivity)) {
+            return -1;
+        }
+        strcpy(selectivity, limits->selectivity);
+        if ((prune_strat.selectivity = parse_selectivity(selectivity)) < 0) {
+            return -1;
+        }
+    }
+    Engine *prev = ctx;
+    ctx = engine;
+    engine->is_interrupted = 0;
+    engine->progress = limits->progress;
+    engine->progress_data = limits->progress_data;
+    engine->search_start_time = seconds_now();
+    engine->deadline = limits->max_seconds > 0 ?
+                    engine->search_start_time + limits->max_seconds : 0;
+    engine->nodes_until_time_check = TIME_CHECK_N_NODES;
+    engine->search_start_n_pos_explored = engine->n_pos_explored;
+    reset_buffers();
+    engine->root = decode_fen(engine->fen);
+    Ply ply = limits->ply < MAX_SEARCH_PLY ? limits->ply : MAX_SEARCH_PLY;
+    engine->results = limits->iterative_deepening ?
+        position_val_iter_deepening(
+                    &engine->root, ply, &prune_strat, 0, limits->multi_pv)
+        : position_val_at_ply(
+                    &engine->root, ply, &prune_strat, 0, limits->multi_pv);
+    if (engine->is_interrupted && !limits->iterative_deepening) {
+        /* Only an iterative deepening search has results to show when it is
+         * interrupted, those of the last depth completed. */
+        engine->results = NULL;
+    }
+    /* A position without moves still has one result, its static value. */
+    engine->n_results = engine->results == NULL ? 0
+        : engine->root.moves_len == 0 ? 1
+        : limits->multi_pv < engine->root.moves_len ? limits->multi_pv
+        : engine->root.moves_len;
+    engine->progress = NULL;
+    engine->deadline = 0;
+    ctx = prev;
+    return engine->n_results;
+}
+
+int engine_search(Engine *engine, const EngineLimits *limits) {
+    if (engine->is_searching) {
+        return -1;
+    }
+    engine->stop = 0;
+    return engine_run_search(engine, limits);
+}
+
+void *engine_search_thread(void *arg) {
+    Engine *engine = arg;
+    engine->thread_n_results =
+                        engine_run_search(engine, &engine->thread_limits);
+    return NULL;
+}
+
+int engine_start_search(Engine *engine, const EngineLimits *limits) {
+    if (engine->is_searching) {
+        return -1;
+    }
+    /* The limits have to outlive the caller's copy. */
+    engine->thread_limits = *limits;
+    if (limits->selectivity != NULL) {
+        if (strlen(limits->selectivity) >= sizeof(engine->thread_selectivity)) {
+            return -1;
+        }
+        strcpy(engine->thread_selectivity, limits->selectivity);
+        engine->thread_limits.selectivity = engine->thread_selectivity;
+    }
+    engine->stop = 0;
+    if (pthread_create(
+            &engine->search_thread, NULL, engine_search_thread, engine) != 0) {
+        return -1;
+    }
+    engine->is_searching = 1;
+    return 0;
+}
+
+void engine_stop(Engine *engine) {
+    engine->stop = 1;
+}
+
+int engine_wait(Engine *engine) {
+    if (!engine->is_searching) {
+        return -1;
+    }
+    pthread_join(engine->search_thread, NULL);
+    engine->is_searching = 0;
+    return engine->thread_n_results;
+}
+
+int engine_start_ponder(Engine *engine, const EngineLimits *limits) {
+    if (
+        engine->is_searching
+        || engine->n_results == 0
+        || engine->results[0].line.len < 2
+    ) {
+        return -1;
+    }
+    Engine *prev = ctx;
+    ctx = engine;
+    Pos after_move;
+    Pos after_reply;
+    position_after_move(&engine->root, &engine->results[0].line.moves[0],
+                                                                &after_move);
+    position_after_move(&after_move, &engine->results[0].line.moves[1],
+                                                                &after_reply);
+    encode_fen(&after_reply, engine->fen);
+    ctx = prev;
+    engine->n_results = 0;
+    return engine_start_search(engine, limits);
+}
+
+int engine_score(Engine *engine, int index) {
+    if (index < 0 || index >= engine->n_results) {
+        return 0;
+    }
+    return engine->results[index].val;
+}
+
+int engine_pv(Engine *engine, int index, char *buf, size_t size) {
+    if (index < 0 || index >= engine->n_results) {
+        return -1;
+    }
+    Engine *prev = ctx;
+    ctx = engine;
+    char text[MAX_SEARCH_PLY * MOVE_TEXT_MAX_LEN + 1];
+    format_move_line(&engine->results[index].line, &engine->root, text);
+    strip_line_end(text);
+    snprintf(buf, size, "%s", text);
+    ctx = prev;
+    return 0;
+}
+
+int engine_best_move(Engine *engine, char *buf, size_t size) {
+    if (engine->n_results == 0 || engine->results[0].line.len == 0) {
+        return -1;
+    }
+    Engine *prev = ctx;
+    ctx = engine;
+    char text[MOVE_TEXT_MAX_LEN + 1];
+    move_to_alg(engine->results[0].line.moves[0], &engine->root, text);
+    snprintf(buf, size, "%s", text);
+    ctx = prev;
+    return 0;
+}
+
+void engine_stats(Engine *engine, EngineStats *stats) {
+    stats->n_pos_explored = engine->n_pos_explored;
+    stats->n_pawn_hash_hits = engine->n_pawn_hash_hits;
+    stats->n_pawn_hash_misses = engine->n_pawn_hash_misses;
+    stats->n_tablebase_hits = engine->n_tablebase_hits;
+}
+
+#ifndef CWIG_LIBRARY
+
+/* Analysis server.
+ *
+ * serve reads requests, one JSON object per line, and answers each with one
+ * line of JSON. The engine stays the same between requests, so the
+ * transposition table and the pawn hash keep what earlier searches found;
+ * consecutive positions of a game share most of their subtrees. A request
+ * looks like
+ *
+ *   {"id": 7, "fen": "7k/6pp/8/8/8/8/8/K2R4 w - - 0 1", "ply": 4,
+ *    "multi_pv": 2, "iterative_deepening": true, "selectivity": "nl"}
+ *
+ * where only fen is required; ply defaults to 3 and multi_pv to 1 as for
+ * solve. "seconds": 0.5 stops the search after half a second, with the
+ * results of the last depth completed if it is an iterative deepening one;
+ * without a positive "seconds" the search stops after
+ * SERVE_DEFAULT_SECONDS, so that no request holds the server for good.
+ * "clear": true empties the transposition table first. Values other than
+ * strings have to be numbers, true, false or null. The answer is
+ *
+ *   {"id": 7, "move": "Rd8#", "lines": [{"value": 31999, "text": "+M1",
+ *    "pv": "1.Rd8#"}, ...], "stats": {"explored": 812,
+ *    "tablebase_hits": 0, "seconds": 0.004}}
+ *
+ * where move, the first move of the best line, is null if there is none.
+ *
+ * or {"id": 7, "error": "..."}. id is copied from the request, if any. */
+
+#define SERVE_LINE_MAX_LEN 4096
+#define SERVE_DEFAULT_SECONDS 60
+#define JSON_MAX_FIELDS 16
+#define JSON_MAX_KEY_LEN 32
+#define JSON_MAX_VALUE_LEN 128
+
+typedef struct JsonField {
+    char key[JSON_MAX_KEY_LEN];
+    /* Strings unescaped, anything else as written. */
+    char value[JSON_MAX_VALUE_LEN];
+    int is_string;
+} JsonField;
+
+char *parse_json_string(char *p, char *result, int size) {
+    /* p is at the opening quote. Return the end of the string, or NULL if
+     * it is malformed or does not fit. Escapes other than \uXXXX are
+     * understood. */
+    int len = 0;
+    for (p++; *p != '"'; p++) {
+        char c = *p;
+        if (c == '\0') {
+            return NULL;
+        }
+        if (c == '\\') {
+            c = *++p;
+            if (c == 'n') { c = '\n'; }
+            else if (c == 't') { c = '\t'; }
+            else if (c == 'r') { c = '\r'; }
+            else if (c == 'b') { c = '\b'; }
+            else if (c == 'f') { c = '\f'; }
+            else if (c != '"' && c != '\\' && c != '/') { return NULL; }
+        }
+        if (len == size - 1) {
+            return NULL;
+        }
+        result[len++] = c;
+    }
+    result[len] = '\0';
+    return p + 1;
+}
+
+int is_json_bare_value(const char *value) {
+    /* Whether value is a JSON number, true, false or null. */
+    if (
+        strcmp(value, "true") == 0 || strcmp(value, "false") == 0
+        || strcmp(value, "null") == 0
+    ) {
+        return 1;
+    }
+    const char *p = value;
+    if (*p == '-') {
+        p++;
+    }
+    if (*p == '0') {
+        p++;
+    } else if (*p >= '1' && *p <= '9') {
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+    } else {
+        return 0;
+    }
+    if (*p == '.') {
+        p++;
+        if (!(*p >= '0' && *p <= '9')) {
+            return 0;
+        }
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+    if (*p == 'e' || *p == 'E') {
+        p++;
+        if (*p == '+' || *p == '-') {
+            p++;
+        }
+        if (!(*p >= '0' && *p <= '9')) {
+            return 0;
+        }
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+    return *p == '\0';
+}
+
+char *skip_json_space(char *p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+        p++;
+    }
+    return p;
+}
+
+int parse_json_object(char *text, JsonField *fields, int max_fields) {
+    /* Parse an object whose values are strings, numbers, true, false or
+     * null into fields. Return the number of fields, or -1 if text is not
+     * such an object. */
+    int n_fields = 0;
+    char *p = skip_json_space(text);
+    if (*p++ != '{') {
+        return -1;
+    }
+    p = skip_json_space(p);
+    if (*p == '}') {
+        return *skip_json_space(p + 1) == '\0' ? 0 : -1;
+    }
+    while (1) {
+        if (n_fields == max_fields || *p != '"') {
+            return -1;
+        }
+        JsonField *field = &fields[n_fields++];
+        if ((p = parse_json_string(p, field->key, JSON_MAX_KEY_LEN)) == NULL) {
+            return -1;
+        }
+        p = skip_json_space(p);
+        if (*p++ != ':') {
+            return -1;
+        }
+        p = skip_json_space(p);
+        field->is_string = *p == '"';
+        if (field->is_string) {
+            p = parse_json_string(p, field->value, JSON_MAX_VALUE_LEN);
+            if (p == NULL) {
+                return -1;
+            }
+        } else {
+            int len = 0;
+            while (
+                *p != '\0' && *p != ',' && *p != '}' && *p != ' '
+                && *p != '\t' && *p != '\r' && *p != '\n'
+            ) {
+                if (*p == '{' || *p == '[' || len == JSON_MAX_VALUE_LEN - 1) {
+                    return -1;
+                }
+                field->value[len++] = *p++;
+            }
+            field->value[len] = '\0';
+            if (!is_json_bare_value(field->value)) {
+                return -1;
+            }
+        }
+        p = skip_json_space(p);
+        if (*p == '}') {
+            return *skip_json_space(p + 1) == '\0' ? n_fields : -1;
+        }
+        if (*p++ != ',') {
+            return -1;
+        }
+        p = skip_json_space(p);
+    }
 }
 
-void explore_position(Pos *pos) {
-    if (!pos->is_explored) {
-        pos->is_king_in_check = is_king_in_check(pos);
-        set_legal_moves_for_position(pos);
-        set_is_king_in_checkmate(pos);
-        set_is_king_in_stalemate(pos);
-        pos->is_explored = 1;
-        n_pos_explored += 1;
+JsonField *json_field(JsonField *fields, int n_fields, char *key) {
+    for (int i = 0; i < n_fields; i++) {
+        if (strcmp(fields[i].key, key) == 0) {
+            return &fields[i];
+        }
     }
+    return NULL;
 }
 
-EvalResult position_static_val(Pos *pos) {
-    EvalResult out;
-    out.val = 0;
-    explore_position(pos);
-    if (pos->is_king_in_checkmate == 1) {
-        if (pos->active_color == COLOR_WHITE) {
-            out.val = -INFINITY;
-        } else if (pos->active_color == COLOR_BLACK) {
-            out.val = INFINITY;
-        }
-    } else if (pos->is_king_in_stalemate == 1) {
-        out.val = 0;
-    } else {
-        for (int f = 0; f < N_FILES; f++) {
-            for (int r = 0; r < N_RANKS; r++) {
-                Sq sq = make_sq(f, r);
-                Piece found = get_piece_at_sq(pos, sq);
-                if (found != PIECE_EMPTY) {
-                    out.val += piece_val(found);
-                }
-            }
+void write_json_string(FILE *f, const char *str) {
+    fputc('"', f);
+    for (int i = 0; str[i] != '\0'; i++) {
+        unsigned char c = str[i];
+        if (c == '"' || c == '\\') {
+            fprintf(f, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(f, "\\u%04x", c);
+        } else {
+            fputc(c, f);
         }
     }
-    return out;
+    fputc('"', f);
 }
 
-void print_eval_result(EvalResult *er) {
-    printf("EvalResult: val: %+.1f\n", er->val);
+void write_json_id(FILE *f, JsonField *id) {
+    if (id == NULL) {
+        return;
+    }
+    fprintf(f, "\"id\": ");
+    if (id->is_string) {
+        write_json_string(f, id->value);
+    } else {
+        fprintf(f, "%s", id->value);
+    }
+    fprintf(f, ", ");
 }
 
-int cmp_eval_results(const void *aa, const void *bb) {
-    /* Return less than 0 if a is better, more than 0 if b is better, 0 if
-     * neither is better.  Better is the one where white is better. */
-    const EvalResult *a = aa;
-    const EvalResult *b = bb;
-    int r;
-    if (a->val == INFINITY && b->val == INFINITY) { r = 0; }
-    else if (a->val == -INFINITY && b->val == -INFINITY) { r = 0; }
-    else {
-        Val diff = b->val - a->val;
-        if (diff > 0) { r = 1; }
-        else if (diff < 0) { r = -1; }
-        else { r = 0; }
+char *serve_request(char *line, FILE *out) {
+    /* Answer one request. Return an error message if there is no answer to
+     * write, otherwise NULL. */
+    JsonField fields[JSON_MAX_FIELDS];
+    int n_fields = parse_json_object(line, fields, JSON_MAX_FIELDS);
+    if (n_fields < 0) {
+        return "request is not a flat JSON object";
+    }
+    JsonField *fen = json_field(fields, n_fields, "fen");
+    JsonField *ply = json_field(fields, n_fields, "ply");
+    JsonField *multi_pv = json_field(fields, n_fields, "multi_pv");
+    JsonField *iter = json_field(fields, n_fields, "iterative_deepening");
+    JsonField *selectivity = json_field(fields, n_fields, "selectivity");
+    JsonField *clear = json_field(fields, n_fields, "clear");
+    JsonField *max_seconds = json_field(fields, n_fields, "seconds");
+    EngineLimits limits = {
+        .ply = ply == NULL ? 3 : atoi(ply->value),
+        .multi_pv = multi_pv == NULL ? 1 : atoi(multi_pv->value),
+        .iterative_deepening = iter != NULL && strcmp(iter->value, "true") == 0,
+        .selectivity = selectivity == NULL ? NULL : selectivity->value,
+        .max_seconds = max_seconds == NULL ? 0 : atof(max_seconds->value),
+    };
+    if (limits.max_seconds <= 0) {
+        limits.max_seconds = SERVE_DEFAULT_SECONDS;
     }
-    return r;
+    if (fen == NULL || !fen->is_string) {
+        return "request has no fen";
+    }
+    if (engine_set_position(ctx, fen->value) < 0) {
+        return "invalid fen";
+    }
+    if (clear != NULL && strcmp(clear->value, "true") == 0) {
+        tt_clear();
+    }
+    EngineStats before;
+    EngineStats after;
+    engine_stats(ctx, &before);
+    double start = seconds_now();
+    int n_lines = engine_search(ctx, &limits);
+    double seconds = seconds_now() - start;
+    engine_stats(ctx, &after);
+    if (n_lines < 0) {
+        return "limits are not valid";
+    }
+    fprintf(out, "{");
+    write_json_id(out, json_field(fields, n_fields, "id"));
+    char best_move[MOVE_TEXT_MAX_LEN + 1];
+    if (engine_best_move(ctx, best_move, sizeof(best_move)) == 0) {
+        fprintf(out, "\"move\": \"%s\", ", best_move);
+    } else {
+        fprintf(out, "\"move\": null, ");
+    }
+    fprintf(out, "\"lines\": [");
+    for (int i = 0; i < n_lines; i++) {
+        char val_str[16];
+        char pv[MAX_SEARCH_PLY * MOVE_TEXT_MAX_LEN + 1];
+        val_to_str(engine_score(ctx, i), val_str);
+        engine_pv(ctx, i, pv, sizeof(pv));
+        fprintf(out, "%s{\"value\": %d, \"text\": \"%s\", \"pv\": ",
+                i == 0 ? "" : ", ", engine_score(ctx, i), val_str);
+        write_json_string(out, pv);
+        fprintf(out, "}");
+    }
+    fprintf(out,
+        "], \"stats\": {\"explored\": %d, \"tablebase_hits\": %d, "
+        "\"seconds\": %.3f}}\n",
+        after.n_pos_explored - before.n_pos_explored,
+        after.n_tablebase_hits - before.n_tablebase_hits, seconds);
+    return NULL;
 }
 
-int cmp_eval_results_rev(const void *aa, const void *bb) {
-    return cmp_eval_results(bb, aa);
+void serve_stream(FILE *in, FILE *out) {
+    /* Answer requests from in until it ends. */
+    char line[SERVE_LINE_MAX_LEN];
+    while (fgets(line, sizeof(line), in) != NULL) {
+        int len = strlen(line);
+        if (len == sizeof(line) - 1 && line[len - 1] != '\n') {
+            /* Too long: skip the rest of it and say so. */
+            int c;
+            while ((c = fgetc(in)) != EOF && c != '\n') {}
+            fprintf(out, "{\"error\": \"request is too long\"}\n");
+            fflush(out);
+            continue;
+        }
+        strip_line_end(line);
+        if (*skip_json_space(line) == '\0') {
+            continue;
+        }
+        char *error = serve_request(line, out);
+        if (error != NULL) {
+            JsonField fields[JSON_MAX_FIELDS];
+            int n_fields = parse_json_object(line, fields, JSON_MAX_FIELDS);
+            fprintf(out, "{");
+            if (n_fields > 0) {
+                write_json_id(out, json_field(fields, n_fields, "id"));
+            }
+            fprintf(out, "\"error\": ");
+            write_json_string(out, error);
+            fprintf(out, "}\n");
+        }
+        fflush(out);
+    }
 }
 
-void reset_buffers() {
-    move_buffer_current = move_buffer_start;
-    move_list_node_buffer_current = move_list_node_buffer_start;
-    eval_result_array_buffer_current = eval_result_array_buffer_start;
+int serve_main(int argc, char **argv) {
+    /* Answer requests on stdin, or on connections to a Unix socket, one
+     * connection at a time. */
+    char *socket_path = NULL;
+    int is_usage_error = 0;
+    int opt;
+    while ((opt = getopt(argc - 1, argv + 1, "u:t:w:N:")) != -1) {
+        if (opt == 'u') {
+            socket_path = optarg;
+        } else if (opt == 't') {
+            if (open_tablebases(optarg) < 0) {
+                return 1;
+            }
+        } else if (opt == 'w') {
+            if (read_eval_weights(optarg) < 0) {
+                return 1;
+            }
+        } else if (opt == 'N') {
+            if (read_nnue_network(optarg) < 0) {
+                return 1;
+            }
+        } else {
+            is_usage_error = 1;
+            break;
+        }
+    }
+    if (is_usage_error || optind + 1 < argc) {
+        fprintf(stderr,
+            "Usage: %s serve [-u SOCKET_PATH] [-t TABLEBASE_DIR] "
+            "[-w WEIGHTS_FILE] [-N NETWORK_FILE]\n",
+            argv[0]);
+        return 1;
+    }
+    if (socket_path == NULL) {
+        serve_stream(stdin, stdout);
+        return 0;
+    }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long.\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    int server_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if (
+        server_fd < 0
+        || bind(server_fd, (struct sockaddr*) &addr, sizeof(addr)) < 0
+        || listen(server_fd, 8) < 0
+    ) {
+        fprintf(stderr, "Could not listen on %s.\n", socket_path);
+        return 1;
+    }
+    while (1) {
+        int fd = accept(server_fd, NULL, NULL);
+        if (fd < 0) {
+            continue;
+        }
+        int out_fd = dup(fd);
+        FILE *in = fdopen(fd, "r");
+        FILE *out = out_fd < 0 ? NULL : fdopen(out_fd, "w");
+        if (in != NULL && out != NULL) {
+            serve_stream(in, out);
+        }
+        if (in != NULL) {
+            fclose(in);
+        } else {
+            close(fd);
+        }
+        if (out != NULL) {
+            fclose(out);
+        } else if (out_fd >= 0) {
+            close(out_fd);
+        }
+    }
 }
 
-void join_move_lists(MoveListNode *a, MoveListNode *b) {
-    if (a == NULL) {
-        fprintf(stderr,
-            "NULL first move list passed to join_move_lists, aborting...");
+/* Self-play matches.
+ *
+ * match plays two engines against each other from a file of opening FENs,
+ * each opening twice with the colors swapped, to tell whether a change
+ * makes the engine stronger at a given time control; lines of the file
+ * that are not valid FENs are skipped. The engines are
+ * commands that answer serve requests, usually two builds of cwig, e.g.
+ * "old/cwig.out serve". Games are played by several threads at once, each
+ * with its own pair of engine processes.
+ *
+ * A game ends by the rules (mate, stalemate, the fifty-move rule,
+ * threefold repetition, or too little material to mate), by a flag fall or
+ * an illegal move, or by adjudication: a win once both engines have agreed
+ * for MATCH_ADJUDICATION_PLIES half-moves that one side is MATCH_WIN_VAL
+ * ahead, a draw once they have agreed as long that neither is more than
+ * MATCH_DRAW_VAL ahead after MATCH_DRAW_MIN_PLY, and a draw after
+ * MATCH_MAX_PLIES.
+ *
+ * The match stops early when the sequential probability ratio test decides
+ * between the hypotheses that engine A is ELO0 and ELO1 stronger than
+ * engine B, with error rates SPRT_ALPHA and SPRT_BETA. */
+
+#define MATCH_MAX_PLIES 400
+#define MATCH_MOVES_TO_GO 30
+#define MATCH_ADJUDICATION_PLIES 8
+#define MATCH_WIN_VAL 1000
+#define MATCH_DRAW_VAL 10
+#define MATCH_DRAW_MIN_PLY 80
+#define MATCH_ANSWER_MAX_LEN 8192
+#define SPRT_ALPHA 0.05
+#define SPRT_BETA 0.05
+
+typedef struct MatchEngine {
+    char *command;
+    pid_t pid;
+    FILE *requests;
+    FILE *answers;
+} MatchEngine;
+
+typedef struct Match {
+    char *commands[2];
+    char **openings;
+    int n_openings;
+    int n_games;
+    double base_seconds;
+    double increment_seconds;
+    Ply max_ply;
+    char *selectivity;
+    double elo0;
+    double elo1;
+    pthread_mutex_t mutex;
+    int next_game;
+    /* From the point of view of engine A. */
+    int n_wins;
+    int n_draws;
+    int n_losses;
+    /* 1 if H1 (ELO1) was accepted, -1 if H0 (ELO0) was, else 0. */
+    int decision;
+} Match;
+
+typedef struct MatchWorker {
+    Match *match;
+    /* Engine A first. */
+    MatchEngine engines[2];
+    pthread_t thread;
+} MatchWorker;
+
+int start_match_engine(MatchEngine *engine, char *command) {
+    /* Run command with pipes to and from it. Return 0 on success and -1 on
+     * failure. */
+    int to_engine[2];
+    int from_engine[2];
+    if (pipe(to_engine) < 0) {
+        return -1;
+    }
+    if (pipe(from_engine) < 0) {
+        close(to_engine[0]);
+        close(to_engine[1]);
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(to_engine[0], STDIN_FILENO);
+        dup2(from_engine[1], STDOUT_FILENO);
+        close(to_engine[0]);
+        close(to_engine[1]);
+        close(from_engine[0]);
+        close(from_engine[1]);
+        execl("/bin/sh", "sh", "-c", command, (char*) NULL);
+        _exit(127);
+    }
+    close(to_engine[0]);
+    close(from_engine[1]);
+    if (pid < 0) {
+        close(to_engine[1]);
+        close(from_engine[0]);
+        return -1;
+    }
+    /* Engines started later must not hold this one's pipes open. */
+    fcntl(to_engine[1], F_SETFD, FD_CLOEXEC);
+    fcntl(from_engine[0], F_SETFD, FD_CLOEXEC);
+    engine->command = command;
+    engine->pid = pid;
+    engine->requests = fdopen(to_engine[1], "w");
+    engine->answers = fdopen(from_engine[0], "r");
+    if (engine->requests == NULL || engine->answers == NULL) {
+        fprintf(stderr, "Could not allocate memory. Aborting...\n");
         abort();
     }
-    while (a->rest != NULL) {
-        a = a->rest;
+    return 0;
+}
+
+void stop_match_engine(MatchEngine *engine) {
+    /* serve stops at the end of its input. */
+    fclose(engine->requests);
+    fclose(engine->answers);
+    waitpid(engine->pid, NULL, 0);
+}
+
+int scan_json_value(char *json, char *key, char *result, int size) {
+    /* Find the first value named key anywhere in json, which need not be
+     * flat, and write it to result as parse_json_object would. Return 0 if
+     * it is found and fits, else -1. */
+    char pattern[JSON_MAX_KEY_LEN + 3];
+    snprintf(pattern, sizeof(pattern), "\"%s\"", key);
+    char *p = strstr(json, pattern);
+    if (p == NULL) {
+        return -1;
+    }
+    p = skip_json_space(p + strlen(pattern));
+    if (*p++ != ':') {
+        return -1;
     }
-    a->rest = b;
+    p = skip_json_space(p);
+    if (*p == '"') {
+        return parse_json_string(p, result, size) == NULL ? -1 : 0;
+    }
+    int len = 0;
+    while (*p != '\0' && strchr(",}] \t\r\n", *p) == NULL) {
+        if (len == size - 1) {
+            return -1;
+        }
+        result[len++] = *p++;
+    }
+    result[len] = '\0';
+    return len > 0 ? 0 : -1;
 }
 
-EvalResult *position_val_at_ply(
-    Pos *pos,
-    Ply ply,
-    PruneStrategy *prune_strat,
-    int do_quiescence_search
+int has_mating_material(Pos *pos) {
+    /* Whether there is more than a king and at most one minor piece left,
+     * the least that can still be mated with. */
+    int n_minors = 0;
+    for (File f = 0; f < N_FILES; f++) {
+        for (Rank r = 0; r < N_RANKS; r++) {
+            Piece wp = piece_as_white(pos->placement[f][r]);
+            if (wp == B_WHITE || wp == N_WHITE) {
+                n_minors++;
+            } else if (wp == P_WHITE || wp == R_WHITE || wp == Q_WHITE) {
+                return 1;
+            }
+        }
+    }
+    return n_minors > 1;
+}
+
+int play_match_game(
+    Match *match,
+    MatchEngine *engines[2],
+    char *opening,
+    char *reason
 ) {
-    EvalResult *ret_val;
-    explore_position(pos);
-    if (
-        ply == 0
-        || (pos->is_king_in_checkmate == 1)
-        || (pos->is_king_in_stalemate == 1)
-       )
-    {
-        if (eval_result_array_buffer_current >= eval_result_array_buffer_end) {
-            fprintf(stderr,
-                "eval_result_array_buffer exhausted. Aborting...\n");
+    /* Play a game from opening with engines[0] as white. Return 1 if white
+     * wins, -1 if black wins and 0 for a draw, and write why to reason. */
+    uint64_t keys[MATCH_MAX_PLIES + 1];
+    Val vals[MATCH_MAX_PLIES];
+    double clocks[2] = { match->base_seconds, match->base_seconds };
+    char fen[FEN_MAX_LEN];
+    char answer[MATCH_ANSWER_MAX_LEN];
+    reset_buffers();
+    Pos pos = decode_fen(opening);
+    for (int n_plies = 0; ; n_plies++) {
+        /* Only the current position is needed, so its moves can go at the
+         * start of the buffer. */
+        reset_buffers();
+        pos.is_explored = 0;
+        explore_position(&pos);
+        keys[n_plies] = position_key(&pos);
+        int side = pos.active_color == COLOR_WHITE ? 0 : 1;
+        int sign = side == 0 ? 1 : -1;
+        if (pos.is_king_in_checkmate) {
+            strcpy(reason, "mate");
+            return -sign;
+        }
+        if (pos.is_king_in_stalemate) {
+            strcpy(reason, "stalemate");
+            return 0;
+        }
+        if (pos.halfmoves >= 100) {
+            strcpy(reason, "fifty moves");
+            return 0;
+        }
+        int n_repetitions = 0;
+        for (int i = n_plies - 2; i >= 0 && i >= n_plies - pos.halfmoves;
+                                                                    i -= 2) {
+            n_repetitions += keys[i] == keys[n_plies];
+        }
+        if (n_repetitions >= 2) {
+            strcpy(reason, "repetition");
+            return 0;
+        }
+        if (!has_mating_material(&pos)) {
+            strcpy(reason, "insufficient material");
+            return 0;
+        }
+        if (n_plies == MATCH_MAX_PLIES) {
+            strcpy(reason, "adjudication, length");
+            return 0;
+        }
+        if (n_plies >= MATCH_ADJUDICATION_PLIES) {
+            int n_white_wins = 0;
+            int n_black_wins = 0;
+            int n_draws = 0;
+            for (int i = n_plies - MATCH_ADJUDICATION_PLIES; i < n_plies; i++) {
+                n_white_wins += vals[i] >= MATCH_WIN_VAL;
+                n_black_wins += vals[i] <= -MATCH_WIN_VAL;
+                n_draws += abs(vals[i]) <= MATCH_DRAW_VAL;
+            }
+            if (
+                n_white_wins == MATCH_ADJUDICATION_PLIES
+                || n_black_wins == MATCH_ADJUDICATION_PLIES
+            ) {
+                strcpy(reason, "adjudication, win");
+                return n_white_wins > 0 ? 1 : -1;
+            }
+            if (
+                n_plies >= MATCH_DRAW_MIN_PLY
+                && n_draws == MATCH_ADJUDICATION_PLIES
+            ) {
+                strcpy(reason, "adjudication, draw");
+                return 0;
+            }
+        }
+        MatchEngine *engine = engines[side];
+        double budget = clocks[side] / MATCH_MOVES_TO_GO
+                                                + match->increment_seconds;
+        if (budget > clocks[side] / 2) {
+            budget = clocks[side] / 2;
+        }
+        /* As sent, with three decimals; 0 would get the server's default
+         * limit. */
+        if (budget < 0.001) {
+            budget = 0.001;
+        }
+        encode_fen(&pos, fen);
+        fprintf(engine->requests,
+            "{\"fen\": \"%s\", \"ply\": %d, \"iterative_deepening\": true, "
+            "\"seconds\": %.3f, \"clear\": %s, \"selectivity\": \"%s\"}\n",
+            fen, match->max_ply, budget, n_plies < 2 ? "true" : "false",
+            match->selectivity);
+        fflush(engine->requests);
+        double start = seconds_now();
+        if (fgets(answer, sizeof(answer), engine->answers) == NULL) {
+            fprintf(stderr, "%s stopped answering. Aborting...\n",
+                                                            engine->command);
             abort();
         }
-        if (ply == 0 && do_quiescence_search) {
-            EvalResult *eval_results =
-                position_val_at_ply(
-                    pos, 10,
-                    &prune_strat_prune_low_val_changes, do_quiescence_search);
-            ret_val = eval_results;
-        } else {
-            ret_val[0] = position_static_val(pos);
+        clocks[side] -= seconds_now() - start;
+        if (clocks[side] < 0) {
+            strcpy(reason, "time");
+            return -sign;
         }
-        eval_result_array_buffer_current++;
-    } else {
+        clocks[side] += match->increment_seconds;
+        char san[MOVE_TEXT_MAX_LEN + 1];
+        char val_str[16];
+        Move move;
+        if (
+            scan_json_value(answer, "move", san, sizeof(san)) < 0
+            || scan_json_value(answer, "value", val_str, sizeof(val_str)) < 0
+            || !parse_san(&pos, san, &move)
+        ) {
+            strcpy(reason, "illegal move");
+            return -sign;
+        }
+        vals[n_plies] = atoi(val_str);
+        int is_irreversible =
+            piece_as_white(get_piece_at_sq(&pos, move.from)) == P_WHITE
+            || get_piece_at_sq(&pos, move.to) != PIECE_EMPTY;
         Pos next_pos;
-        if (eval_result_array_buffer_current + pos->moves_len
-                                    > eval_result_array_buffer_end) {
-            fprintf(stderr,
-                "eval_result_array_buffer exhausted. Aborting...\n");
+        position_after_move(&pos, &move, &next_pos);
+        next_pos.halfmoves = is_irreversible ? 0 : pos.halfmoves + 1;
+        next_pos.fullmoves = pos.fullmoves + side;
+        pos = next_pos;
+    }
+}
+
+double elo_to_score(double elo) {
+    return 1 / (1 + pow(10, -elo / 400));
+}
+
+double sprt_llr(
+    int n_wins, int n_draws, int n_losses, double elo0, double elo1
+) {
+    /* The log-likelihood ratio of elo1 against elo0, by the normal
+     * approximation of the generalized SPRT on game scores. */
+    double n = n_wins + n_draws + n_losses;
+    if (n == 0) {
+        return 0;
+    }
+    double score = (n_wins + n_draws / 2.0) / n;
+    double variance = (n_wins * (1 - score) * (1 - score)
+                        + n_draws * (0.5 - score) * (0.5 - score)
+                        + n_losses * score * score) / n;
+    if (variance <= 0) {
+        return 0;
+    }
+    double s0 = elo_to_score(elo0);
+    double s1 = elo_to_score(elo1);
+    return (s1 - s0) * (2 * score - s0 - s1) / (2 * variance / n);
+}
+
+void *match_worker(void *arg) {
+    MatchWorker *worker = arg;
+    Match *match = worker->match;
+    /* Positions are made and moves generated for the games of this
+     * thread only. */
+    ctx = engine_create();
+    if (ctx == NULL) {
+        fprintf(stderr, "Could not allocate memory. Aborting...\n");
+        abort();
+    }
+    double llr_lower = log(SPRT_BETA / (1 - SPRT_ALPHA));
+    double llr_upper = log((1 - SPRT_BETA) / SPRT_ALPHA);
+    while (1) {
+        pthread_mutex_lock(&match->mutex);
+        int game = match->next_game++;
+        int is_over = match->decision != 0 || game >= match->n_games;
+        pthread_mutex_unlock(&match->mutex);
+        if (is_over) {
+            break;
+        }
+        char *opening = match->openings[(game / 2) % match->n_openings];
+        int a_is_white = game % 2 == 0;
+        MatchEngine *engines[2] = {
+            &worker->engines[a_is_white ? 0 : 1],
+            &worker->engines[a_is_white ? 1 : 0],
+        };
+        char reason[32];
+        int result = play_match_game(match, engines, opening, reason);
+        int a_result = a_is_white ? result : -result;
+        pthread_mutex_lock(&match->mutex);
+        match->n_wins += a_result > 0;
+        match->n_draws += a_result == 0;
+        match->n_losses += a_result < 0;
+        int n_games = match->n_wins + match->n_draws + match->n_losses;
+        double score = (match->n_wins + match->n_draws / 2.0) / n_games;
+        double llr = sprt_llr(match->n_wins, match->n_draws, match->n_losses,
+                                                    match->elo0, match->elo1);
+        if (match->decision == 0 && llr >= llr_upper) {
+            match->decision = 1;
+        } else if (match->decision == 0 && llr <= llr_lower) {
+            match->decision = -1;
+        }
+        printf("Game %d: %s %s (%s). A: +%d =%d -%d, ", game + 1,
+            a_is_white ? "A-B" : "B-A",
+            result > 0 ? "1-0" : result < 0 ? "0-1" : "1/2-1/2", reason,
+            match->n_wins, match->n_draws, match->n_losses);
+        if (score > 0 && score < 1) {
+            printf("Elo %+.1f, ", -400 * log10(1 / score - 1));
+        }
+        printf("LLR %.2f (%.2f, %.2f)\n", llr, llr_lower, llr_upper);
+        fflush(stdout);
+        pthread_mutex_unlock(&match->mutex);
+    }
+    engine_destroy(ctx);
+    ctx = &default_engine;
+    return NULL;
+}
+
+int match_main(int argc, char **argv) {
+    /* Play engine A against engine B; see the comment on Match. */
+    Match match = {
+        .n_games = 100,
+        .base_seconds = 10,
+        .increment_seconds = 0.1,
+        .max_ply = 32,
+        .selectivity = "",
+        .elo0 = 0,
+        .elo1 = 5,
+    };
+    int n_threads = 1;
+    int is_usage_error = 0;
+    int opt;
+    while ((opt = getopt(argc - 1, argv + 1, "j:g:t:p:s:e:")) != -1) {
+        if (opt == 'j') {
+            n_threads = atoi(optarg);
+        } else if (opt == 'g') {
+            match.n_games = atoi(optarg);
+        } else if (opt == 't') {
+            match.increment_seconds = 0;
+            if (sscanf(optarg, "%lf+%lf", &match.base_seconds,
+                                        &match.increment_seconds) < 1) {
+                is_usage_error = 1;
+            }
+        } else if (opt == 'p') {
+            match.max_ply = atoi(optarg);
+        } else if (opt == 's') {
+            match.selectivity = optarg;
+        } else if (opt == 'e') {
+            if (sscanf(optarg, "%lf,%lf", &match.elo0, &match.elo1) != 2) {
+                is_usage_error = 1;
+            }
+        } else {
+            is_usage_error = 1;
+            break;
+        }
+    }
+    if (
+        is_usage_error
+        || optind + 3 >= argc
+        || n_threads < 1
+        || match.n_games < 1
+        || match.base_seconds <= 0
+        || match.max_ply < 1
+        || match.elo0 >= match.elo1
+        || parse_selectivity(match.selectivity) < 0
+    ) {
+        fprintf(stderr,
+            "Usage: %s match [-j THREADS] [-g GAMES] "
+            "[-t SECONDS[+INCREMENT]] [-p MAX_PLY] [-s nlfrcos] "
+            "[-e ELO0,ELO1] ENGINE_A ENGINE_B OPENING_FILE\n",
+            argv[0]);
+        return 1;
+    }
+    match.commands[0] = argv[optind + 1];
+    match.commands[1] = argv[optind + 2];
+    char *openings_path = argv[optind + 3];
+    FILE *f = fopen(openings_path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s for reading.\n", openings_path);
+        return 1;
+    }
+    int openings_cap = 64;
+    match.openings = malloc(openings_cap * sizeof(char*));
+    char line[500];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        strip_line_end(line);
+        if (!is_valid_fen(line)) {
+            continue;
+        }
+        if (match.n_openings == openings_cap) {
+            openings_cap *= 2;
+            match.openings =
+                realloc(match.openings, openings_cap * sizeof(char*));
+        }
+        if (match.openings == NULL) {
+            fprintf(stderr, "Could not allocate memory. Aborting...\n");
             abort();
         }
-        ret_val = eval_result_array_buffer_current;
-        eval_result_array_buffer_current += pos->moves_len;
-        EvalResult pos_static_eval_result;
-        int was_pos_static_eval_result_set = 0;
-        for (int i = 0; i < pos->moves_len; i++) {
-            Move move = pos->p_moves[i];
-            position_after_move(pos, &move, &next_pos);
-            if (prune_strat->type == PruneStrategyTypeNoPruning) {
-                goto recurse;
-            } else if (prune_strat->type == PruneStrategyTypePruneLowValChanges) {
-                if (!was_pos_static_eval_result_set) {
-                    pos_static_eval_result = position_static_val(pos);
-                    was_pos_static_eval_result_set = 1;
-                }
-                EvalResult next_pos_eval_result = position_static_val(&next_pos);
-                Val next_pos_static_val = next_pos_eval_result.val;
-                Val diff = next_pos_static_val - pos_static_eval_result.val;
-                if (diff >= prune_strat->cutoff
-                    || diff <= -prune_strat->cutoff) {
-                    /* Don't prune; keep evaluating. */
-                    goto recurse;
-                } else {
-                    /* Prune. Stop evaluating. */
-                    ret_val[i] = pos_static_eval_result;
-                }
+        match.openings[match.n_openings++] = strdup(line);
+    }
+    fclose(f);
+    if (match.n_openings == 0) {
+        fprintf(stderr, "There are no valid FENs in %s.\n", openings_path);
+        return 1;
+    }
+    /* A dead engine is noticed when its answer does not come. */
+    signal(SIGPIPE, SIG_IGN);
+    pthread_mutex_init(&match.mutex, NULL);
+    MatchWorker *workers = calloc(n_threads, sizeof(MatchWorker));
+    if (workers == NULL) {
+        fprintf(stderr, "Could not allocate memory. Aborting...\n");
+        abort();
+    }
+    /* All engines are started before any thread, so that none of them
+     * inherits pipes it should not. */
+    for (int i = 0; i < n_threads; i++) {
+        workers[i].match = &match;
+        for (int j = 0; j < 2; j++) {
+            if (start_match_engine(
+                        &workers[i].engines[j], match.commands[j]) < 0) {
+                fprintf(stderr, "Could not start %s.\n", match.commands[j]);
+                return 1;
             }
-            if (0) {
-                recurse:
-                    EvalResult *eval_results = position_val_at_ply(
-                            &next_pos, ply-0.5,
-                            prune_strat, do_quiescence_search);
-                    EvalResult *eval_result = &eval_results[0];
-                    MoveListNode *new_move_list_node =
-                                            move_list_node_buffer_current++;
-                    new_move_list_node->rest =
-                                    (ply == 0.5 ? NULL : eval_result->moves);
-                    new_move_list_node->move = move;
-                    eval_result->moves = new_move_list_node;
-                    ret_val[i] = *eval_result;
-            }
-        }
-        int (*cmp_fn)(const void *, const void *);
-        if (pos->active_color == COLOR_WHITE) {
-            cmp_fn = cmp_eval_results;
-        } else if (pos->active_color == COLOR_BLACK) {
-            cmp_fn = cmp_eval_results_rev;
-        }
-        qsort(ret_val, pos->moves_len, sizeof(EvalResult), cmp_fn);
+        }
     }
-    return ret_val;
+    for (int i = 0; i < n_threads; i++) {
+        if (pthread_create(
+                &workers[i].thread, NULL, match_worker, &workers[i]) != 0) {
+            fprintf(stderr, "Could not create thread. Aborting...\n");
+            abort();
+        }
+    }
+    for (int i = 0; i < n_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        stop_match_engine(&workers[i].engines[0]);
+        stop_match_engine(&workers[i].engines[1]);
+    }
+    pthread_mutex_destroy(&match.mutex);
+    printf("A: +%d =%d -%d. %s\n", match.n_wins, match.n_draws,
+        match.n_losses,
+        match.decision > 0 ? "H1 accepted: A is stronger."
+        : match.decision < 0 ? "H0 accepted: A is not stronger."
+        : "No decision.");
+    for (int i = 0; i < match.n_openings; i++) {
+        free(match.openings[i]);
+    }
+    free(match.openings);
+    free(workers);
+    return 0;
 }
 
-void position_val_iter_deep(
-    Pos *pos,
-    EvalResult *buffer,
-    Ply *plies,
-    int plies_n,
-    Val cutoff_val_diff
-) {
-    if (plies_n > 0) {
-        Ply ply = plies[0];
-        EvalResult *ers = position_val_at_ply(
-            pos, ply, &prune_strat_no_pruning, 0);
-        int n_moves_to_keep = 0;
-        for (int j = 0; j < pos->moves_len; j++) {
-            if (
-                pos->active_color == COLOR_WHITE
-                    &&
-                ers[j].val < ers[0].val - cutoff_val_diff 
-                    ||
-                pos->active_color == COLOR_BLACK
-                    &&
-                ers[j].val > ers[0].val + cutoff_val_diff 
-            ) {
-                /* Further explore the moves that are within the cutoff. */
+/* Mate puzzle mining.
+ *
+ * mine looks through a file of positions, one FEN or EPD per line, for
+ * positions where the side to move mates in exactly n moves with a single
+ * key move, and prints them as in mates_in_2.txt: a line saying where the
+ * position came from, its FEN and the solution, e.g.
+ *
+ *   Mined from games.epd, line 1234
+ *   r2qkb1r/pp2nppp/3p4/2pNN1B1/2BnP3/3P4/PPP2PPP/R2bK2R w KQkq - 0 1
+ *   1. Nf6+ gxf6 2. Bxf7#
+ *
+ * so that verify can check them. Most positions are ruled out by a cheap
+ * test before any search: the defending king has to be short of flight
+ * squares, and the attacker has to have a check unless the king has none
+ * at all. The rest, the candidates, are searched to 2n - 1 half-moves for
+ * the mate, and then with two lines to see that no other move mates as
+ * fast. The lines are split among threads, each with its own engine.
+ * Lines that look like positions but do not pass is_valid_fen are skipped
+ * and counted as invalid in the progress reports. */
 
-                /* Find the resulting position. */
-                MoveListNode *move_list_node = ers[j].moves;
-                Pos current_pos = *pos;
-                Pos next_pos;
-                while (move_list_node != NULL) {
-                    position_after_move(
-                        &current_pos, &move_list_node->move, &next_pos);
-                    move_list_node = move_list_node->rest;
-                    current_pos = next_pos;
-                }
-                /* At this point next_pos (and current_pos) is the resulting
-                 * position. */
-                EvalResult *ers_next_ply = calloc(
-                    next_pos.moves_len, sizeof(EvalResult));
-                position_val_iter_deep(
-                    &next_pos,
-                    ers_next_ply,
-                    plies+1,
-                    plies_n-1,
-                    cutoff_val_diff
-                );
-                /* Use the best continuation from ers_next_ply but set the
-                 * current move list as the leading move list. */
-                buffer[j] = ers_next_ply[0];
-                buffer[j].moves = ers[j].moves;
-                join_move_lists(buffer[j].moves, ers_next_ply[0].moves);
-            } else {
-                /* Store the current evaluation i.e. no further exploration
-                 * will be conducted. Corollary: Those moves do not need
-                 * reordering. */
-                buffer[j] = ers[j];
+#define MINE_MAX_MATE_MOVES 4
+#define MINE_MAX_FLIGHT_SQUARES 2
+#define MINE_PROGRESS_N_POSITIONS 100000
+
+typedef struct Mine {
+    FILE *f;
+    char *path;
+    Ply ply;
+    int n_mate_moves;
+    pthread_mutex_t mutex;
+    int n_lines;
+    int n_positions;
+    int n_invalid;
+    int n_candidates;
+    int n_puzzles;
+    double start_time;
+} Mine;
+
+int n_king_flight_squares(Pos *pos, Color color) {
+    /* The squares next to the king of color that are neither taken by its
+     * own pieces nor attacked. Attacks along a line through the king's own
+     * square are missed, which is good enough for a prefilter. */
+    Sq king_sq = find_king(pos, color);
+    if (king_sq.f < 0) {
+        return 0;
+    }
+    int n_squares = 0;
+    for (int df = -1; df <= 1; df++) {
+        for (int dr = -1; dr <= 1; dr++) {
+            int f = king_sq.f + df;
+            int r = king_sq.r + dr;
+            if ((df == 0 && dr == 0) || !IS_ON_BOARD(f, r)) {
+                continue;
             }
+            Piece piece = pos->placement[f][r];
+            if (piece != PIECE_EMPTY && piece_color(piece) == color) {
+                continue;
+            }
+            n_squares += color == COLOR_WHITE ?
+                            !is_sq_attacked_against_white(pos, f, r) :
+                            !is_sq_attacked_against_black(pos, f, r);
         }
     }
+    return n_squares;
+}
+
+int is_mate_candidate(Pos *pos) {
+    explore_position(pos);
+    if (pos->moves_len == 0) {
+        return 0;
+    }
+    int n_flight_squares =
+                n_king_flight_squares(pos, toggled_color(pos->active_color));
+    return n_flight_squares <= MINE_MAX_FLIGHT_SQUARES
+                        && (n_flight_squares == 0 || has_checking_move(pos));
+}
+
+int is_mate_in(Val val, Color color, int n_mate_moves) {
+    /* Whether val is a mate by color in at most n_mate_moves. */
+    int n = mate_val_n_moves(val);
+    return is_mate_val(val)
+            && (color == COLOR_WHITE ? n > 0 : n < 0)
+            && abs(n) <= n_mate_moves;
 }
 
-void print_move_list(MoveListNode *move_list_node, Pos *pos_in) {
+void format_solution(MoveLine *line, Pos *pos_in, char *result) {
+    /* As format_move_line, but spaced as in mates_in_2.txt, e.g.
+     * "1. Nf6+ gxf6 2. Bxf7#". */
     Pos pos = *pos_in;
     Pos new_pos;
-    int printed_first_move_number = 0;
-    int move_number = 1;
-    while (move_list_node != NULL) {
+    int len = 0;
+    for (int i = 0; i < line->len; i++) {
         if (pos.active_color == COLOR_WHITE) {
-            printf("%d.", move_number);
-            printed_first_move_number = 1;
+            len += sprintf(result + len, "%d. ", i / 2 + 1);
+        } else if (i == 0) {
+            len += sprintf(result + len, "1... ");
         }
-        if (pos.active_color == COLOR_BLACK) {
-            if (move_number == 1 && !printed_first_move_number) {
-                printf("1... ");
+        move_to_alg(line->moves[i], &pos, result + len);
+        len += strlen(result + len);
+        result[len++] = ' ';
+        result[len] = '\0';
+        position_after_move(&pos, &line->moves[i], &new_pos);
+        pos = new_pos;
+    }
+    strip_line_end(result);
+}
+
+void print_mine_progress(Mine *mine) {
+    double seconds = seconds_now() - mine->start_time;
+    fprintf(stderr,
+        "Positions: %d, invalid: %d, candidates: %d, puzzles: %d in %.1f s "
+        "(%.0f positions/s, %.0f candidates/s, %.2f puzzles/s)\n",
+        mine->n_positions, mine->n_invalid, mine->n_candidates,
+        mine->n_puzzles, seconds,
+        seconds > 0 ? mine->n_positions / seconds : 0,
+        seconds > 0 ? mine->n_candidates / seconds : 0,
+        seconds > 0 ? mine->n_puzzles / seconds : 0);
+}
+
+void *mine_worker(void *arg) {
+    Mine *mine = arg;
+    ctx = engine_create();
+    if (ctx == NULL) {
+        fprintf(stderr, "Could not allocate memory. Aborting...\n");
+        abort();
+    }
+    char line[500];
+    char fen[FEN_MAX_LEN];
+    char solution[MAX_SEARCH_PLY * MOVE_TEXT_MAX_LEN + 1];
+    while (1) {
+        pthread_mutex_lock(&mine->mutex);
+        int is_over = fgets(line, sizeof(line), mine->f) == NULL;
+        int line_number = ++mine->n_lines;
+        pthread_mutex_unlock(&mine->mutex);
+        if (is_over) {
+            break;
+        }
+        strip_line_end(line);
+        if (!is_fen_line(line)) {
+            continue;
+        }
+        epd_to_fen(line, fen);
+        if (!is_valid_fen(fen)) {
+            pthread_mutex_lock(&mine->mutex);
+            mine->n_invalid++;
+            pthread_mutex_unlock(&mine->mutex);
+            continue;
+        }
+        reset_buffers();
+        Pos pos = decode_fen(fen);
+        int is_candidate = is_mate_candidate(&pos);
+        int is_puzzle = 0;
+        if (is_candidate) {
+            Color color = pos.active_color;
+            EvalResult *ers = position_val_at_ply(
+                        &pos, mine->ply, &prune_strat_no_pruning, 0, 1);
+            /* A shorter mate makes it a puzzle of another length. */
+            if (
+                is_mate_in(ers[0].val, color, mine->n_mate_moves)
+                && !is_mate_in(ers[0].val, color, mine->n_mate_moves - 1)
+            ) {
+                ers = position_val_at_ply(
+                        &pos, mine->ply, &prune_strat_no_pruning, 0, 2);
+                is_puzzle =
+                    ers[0].line.len == mine->ply
+                    && (pos.moves_len == 1
+                        || !is_mate_in(ers[1].val, color, mine->n_mate_moves));
+                if (is_puzzle) {
+                    format_solution(&ers[0].line, &pos, solution);
+                }
             }
-            move_number++;
         }
-        print_move(move_list_node->move, &pos);
-        printf(" ");
-        if (pos.active_color == COLOR_BLACK) {
-            printf(" ");
+        pthread_mutex_lock(&mine->mutex);
+        mine->n_positions++;
+        mine->n_candidates += is_candidate;
+        mine->n_puzzles += is_puzzle;
+        if (is_puzzle) {
+            printf("Mined from %s, line %d\n%s\n%s\n\n\n",
+                                mine->path, line_number, fen, solution);
+            fflush(stdout);
         }
-        position_after_move(&pos, &move_list_node->move, &new_pos);
-        pos = new_pos;
-        move_list_node = move_list_node->rest;
+        if (mine->n_positions % MINE_PROGRESS_N_POSITIONS == 0) {
+            print_mine_progress(mine);
+        }
+        pthread_mutex_unlock(&mine->mutex);
     }
-    printf("\n");
+    engine_destroy(ctx);
+    ctx = &default_engine;
+    return NULL;
+}
+
+int mine_main(int argc, char **argv) {
+    /* Print the mate puzzles found in a position file; see the comment on
+     * Mine. */
+    Mine mine = { .n_mate_moves = 2 };
+    int n_threads = 1;
+    int is_usage_error = 0;
+    int opt;
+    while ((opt = getopt(argc - 1, argv + 1, "j:n:")) != -1) {
+        if (opt == 'j') {
+            n_threads = atoi(optarg);
+        } else if (opt == 'n') {
+            mine.n_mate_moves = atoi(optarg);
+        } else {
+            is_usage_error = 1;
+            break;
+        }
+    }
+    if (
+        is_usage_error
+        || optind + 1 >= argc
+        || n_threads < 1
+        || mine.n_mate_moves < 1
+        || mine.n_mate_moves > MINE_MAX_MATE_MOVES
+    ) {
+        fprintf(stderr,
+            "Usage: %s mine [-j THREADS] [-n MATE_MOVES] POSITION_FILE\n",
+            argv[0]);
+        return 1;
+    }
+    mine.path = argv[optind + 1];
+    mine.ply = 2 * mine.n_mate_moves - 1;
+    mine.f = fopen(mine.path, "r");
+    if (mine.f == NULL) {
+        fprintf(stderr, "Could not open %s for reading.\n", mine.path);
+        return 1;
+    }
+    pthread_mutex_init(&mine.mutex, NULL);
+    mine.start_time = seconds_now();
+    pthread_t threads[n_threads];
+    for (int i = 0; i < n_threads; i++) {
+        if (pthread_create(&threads[i], NULL, mine_worker, &mine) != 0) {
+            fprintf(stderr, "Could not create thread. Aborting...\n");
+            abort();
+        }
+    }
+    for (int i = 0; i < n_threads; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    fclose(mine.f);
+    pthread_mutex_destroy(&mine.mutex);
+    print_mine_progress(&mine);
+    return 0;
 }
 
-int main() {
+int main(int argc, char **argv) {
+    init_zobrist_keys();
+    init_simd_kernels(NULL);
+    if (init_engine(&default_engine) != 0) {
+        fprintf(stderr, "Could not allocate memory. Aborting...\n");
+        abort();
+    }
+
+    if (argc > 1 && strcmp(argv[1], "solve") == 0) {
+        return solve_main(argc, argv);
+    } else if (argc > 1 && strcmp(argv[1], "pack") == 0) {
+        return pack_main(argc, argv);
+    } else if (argc > 1 && strcmp(argv[1], "unpack") == 0) {
+        return unpack_main(argc, argv);
+    } else if (argc > 1 && strcmp(argv[1], "tbgen") == 0) {
+        return tbgen_main(argc, argv);
+    } else if (argc > 1 && strcmp(argv[1], "book") == 0) {
+        return book_main(argc, argv);
+    } else if (argc > 1 && strcmp(argv[1], "verify") == 0) {
+        return verify_main(argc, argv);
+    } else if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        return bench_main(argc, argv);
+    } else if (argc > 1 && strcmp(argv[1], "tune") == 0) {
+        return tune_main(argc, argv);
+    } else if (argc > 1 && strcmp(argv[1], "nnuetrain") == 0) {
+        return nnuetrain_main(argc, argv);
+    } else if (argc > 1 && strcmp(argv[1], "serve") == 0) {
+        return serve_main(argc, argv);
+    } else if (argc > 1 && strcmp(argv[1], "match") == 0) {
+        return match_main(argc, argv);
+    } else if (argc > 1 && strcmp(argv[1], "mine") == 0) {
+        return mine_main(argc, argv);
+    }
+
+
     char starting_fen[] =
         "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 123 55";
     char fen_mate_in_2[] =
@@ -1208,11 +8744,11 @@ int main() {
     //            printf("%s\n", line);
     //            reset_buffers();
     //            Pos pos = decode_fen(line);
-    //            float ply = 1.5;
-    //            EvalResult *ers = position_val_at_ply(&pos, ply, &prune_strat_no_pruning, 0);
+    //            Ply ply = 3;
+    //            EvalResult *ers = position_val_at_ply(&pos, ply, &prune_strat_no_pruning, 0, 1);
     //            //print_eval_result(&er);
     //            EvalResult er = ers[0];
-    //            print_move_list(er.moves, &pos);
+    //            print_move_list(&er.line, &pos);
     //            printf("\n");
     //            printf("\n");
     //        }
@@ -1226,26 +8762,28 @@ int main() {
     //fclose(f);
 
     Pos pos = decode_fen(fen_entice_queen);
-    float ply = 1.0;
+    Ply ply = 2;
     EvalResult *ers = position_val_at_ply(
-                    &pos, ply, &prune_strat_no_pruning, 1);
-    //Ply plies[] = {0.5};
+                    &pos, ply, &prune_strat_no_pruning, 1, 1);
+    //Ply plies[] = {1};
     //EvalResult *ers = calloc(pos.moves_len, sizeof(EvalResult));
     //if (ers == NULL) {
     //    fprintf(stderr, "Could not allocate memory. Aborting...\n");
     //    abort();
     //}
     //reset_buffers();
-    //position_val_iter_deep(&pos, ers, plies, 1, 0.5);
+    //position_val_iter_deep(&pos, ers, plies, 1, 50);
     EvalResult er = ers[0];
     print_eval_result(&er);
-    print_move_list(er.moves, &pos);
+    print_move_list(&er.line, &pos);
     //free(ers);
 
-    printf("Number of positions explored: %d\n", n_pos_explored);
-    printf("Number of positions made: %d\n", positions_made);
+    printf("Number of positions explored: %d\n", ctx->n_pos_explored);
+    printf("Number of positions made: %d\n", ctx->positions_made);
 
     printf("Done.\n");
     return 0;
 
 }
+
+#endif
@@ -0,0 +1,108 @@
+/* Search the same positions with several engines on as many threads at
+ * once, and check that every thread finds what a single engine found
+ * alone. Lines of the file that are not FENs are those engine_set_position
+ * refuses. Built by run_tests.bash against src/main.c with
+ * -DCWIG_LIBRARY. */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cwig.h"
+
+#define N_THREADS 4
+#define MAX_FENS 64
+#define LINE_MAX_LEN 500
+#define MOVE_MAX_LEN 16
+
+typedef struct Answer {
+    char move[MOVE_MAX_LEN];
+    int score;
+} Answer;
+
+typedef struct Job {
+    char (*fens)[LINE_MAX_LEN];
+    int n_fens;
+    Answer answers[MAX_FENS];
+    int is_failed;
+} Job;
+
+void *search_all(void *arg) {
+    Job *job = arg;
+    Engine *engine = engine_create();
+    if (engine == NULL) {
+        job->is_failed = 1;
+        return NULL;
+    }
+    EngineLimits limits = { .ply = 3, .multi_pv = 1 };
+    for (int i = 0; i < job->n_fens; i++) {
+        if (
+            engine_set_position(engine, job->fens[i]) != 0
+            || engine_search(engine, &limits) != 1
+            || engine_best_move(engine, job->answers[i].move, MOVE_MAX_LEN)
+                                                                        != 0
+        ) {
+            job->is_failed = 1;
+            break;
+        }
+        job->answers[i].score = engine_score(engine, 0);
+    }
+    engine_destroy(engine);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s FEN_FILE\n", argv[0]);
+        return 1;
+    }
+    FILE *f = fopen(argv[1], "r");
+    if (f == NULL) {
+        fprintf(stderr, "Could not open %s for reading.\n", argv[1]);
+        return 1;
+    }
+    static char fens[MAX_FENS][LINE_MAX_LEN];
+    int n_fens = 0;
+    Engine *checker = engine_create();
+    if (checker == NULL) {
+        fprintf(stderr, "Could not allocate memory. Aborting...\n");
+        abort();
+    }
+    while (n_fens < MAX_FENS && fgets(fens[n_fens], LINE_MAX_LEN, f)) {
+        fens[n_fens][strcspn(fens[n_fens], "\r\n")] = '\0';
+        if (engine_set_position(checker, fens[n_fens]) == 0) {
+            n_fens++;
+        }
+    }
+    fclose(f);
+    engine_destroy(checker);
+
+    static Job alone;
+    alone.fens = fens;
+    alone.n_fens = n_fens;
+    search_all(&alone);
+
+    static Job jobs[N_THREADS];
+    pthread_t threads[N_THREADS];
+    for (int t = 0; t < N_THREADS; t++) {
+        jobs[t].fens = fens;
+        jobs[t].n_fens = n_fens;
+        if (pthread_create(&threads[t], NULL, search_all, &jobs[t]) != 0) {
+            fprintf(stderr, "Could not start a thread. Aborting...\n");
+            abort();
+        }
+    }
+    int n_mismatches = 0;
+    for (int t = 0; t < N_THREADS; t++) {
+        pthread_join(threads[t], NULL);
+        for (int i = 0; i < n_fens; i++) {
+            n_mismatches += jobs[t].is_failed
+                || strcmp(jobs[t].answers[i].move, alone.answers[i].move) != 0
+                || jobs[t].answers[i].score != alone.answers[i].score;
+        }
+    }
+    printf("Positions: %d, threads: %d, failed: %d, mismatches: %d\n",
+                        n_fens, N_THREADS, alone.is_failed, n_mismatches);
+    return alone.is_failed || n_mismatches > 0;
+}
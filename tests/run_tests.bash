@@ -0,0 +1,137 @@
+#!/bin/bash
+
+# Build cwig and check some of its behaviour end to end. Exits with 1 if
+# any check fails.
+
+cd "$(dirname "$0")/.."
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+gcc src/main.c -O3 -pthread -lm -o "$tmp/cwig.out" || exit 1
+cwig="$tmp/cwig.out"
+n_failed=0
+
+check() {
+    # check NAME EXPECTED OUTPUT: OUTPUT has to contain EXPECTED.
+    if [[ "$3" == *"$2"* ]]; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1"
+        echo "     expected: $2"
+        echo "     got: $3"
+        n_failed=$((n_failed + 1))
+    fi
+}
+
+# The slashes of "1/2-1/2" must not make a line look like something else
+# than a FEN.
+cat > "$tmp/draws.epd" <<'END'
+rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - c9 "1/2-1/2";
+rnbqkbnr/pppppppp/8/8/4P3/8/PPPP1PPP/RNBQKBNR b KQkq - c9 "1-0";
+END
+check "tune reads draw-annotated EPD lines" "Positions: 2," \
+    "$("$cwig" tune -n 1 "$tmp/draws.epd" "$tmp/weights.txt")"
+
+# parse_san reads the solutions of the puzzles, promotions to a queen and
+# to a knight and moves told apart by their rank included, and each
+# solution mates. Only hxg3+, en passant, which the move generator does
+# not know, cannot be read.
+cat > "$tmp/san.txt" <<'END'
+1rb4r/pkPp3p/1b1P3n/1Q6/N3Pp2/8/P1P3PP/7K w - - 1 0
+1. Qd5+ Ka6 2. cxb8=N#
+k1n3rr/Pp3p2/3q4/3N4/3Pp2p/1Q2P1p1/3B1PP1/R4RK1 w - - 1 0
+1. Qxb7+ Kxb7 2. a8=Q#
+5qrk/5p1n/pp3p1Q/2pPp3/2P1P1rN/2P4R/P5P1/2B3K1 w - - 1 0
+1. Ng6+ R4xg6 2. Qxh7#
+3r2k1/6pp/1nQ1R3/3r4/3N2q1/6N1/n4PPP/4R1K1 w - - 1 0
+1. Re8+ Kf7 2. R1e7#
+END
+check "parse_san reads promotions and disambiguated moves" \
+    "Puzzles: 4, bad solutions: 0," "$("$cwig" verify -p 1 "$tmp/san.txt")"
+check "parse_san reads the solutions of mates_in_2.txt" \
+    "Puzzles: 221, bad solutions: 1," \
+    "$("$cwig" verify -p 1 mates_in_2.txt 2>&1)"
+
+# Positions packed into a record file come back unchanged.
+"$cwig" pack -p 1 mates_in_2.txt "$tmp/records.bin" > /dev/null
+check "packed positions unpack to the same FENs" "same" \
+    "$(diff <("$cwig" unpack "$tmp/records.bin" | cut -d';' -f1) \
+        <(grep -E '^([^ /]+/){7}[^ /]+ [wb] ' mates_in_2.txt \
+            | tr -d '\r' | sed 's/ *$//') > /dev/null && echo same)"
+
+# An evaluation cache that a run stored nothing in still grows, and its
+# records are found again when it is reopened.
+: > "$tmp/empty.txt"
+"$cwig" solve -c "$tmp/cache.evc" "$tmp/empty.txt" > /dev/null
+"$cwig" solve -p 2 -c "$tmp/cache.evc" mates_in_2.txt > /dev/null
+check "a reopened evaluation cache is hit" "Cache hits: 221, misses: 0" \
+    "$("$cwig" solve -p 2 -c "$tmp/cache.evc" mates_in_2.txt)"
+
+# A generated tablebase gives mates beyond the search depth, the same as a
+# deeper search without it.
+mkdir "$tmp/tb"
+check "tbgen generates KRvK" "KRvK: 81920 positions, longest mate 32" \
+    "$("$cwig" tbgen -d "$tmp/tb" KRvK)"
+echo '7k/8/5K2/8/8/8/8/1R6 w - - 0 1' > "$tmp/krk.txt"
+check "a search finds the mate" "1.Kf7 Kh7  2.Rh1#" \
+    "$("$cwig" solve -p 4 "$tmp/krk.txt")"
+check "a tablebase probe finds the mate beyond the depth" \
+    "1.Kf7 Kh7  2.Rh1#" "$("$cwig" solve -p 1 -t "$tmp/tb" "$tmp/krk.txt")"
+
+# A book built from games gives the moves played, weighted by how often.
+cat > "$tmp/games.pgn" <<'END'
+[Event "a"]
+1. e4 e5 2. Nf3 *
+
+[Event "b"]
+1. e4 c5 *
+
+[Event "c"]
+1. d4 d5 *
+END
+echo 'rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1' \
+    > "$tmp/start.txt"
+"$cwig" book "$tmp/games.pgn" "$tmp/games.bin" > /dev/null
+book_output=$("$cwig" solve -b "$tmp/games.bin" "$tmp/start.txt")
+check "a built book has the most played move" "book 66% 1.e4" "$book_output"
+check "a built book has the other move" "book 33% 1.d4" "$book_output"
+
+# Malformed FENs are refused before they reach decode_fen, and the server
+# goes on to answer the next request.
+serve_output=$("$cwig" serve <<'END'
+{"id": 1, "fen": "kppppppppppppp/8/8/8/8/8/8/7K w - - 0 1"}
+{"id": 2, "fen": "8/8/8/8/8/8/8/7K w - - 0 1"}
+{"id": 3, "fen": "k7/8/8/8/8/8/8/K6K w - - 0 1"}
+{"id": 4, "fen": "k7/8/8/8/8/8/8/1KQ5 w - - 0 1", "ply": 2}
+{"id": foo"bar, "fen": "k7/8/8/8/8/8/8/1KQ5 w - - 0 1"}
+END
+)
+check "serve refuses a rank of too many squares" \
+    '{"id": 1, "error": "invalid fen"}' "$serve_output"
+check "serve refuses a position without kings" \
+    '{"id": 2, "error": "invalid fen"}' "$serve_output"
+check "serve refuses a position with two white kings" \
+    '{"id": 3, "error": "invalid fen"}' "$serve_output"
+check "serve answers after refusing" '{"id": 4, "move": ' "$serve_output"
+check "serve refuses a bare value that is not JSON" \
+    '{"error": "request is not a flat JSON object"}' "$serve_output"
+
+# mine skips and counts malformed positions instead of decoding them, and
+# still reads the draw-annotated line after them.
+cat > "$tmp/mine.epd" <<'END'
+kppppppppppppp/8/8/8/8/8/8/7K w - - 0 1
+6k1/5ppp/8/8/8/8/5PPP/R5K1 w - - c9 "1/2-1/2";
+END
+mine_output=$("$cwig" mine -n 1 "$tmp/mine.epd" 2>&1)
+check "mine counts invalid lines" "invalid: 1," "$mine_output"
+check "mine finds the mate of a draw-annotated line" "1. Ra8#" "$mine_output"
+
+# Engines of the library searching on several threads at once find what
+# one engine finds alone.
+gcc -c src/main.c -O3 -DCWIG_LIBRARY -o "$tmp/cwig.o" \
+    && gcc tests/library_test.c "$tmp/cwig.o" -Isrc -O3 -pthread -lm \
+        -o "$tmp/library_test" || exit 1
+check "library engines agree across threads" \
+    "Positions: 64, threads: 4, failed: 0, mismatches: 0" \
+    "$("$tmp/library_test" mates_in_2.txt)"
+
+exit $((n_failed > 0))